@@ -15,9 +15,11 @@
 #include "state.h"
 #include "shared.h"
 #include "db_updater.h"
+#include "trace.h"
+#include "metrics.h"
 
 static const char *progname;
-static const char *pidfile, *merlin_user;
+static const char *pidfile, *merlin_user, *metrics_spec;
 static merlin_confsync csync;
 static int killing;
 static int user_sig;
@@ -65,6 +67,10 @@ static void grok_daemon_compound(struct cfg_comp *comp)
 			merlin_user = strdup(v->value);
 			continue;
 		}
+		if (!strcmp(v->key, "metrics_listen")) {
+			metrics_spec = strdup(v->value);
+			continue;
+		}
 		if (!strcmp(v->key, "import_program")) {
 			/* ignored */
 			lwarn("daemon config: import_program is deprecated and no longer used");
@@ -163,6 +169,40 @@ static int handle_ipc_event(merlin_event *pkt)
 	return mrm_db_update(&ipc, pkt);
 }
 
+#define filter_want(f, type, mask) do { \
+		(f)->types |= 1ULL << (type); \
+		(f)->nebattr[type] = mask; \
+	} while (0)
+
+/*
+ * Tell the module which events we'll actually store, so it needn't
+ * encode and send the rest. This must match what mrm_db_update()
+ * and the handlers it calls make use of.
+ */
+static void ipc_send_filter(void)
+{
+	struct merlin_ipc_filter f;
+	uint32_t alerts = 0;
+
+	memset(&f, 0, sizeof(f));
+	if (use_database && db_log_reports) {
+		filter_want(&f, NEBCALLBACK_PROCESS_DATA, 0);
+		filter_want(&f, NEBCALLBACK_DOWNTIME_DATA, 0);
+		filter_want(&f, NEBCALLBACK_FLAPPING_DATA, 0);
+		alerts = NEBATTR_CHECK_ALERT | NEBATTR_CHECK_FIRST;
+	}
+	if (use_database && db_log_notifications)
+		filter_want(&f, NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA, 0);
+
+	/* performance data is logged for every check, state change or not */
+	if (use_database && (alerts || host_perf_table))
+		filter_want(&f, NEBCALLBACK_HOST_CHECK_DATA, host_perf_table ? 0 : alerts);
+	if (use_database && (alerts || service_perf_table))
+		filter_want(&f, NEBCALLBACK_SERVICE_CHECK_DATA, service_perf_table ? 0 : alerts);
+
+	node_ctrl(&ipc, CTRL_FILTER, CTRL_GENERIC, &f, sizeof(f));
+}
+
 static int ipc_reap_events(void)
 {
 	int len, events = 0;
@@ -191,6 +231,8 @@ static int ipc_reap_events(void)
 				}
 				node_set_state(&ipc, STATE_CONNECTED, "Connected");
 				memcpy(&ipc.info, pkt->body, sizeof(ipc.info));
+				ipc_send_filter();
+				ipc_ring_offer();
 				break;
 
 			case CTRL_INACTIVE:
@@ -208,10 +250,32 @@ static int ipc_reap_events(void)
 	return 0;
 }
 
+/*
+ * Events the module wrote to shared memory are handled where they
+ * are. The ring goes away once the module has disconnected and
+ * we've read what it left in there.
+ */
+static int ipc_reap_ring(void)
+{
+	int events = 0;
+	merlin_event *pkt;
+
+	while ((pkt = ipc_ring_get_event())) {
+		events++;
+		handle_ipc_event(pkt);
+		ipc_ring_release();
+	}
+
+	if (ipc.sock < 0)
+		ipc_ring_close();
+
+	return events;
+}
+
 static int io_poll_sockets(void)
 {
 	fd_set rd, wr;
-	int sel_val, ipc_listen_sock, nfound;
+	int sel_val, ipc_listen_sock, metrics_listen_sock, metrics_max_fd, ring_fd, nfound;
 	int sockets = 0;
 	struct timeval tv = { 2, 0 };
 	static time_t last_ipc_reinit = 0;
@@ -226,7 +290,11 @@ static int io_poll_sockets(void)
 	}
 
 	ipc_listen_sock = ipc_listen_sock_desc();
+	metrics_listen_sock = metrics_sock_desc();
+	ring_fd = ipc_ring_desc();
 	sel_val = max(ipc.sock, ipc_listen_sock);
+	sel_val = max(sel_val, metrics_listen_sock);
+	sel_val = max(sel_val, ring_fd);
 
 	FD_ZERO(&rd);
 	FD_ZERO(&wr);
@@ -234,6 +302,16 @@ static int io_poll_sockets(void)
 		FD_SET(ipc.sock, &rd);
 	if (ipc_listen_sock >= 0)
 		FD_SET(ipc_listen_sock, &rd);
+	if (metrics_listen_sock >= 0)
+		FD_SET(metrics_listen_sock, &rd);
+	metrics_max_fd = metrics_set_fds(&rd, &wr);
+	sel_val = max(sel_val, metrics_max_fd);
+	if (ring_fd >= 0) {
+		FD_SET(ring_fd, &rd);
+		/* the module only wakes us up if we say we're sleeping */
+		if (ipc_ring_prepare_wait())
+			tv.tv_sec = 0;
+	}
 
 	if (sel_val < 0)
 		return 0;
@@ -252,9 +330,33 @@ static int io_poll_sockets(void)
 		ipc_reap_events();
 	}
 
+	/* after the socket, so we see what was written before a disconnect */
+	if (ring_fd >= 0 && FD_ISSET(ring_fd, &rd))
+		ipc_ring_woken();
+	ipc_reap_ring();
+
+	metrics_poll_clients(&rd, &wr);
+	if (metrics_listen_sock >= 0 && FD_ISSET(metrics_listen_sock, &rd))
+		metrics_accept();
+
 	return 0;
 }
 
+static void metrics_init(void)
+{
+	metrics_register("merlin_sql_pending_queries", "Queries run but not yet committed",
+	                 METRIC_GAUGE, sql_pending_queries);
+	metrics_register("merlin_sql_queries", "Queries run against the database",
+	                 METRIC_COUNTER, sql_total_queries);
+	metrics_register("merlin_sql_commits", "Transactions committed to the database",
+	                 METRIC_COUNTER, sql_num_commits);
+	metrics_register_summary("merlin_sql_commit_seconds", "Time spent committing transactions",
+	                         &sql_commit_time);
+
+	if (metrics_spec && metrics_listen(metrics_spec) < 0)
+		lwarn("Failed to start metrics listener. Metrics will not be available");
+}
+
 static void dump_daemon_nodes(void)
 {
 	int fd;
@@ -313,7 +415,10 @@ static void clean_exit(int sig)
 	}
 
 	ipc_deinit();
+	metrics_close();
+	ipc_ring_close();
 	sql_close();
+	trace_deinit();
 	log_deinit();
 	daemon_shutdown();
 
@@ -424,6 +529,9 @@ int merlind_main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 
+		/* the log writer thread didn't survive the fork */
+		log_init();
+
 		/*
 		 * we'll leak these file-descriptors, but that
 		 * doesn't really matter as we just want accidental
@@ -436,6 +544,7 @@ int merlind_main(int argc, char **argv)
 		fclose(stderr);
 		open("/dev/null", O_WRONLY);
 	}
+	trace_init();
 
 	signal(SIGINT, merlind_sighandler);
 	signal(SIGTERM, merlind_sighandler);
@@ -443,6 +552,7 @@ int merlind_main(int argc, char **argv)
 	signal(SIGUSR2, sigusr_handler);
 
 	sql_init();
+	metrics_init();
 	state_init();
 	linfo("Merlin daemon " PACKAGE_VERSION " successfully initialized");
 	polling_loop();
@@ -3,6 +3,7 @@
 #include "ipc.h"
 #include "sql.h"
 #include "configuration.h"
+#include "trace.h"
 #include <naemon/naemon.h>
 
 
@@ -326,6 +327,9 @@ int mrm_db_update(merlin_node *node, merlin_event *pkt)
 		return 0;
 	}
 
+	/* must be done before decoding, which changes the body */
+	trace_event(TRACE_DB_UPDATE, node, pkt);
+
 	if (merlin_decode_event(node, pkt)) {
 		return 0;
 	}
@@ -12,6 +12,9 @@ int sql_table_crashed = 0;
 static long int commit_interval, commit_queries;
 static time_t last_commit;
 unsigned long total_queries = 0;
+static unsigned long pending_queries;
+static unsigned long long num_commits;
+merlin_histogram sql_commit_time;
 static int db_type;
 
 #define MERLIN_DBT_MYSQL 0
@@ -123,35 +126,53 @@ db_wrap_result * sql_get_result(void)
 
 void sql_try_commit(int query)
 {
-	static int queries;
 	time_t now = time(NULL);
+	unsigned long long start;
 
 	if (!db.conn || !use_database || !db.conn->api->commit)
 		return;
 
 	if (query > 0)
-		queries += query;
+		pending_queries += query;
 
-	if (queries &&
+	if (pending_queries &&
 	    (query == -1 ||
 	     (commit_interval && last_commit + commit_interval <= now) ||
-	     (commit_queries && queries >= commit_queries)
+	     (commit_queries && pending_queries >= (unsigned long)commit_queries)
 	    )
 	   )
 	{
-		ldebug("Committing %d queries", queries);
+		ldebug("Committing %lu queries", pending_queries);
 		/*
 		 * we ignore the return value here, as each db
 		 * seems to return a different code on success
 		 * and failure. Bleh...
 		 */
+		start = histogram_clock();
 		(void)db.conn->api->commit(db.conn);
+		histogram_add(&sql_commit_time, histogram_clock() - start);
+		num_commits++;
 		last_commit = now;
-		total_queries += queries;
-		queries = 0;
+		total_queries += pending_queries;
+		pending_queries = 0;
 	}
 }
 
+unsigned long long sql_pending_queries(void)
+{
+	return pending_queries;
+}
+
+unsigned long long sql_total_queries(void)
+{
+	return total_queries + pending_queries;
+}
+
+unsigned long long sql_num_commits(void)
+{
+	return num_commits;
+}
+
 static int run_query(char *query, size_t len)
 {
 	db_wrap_result *res = NULL;
@@ -3,10 +3,12 @@
 
 #include <stdarg.h>
 #include "db_wrap.h"
+#include "histogram.h"
 
 extern char *host_perf_table;
 extern char *service_perf_table;
 extern unsigned long total_queries;
+extern merlin_histogram sql_commit_time;
 extern int sql_table_crashed;
 
 /*typedef dbi_result SQL_RESULT;*/
@@ -26,6 +28,9 @@ extern int sql_query(const char *fmt, ...)
 extern int sql_vquery(const char *fmt, va_list ap);
 extern db_wrap_result * sql_get_result(void);
 extern void sql_try_commit(int query);
+extern unsigned long long sql_pending_queries(void);
+extern unsigned long long sql_total_queries(void);
+extern unsigned long long sql_num_commits(void);
 extern const char *sql_table_name(void);
 extern const char *sql_db_name(void);
 extern const char *sql_db_user(void);
@@ -106,6 +106,23 @@ Feature: Module handles network and connections
 			| filter_var | filter_val | match_var   | match_val       |
 			| name       | my_master  | state       | STATE_CONNECTED |
 
+	Scenario: The module connects to many pollers at once
+		Given I start naemon with 200 simulated pollers listening from port 4200
+		Then all 200 simulated pollers are connected to merlin within 15 seconds
+		And ipc is connected to merlin
+
+		When all 200 simulated pollers send CTRL_ACTIVE
+		Then all 200 simulated pollers received CTRL_ACTIVE
+		And I wait for 1 second
+		And all 200 simulated pollers appear connected
+
+		# longer than the connect and handshake timeout, which must not
+		# apply to nodes that have finished their handshake
+		When I wait for 21 seconds
+		Then all 200 simulated pollers appear connected
+		And file merlin.log does not match timed out after
+		And file merlin.log does not match NODESTATE: poller-[0-9]+: .* -> STATE_NONE
+
 	Scenario: The module listens to peers
 		Given I have merlin configured for port 7000
 			| type | name    | port |
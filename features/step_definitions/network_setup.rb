@@ -60,4 +60,55 @@ Given(/^I start naemon with merlin nodes connected$/) do |nodes|
     step "#{obj["name"]} received event CTRL_ACTIVE"
     step "#{obj["name"]} is connected to merlin"
   end
-end
\ No newline at end of file
+end
+
+# Starts naemon configured with a number of pollers, simulated by merlincat,
+# each listening on a port of its own, counting up from the given one.
+Given(/^I start naemon with (\d+) simulated pollers listening from port (\d+)$/) do |count, port|
+  nodes = [["type", "name", "port", "hostgroups"]]
+  count.to_i.times do |i|
+    nodes << ["poller", "poller-#{i}", (port.to_i + i).to_s, "emptygroup"]
+  end
+  step "I have merlin configured for port 7000", Cucumber::Ast::Table.new(nodes)
+  step "ipc listens for merlin at socket test_ipc.sock"
+  count.to_i.times do |i|
+    step "poller-#{i} listens for merlin at port #{port.to_i + i}"
+  end
+  @naemon_started = Time.now
+  step "I start naemon"
+end
+
+Then(/^all (\d+) simulated pollers are connected to merlin within (\d+) seconds$/) do |count, limit|
+  count.to_i.times do |i|
+    step "poller-#{i} is connected to merlin"
+  end
+  elapsed = Time.now - @naemon_started
+  puts "all #{count} pollers connected after #{"%.2f" % elapsed} seconds"
+  fail "took #{"%.2f" % elapsed} seconds, limit is #{limit}" if elapsed > limit.to_i
+end
+
+# Completes the handshake from every simulated poller. They all share one
+# hostgroup, so each of them has all the others as peers.
+When(/^all (\d+) simulated pollers send CTRL_ACTIVE$/) do |count|
+  count.to_i.times do |i|
+    step "node poller-#{i} have info hash my_hash at 3000"
+    step "node poller-#{i} have expected hash my_hash at 4000"
+    step "poller-#{i} sends event CTRL_ACTIVE", Cucumber::Ast::Table.new([
+      ["configured_peers", (count.to_i - 1).to_s],
+      ["configured_pollers", "0"],
+      ["configured_masters", "1"]
+    ])
+  end
+end
+
+Then(/^all (\d+) simulated pollers received CTRL_ACTIVE$/) do |count|
+  count.to_i.times do |i|
+    step "poller-#{i} received event CTRL_ACTIVE"
+  end
+end
+
+Then(/^all (\d+) simulated pollers appear connected$/) do |count|
+  count.to_i.times do |i|
+    step "poller-#{i} should appear connected"
+  end
+end
@@ -0,0 +1,188 @@
+/*
+ * An index of all comments keyed by host, service, entry time and
+ * author, so comment deletions received from the network can find
+ * their local comment without walking the whole comment list.
+ *
+ * Comment ids aren't in sync between nodes, so we can't use them
+ * for this, but the index maps to local ids which we hand to
+ * find_comment() when we need the comment itself.
+ */
+#include "comment-index.h"
+#include "logging.h"
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+static GHashTable *cmnt_index;
+static unsigned int cmnt_index_size;
+static int cmnt_index_registered;
+
+static uint32_t hash_str(uint32_t h, const char *s)
+{
+	if (!s)
+		return h * 16777619;
+
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619;
+	}
+	/* separate the strings so "ab" + "c" differs from "a" + "bc" */
+	return (h ^ 0xff) * 16777619;
+}
+
+static gpointer index_key(const char *host_name, const char *service_description,
+                          time_t entry_time, const char *author)
+{
+	uint32_t h = 2166136261U;
+	uint64_t t = (uint64_t)entry_time;
+	unsigned int i;
+
+	h = hash_str(h, host_name);
+	h = hash_str(h, service_description);
+	h = hash_str(h, author);
+	for (i = 0; i < sizeof(t); i++) {
+		h ^= (t >> (i * 8)) & 0xff;
+		h *= 16777619;
+	}
+
+	return GUINT_TO_POINTER(h);
+}
+
+static void index_add(gpointer key, unsigned long comment_id, int comment_type)
+{
+	struct comment_ref *ref, *head;
+
+	ref = malloc(sizeof(*ref));
+	if (!ref) {
+		lerr("Failed to allocate memory for comment index");
+		return;
+	}
+	ref->comment_id = comment_id;
+	ref->comment_type = comment_type;
+	head = g_hash_table_lookup(cmnt_index, key);
+	ref->next = head;
+	g_hash_table_insert(cmnt_index, key, ref);
+	cmnt_index_size++;
+}
+
+void comment_index_add(nebstruct_comment_data *ds)
+{
+	if (!cmnt_index)
+		return;
+	index_add(index_key(ds->host_name, ds->service_description, ds->entry_time, ds->author_name),
+	          ds->comment_id, ds->comment_type);
+}
+
+void comment_index_remove(nebstruct_comment_data *ds)
+{
+	struct comment_ref *ref, *prev = NULL, *head;
+	gpointer key;
+
+	if (!cmnt_index)
+		return;
+
+	key = index_key(ds->host_name, ds->service_description, ds->entry_time, ds->author_name);
+	head = g_hash_table_lookup(cmnt_index, key);
+	for (ref = head; ref; prev = ref, ref = ref->next) {
+		if (ref->comment_id != ds->comment_id || ref->comment_type != ds->comment_type)
+			continue;
+
+		if (prev)
+			prev->next = ref->next;
+		else if (ref->next)
+			g_hash_table_insert(cmnt_index, key, ref->next);
+		else
+			g_hash_table_remove(cmnt_index, key);
+		free(ref);
+		cmnt_index_size--;
+		return;
+	}
+}
+
+/*
+ * Returns all comments with the same key as *ds. The caller may
+ * delete the comment it's looking at (which removes it from the
+ * index), as long as it grabs ref->next first.
+ */
+struct comment_ref *comment_index_lookup(nebstruct_comment_data *ds)
+{
+	if (!cmnt_index)
+		return NULL;
+	return g_hash_table_lookup(cmnt_index,
+		index_key(ds->host_name, ds->service_description, ds->entry_time, ds->author_name));
+}
+
+unsigned int comment_index_size(void)
+{
+	return cmnt_index_size;
+}
+
+/*
+ * Every comment, no matter where it comes from, ends up in
+ * add_comment(), which sends a NEBTYPE_COMMENT_LOAD event, and
+ * every deleted comment generates a NEBTYPE_COMMENT_DELETE event,
+ * so these two are all we need to keep the index in sync. This
+ * runs separately from merlin_mod_hook() so the index is kept even
+ * when comment events are filtered out.
+ */
+static int comment_index_hook(__attribute__((unused)) int cb, void *data)
+{
+	nebstruct_comment_data *ds = (nebstruct_comment_data *)data;
+
+	if (ds->type == NEBTYPE_COMMENT_LOAD)
+		comment_index_add(ds);
+	else if (ds->type == NEBTYPE_COMMENT_DELETE)
+		comment_index_remove(ds);
+
+	return 0;
+}
+
+static void free_chain(__attribute__((unused)) gpointer key, gpointer value,
+                       __attribute__((unused)) gpointer user_data)
+{
+	struct comment_ref *ref, *next;
+
+	for (ref = value; ref; ref = next) {
+		next = ref->next;
+		free(ref);
+	}
+}
+
+int comment_index_init(void *neb_handle)
+{
+	comment *cmnt;
+
+	/*
+	 * no destroy function, since replacing the head of a chain
+	 * would free the whole chain. deinit frees them instead.
+	 */
+	cmnt_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cmnt_index_size = 0;
+
+	/* comments added before we were loaded won't generate events */
+	for (cmnt = comment_list; cmnt; cmnt = cmnt->next) {
+		index_add(index_key(cmnt->host_name, cmnt->service_description, cmnt->entry_time, cmnt->author),
+		          cmnt->comment_id, cmnt->comment_type);
+	}
+
+	if (!neb_handle)
+		return 0;
+	if (neb_register_callback(NEBCALLBACK_COMMENT_DATA, neb_handle, 0, comment_index_hook))
+		return -1;
+	cmnt_index_registered = 1;
+	return 0;
+}
+
+void comment_index_deinit(void)
+{
+	if (!cmnt_index)
+		return;
+
+	if (cmnt_index_registered)
+		neb_deregister_callback(NEBCALLBACK_COMMENT_DATA, comment_index_hook);
+	cmnt_index_registered = 0;
+	g_hash_table_foreach(cmnt_index, free_chain, NULL);
+	g_hash_table_destroy(cmnt_index);
+	cmnt_index = NULL;
+	cmnt_index_size = 0;
+}
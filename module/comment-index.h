@@ -0,0 +1,23 @@
+#ifndef INCLUDE_comment_index_h__
+#define INCLUDE_comment_index_h__
+#include <naemon/naemon.h>
+
+/*
+ * All comments sharing one index key. Only the key is compared, so
+ * callers must still make sure the comment they get is the one
+ * they're looking for.
+ */
+struct comment_ref {
+	unsigned long comment_id;
+	int comment_type;
+	struct comment_ref *next;
+};
+
+int comment_index_init(void *neb_handle);
+void comment_index_deinit(void);
+void comment_index_add(nebstruct_comment_data *ds);
+void comment_index_remove(nebstruct_comment_data *ds);
+struct comment_ref *comment_index_lookup(nebstruct_comment_data *ds);
+unsigned int comment_index_size(void);
+
+#endif
@@ -0,0 +1,1089 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "module.h"
+#include "shared.h"
+#include "logging.h"
+#include "configuration.h"
+#include "misc.h"
+#include "sha1.h"
+#include "oconfsplit.h"
+#include "script-helpers.h"
+#include "csync.h"
+
+#define CSYNC_CHUNK (8 << 10)       /* file data per DATA message */
+#define CSYNC_WINDOW (1 << 20)      /* data sent but not yet acked */
+#define CSYNC_ACK_EVERY (256 << 10) /* the receiver acks this often */
+#define CSYNC_MAX_FILES (1 << 20)
+#define CSYNC_TIMEOUT 60            /* give up after this long without input */
+#define CSYNC_CHECK_INTERVAL 5      /* how often we check the session is alive */
+#define CSYNC_DEFAULT_RELOAD "mon oconf reload"
+#define CSYNC_POLLER_OCONF "oconf/from-master.cfg"
+
+struct csync_file {
+	char *name;    /* as sent, relative to config_file_dir */
+	char *path;    /* where we read it from, or where it ends up */
+	char *tmp;     /* (receiver) where it's written until we're done */
+	uint64_t size;
+	uint32_t mode;
+	unsigned char sha1[20];
+	uint64_t done; /* bytes sent or received so far */
+	int fd;
+	blk_SHA_CTX ctx;
+};
+
+/* a message waiting for the socket to become writable */
+struct csync_out {
+	struct csync_out *next;
+	uint32_t size;
+	char buf[];
+};
+
+struct csync_session {
+	uint32_t id;
+	int pushing;
+	int sock;         /* the connection the session runs on */
+	int ok;           /* (pusher) the receiver got everything */
+	int wfd;          /* dup() of sock, polled for writability */
+	int woken;        /* the socket was writable, but nothing fit */
+	struct csync_out *out_head, *out_tail;
+	unsigned int num_files, alloc_files;
+	struct csync_file *files;
+	unsigned int num_want, next_want;
+	uint32_t *want;   /* indexes of the files that are sent, in order */
+	int want_done;    /* (pusher) we've seen the last WANT message */
+	int done_sent;
+	uint64_t total;   /* bytes sent or received */
+	uint64_t acked;   /* bytes acked by (or to) the pusher */
+	time_t last_input;
+	struct timeval start;
+	struct timed_event *retry;
+	struct timed_event *timeout;
+};
+
+/*
+ * Digests of the files we've hashed, keyed by path. A file is only
+ * rehashed if its stat() info changes, so repeated syncs don't have
+ * to read the entire config every time.
+ */
+struct csync_digest {
+	uint64_t dev, ino, size;
+	uint64_t mtime, mtime_nsec;
+	uint64_t ctime, ctime_nsec;
+	unsigned char sha1[20];
+};
+#define DIGEST_KEY_SIZE offsetof(struct csync_digest, sha1)
+
+static GHashTable *digests;
+
+/* outgoing messages are built here */
+static union {
+	struct csync_msg msg;
+	char buf[sizeof(((merlin_event *)0)->body)];
+} out;
+/*
+ * No message we send is larger than this, so each of them fits in
+ * a socket's send buffer at its smallest (16KiB on Linux)
+ */
+#define CSYNC_MSG_MAX (sizeof(struct csync_msg) + CSYNC_CHUNK)
+
+int csync_is_native(const char *cmd)
+{
+	return cmd && !strcmp(cmd, "native");
+}
+
+static int csync_file_sha1(const char *path, const struct stat *st, unsigned char *sha1)
+{
+	struct csync_digest key, *d;
+	blk_SHA_CTX ctx;
+
+	memset(&key, 0, sizeof(key));
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+	key.size = st->st_size;
+	key.mtime = st->st_mtim.tv_sec;
+	key.mtime_nsec = st->st_mtim.tv_nsec;
+	key.ctime = st->st_ctim.tv_sec;
+	key.ctime_nsec = st->st_ctim.tv_nsec;
+
+	if (!digests)
+		digests = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+	d = g_hash_table_lookup(digests, path);
+	if (d && !memcmp(d, &key, DIGEST_KEY_SIZE)) {
+		memcpy(sha1, d->sha1, sizeof(d->sha1));
+		return 0;
+	}
+
+	blk_SHA1_Init(&ctx);
+	if (hash_add_file(path, &ctx) < 0)
+		return -1;
+	blk_SHA1_Final(key.sha1, &ctx);
+	memcpy(sha1, key.sha1, sizeof(key.sha1));
+
+	if (!d) {
+		d = malloc(sizeof(*d));
+		if (!d)
+			return 0;
+		g_hash_table_insert(digests, strdup(path), d);
+	}
+	*d = key;
+	return 0;
+}
+
+static struct csync_msg *csync_msg(uint32_t op, uint32_t session)
+{
+	memset(&out.msg, 0, sizeof(out.msg));
+	out.msg.op = op;
+	out.msg.session = session;
+	return &out.msg;
+}
+
+static void csync_retry(struct nm_event_execution_properties *evprop);
+static void csync_resume(merlin_node *node);
+
+/*
+ * True if a message of "size" bytes fits in the socket's send
+ * buffer right now, so node_ctrl() can't come up short and stall
+ * in io_send_all(). POLLOUT only says there's some room, which is
+ * why we ask for the buffer size and what's in it instead.
+ */
+static int csync_fits(merlin_node *node, uint32_t size)
+{
+	int sndbuf = 0, outq = 0;
+	socklen_t len = sizeof(sndbuf);
+
+	if (getsockopt(node->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0)
+		return 0;
+	if (ioctl(node->sock, SIOCOUTQ, &outq) < 0)
+		return 0;
+
+	/* node_ctrl() sends events waiting to be batched first */
+	size += HDR_SIZE;
+	if (node->coalesce_len)
+		size += HDR_SIZE + node->coalesce_len;
+
+	return sndbuf - outq >= (int)size;
+}
+
+/* iobroker calls this once when the socket is writable */
+static int csync_writable(int sd, int events, void *node_)
+{
+	merlin_node *node = (merlin_node *)node_;
+	struct csync_session *s = node->csync_session;
+
+	iobroker_close(nagios_iobs, sd);
+	if (!s || s->wfd != sd)
+		return 0;
+	s->wfd = -1;
+	s->woken = 1;
+	csync_resume(node);
+	if (node->csync_session)
+		node->csync_session->woken = 0;
+	return 0;
+}
+
+/*
+ * Gets csync_resume() called once there's room on the socket. The
+ * node's socket is already registered for input, so we poll a dup()
+ * of it for output. If the socket was writable but the next message
+ * still didn't fit, we wait a second instead, so we don't spin while
+ * the other end acks what's in the buffer.
+ */
+static void csync_wait_writable(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+
+	if (s->wfd >= 0 || s->retry)
+		return;
+
+	if (!s->woken && (s->wfd = dup(node->sock)) >= 0) {
+		if (!iobroker_register_out(nagios_iobs, s->wfd, node, csync_writable))
+			return;
+		close(s->wfd);
+		s->wfd = -1;
+	}
+	s->retry = schedule_event(1, csync_retry, node);
+}
+
+/*
+ * Sends a message without waiting for the socket, since we're in
+ * naemon's event loop. Messages that don't fit in the socket's send
+ * buffer right now are queued on the session, in order, and sent
+ * once it has room. Without a session there's nothing to queue them
+ * on, so the node is disconnected instead, and the other end sees
+ * the sync fail at once. Returns -1 if the node is (or got)
+ * disconnected, which also frees the session.
+ */
+static int csync_send(merlin_node *node, struct csync_msg *msg)
+{
+	struct csync_session *s = node->csync_session;
+	uint32_t size = sizeof(*msg) + msg->len;
+	struct csync_out *o;
+
+	if (node->sock < 0)
+		return -1;
+
+	if ((!s || !s->out_head) && csync_fits(node, size)) {
+		/* on failure the node is disconnected, which frees the session */
+		if (node_ctrl(node, CTRL_CSYNC, 0, msg, size) <= 0)
+			return -1;
+		if (s)
+			s->woken = 0;
+		return 0;
+	}
+
+	if (!s || !(o = malloc(sizeof(*o) + size))) {
+		node_disconnect(node, "Native config sync: Failed to queue message");
+		return -1;
+	}
+	o->next = NULL;
+	o->size = size;
+	memcpy(o->buf, msg, size);
+	if (s->out_tail)
+		s->out_tail->next = o;
+	else
+		s->out_head = o;
+	s->out_tail = o;
+	csync_wait_writable(node);
+	return 0;
+}
+
+/* sends queued messages for as long as they fit */
+static int csync_flush(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+
+	while (s->out_head && node->sock >= 0 && csync_fits(node, s->out_head->size)) {
+		struct csync_out *o = s->out_head;
+		int ret;
+
+		s->out_head = o->next;
+		if (!s->out_head)
+			s->out_tail = NULL;
+		/* on failure the node is disconnected, which frees the session */
+		ret = node_ctrl(node, CTRL_CSYNC, 0, o->buf, o->size);
+		free(o);
+		if (ret <= 0)
+			return -1;
+		s->woken = 0;
+	}
+	return 0;
+}
+
+/*
+ * Frees the session. If we were pushing, the push is over, so the
+ * next queued one can start.
+ */
+static void csync_session_free(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+	unsigned long long total;
+	unsigned int i;
+	int pushing, ok;
+
+	if (!s)
+		return;
+
+	if (s->retry)
+		destroy_event(s->retry);
+	if (s->wfd >= 0)
+		iobroker_close(nagios_iobs, s->wfd);
+	if (s->timeout)
+		destroy_event(s->timeout);
+	for (i = 0; i < s->num_files; i++) {
+		struct csync_file *f = &s->files[i];
+
+		if (f->fd >= 0)
+			close(f->fd);
+		if (f->tmp) {
+			unlink(f->tmp);
+			free(f->tmp);
+		}
+		free(f->name);
+		free(f->path);
+	}
+	while (s->out_head) {
+		struct csync_out *o = s->out_head;
+		s->out_head = o->next;
+		free(o);
+	}
+	pushing = s->pushing;
+	ok = s->ok;
+	total = s->total;
+	free(s->files);
+	free(s->want);
+	free(s);
+	node->csync_session = NULL;
+
+	if (pushing)
+		csync_push_done(node, ok, total);
+}
+
+static void csync_push_finished(merlin_node *node, int ok)
+{
+	if (!node->csync_session)
+		return;
+	node->csync_session->ok = ok;
+	csync_session_free(node);
+}
+
+void csync_native_abort(merlin_node *node, const char *reason)
+{
+	if (!node->csync_session)
+		return;
+
+	lwarn("CSYNC: %s %s: Native %s aborted: %s", node_type(node), node->name,
+	      node->csync_session->pushing ? "push" : "fetch", reason);
+	csync_push_finished(node, 0);
+}
+
+/*
+ * Ends the session after an error. The receiver tells the pusher,
+ * which disconnects so the nodes negotiate from scratch.
+ */
+static void csync_fail(merlin_node *node, int err, const char *fmt, ...)
+{
+	struct csync_session *s = node->csync_session;
+	struct csync_msg *msg;
+	char *reason;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(&reason, fmt, ap) < 0)
+		reason = NULL;
+	va_end(ap);
+
+	lerr("CSYNC: %s %s: Native %s failed: %s", node_type(node), node->name,
+	     s && s->pushing ? "push" : "fetch", reason ? reason : fmt);
+	free(reason);
+
+	if (!s || s->pushing) {
+		csync_push_finished(node, 0);
+		node_disconnect(node, "Native config sync failed");
+		return;
+	}
+
+	msg = csync_msg(CSYNC_RESULT, s->id);
+	msg->flags = err ? err : EIO;
+	csync_session_free(node);
+	csync_send(node, msg);
+}
+
+static void csync_timeout(struct nm_event_execution_properties *evprop)
+{
+	merlin_node *node = (merlin_node *)evprop->user_data;
+	struct csync_session *s;
+
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+		return;
+
+	s = node->csync_session;
+	if (!s)
+		return;
+	s->timeout = NULL;
+
+	/* in case nothing told us the connection went away */
+	if (node->sock < 0 || node->sock != s->sock) {
+		csync_native_abort(node, "Connection lost");
+		return;
+	}
+	if (s->last_input + CSYNC_TIMEOUT <= time(NULL)) {
+		csync_fail(node, ETIMEDOUT, "Nothing heard from %s for %d seconds", node->name, CSYNC_TIMEOUT);
+		return;
+	}
+	s->timeout = schedule_event(CSYNC_CHECK_INTERVAL, csync_timeout, node);
+}
+
+static struct csync_session *csync_session_new(merlin_node *node, uint32_t id, int pushing)
+{
+	struct csync_session *s;
+
+	csync_native_abort(node, "A new session was started");
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	gettimeofday(&s->start, NULL);
+	s->id = id;
+	s->pushing = pushing;
+	s->sock = node->sock;
+	s->wfd = -1;
+	s->last_input = s->start.tv_sec;
+	s->timeout = schedule_event(CSYNC_CHECK_INTERVAL, csync_timeout, node);
+	node->csync_session = s;
+	return s;
+}
+
+static struct csync_file *csync_file_add(struct csync_session *s, const char *name, const char *path)
+{
+	struct csync_file *f;
+
+	if (s->num_files >= CSYNC_MAX_FILES)
+		return NULL;
+
+	if (s->num_files == s->alloc_files) {
+		unsigned int alloc = s->alloc_files ? s->alloc_files * 2 : 64;
+		struct csync_file *files = realloc(s->files, alloc * sizeof(*files));
+		if (!files)
+			return NULL;
+		s->files = files;
+		s->alloc_files = alloc;
+	}
+
+	f = &s->files[s->num_files];
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+	f->name = strdup(name);
+	f->path = strdup(path);
+	if (!f->name || !f->path) {
+		free(f->name);
+		free(f->path);
+		return NULL;
+	}
+	s->num_files++;
+	return f;
+}
+
+static int csync_want_add(struct csync_session *s, uint32_t idx)
+{
+	uint32_t *want;
+
+	if (idx >= s->num_files || s->num_want >= s->num_files)
+		return -1;
+	if (!s->want) {
+		want = malloc(s->num_files * sizeof(*want));
+		if (!want)
+			return -1;
+		s->want = want;
+	}
+	s->want[s->num_want++] = idx;
+	return 0;
+}
+
+/*
+ * pusher side
+ */
+static int csync_push_file(struct csync_session *s, const char *name, const char *path,
+                           const unsigned char *sha1)
+{
+	struct csync_file *f;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		lerr("CSYNC: Failed to stat() %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (!(f = csync_file_add(s, name, path))) {
+		lerr("CSYNC: Failed to add %s to the manifest", path);
+		return -1;
+	}
+	f->size = st.st_size;
+	f->mode = st.st_mode & 0777;
+	if (sha1) {
+		memcpy(f->sha1, sha1, sizeof(f->sha1));
+	} else if (csync_file_sha1(path, &st, f->sha1) < 0) {
+		lerr("CSYNC: Failed to hash %s: %s", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pollers get the config oconfsplit wrote for them. split_config()
+ * already hashed it, since that's the config hash we expect the
+ * poller to have, so we don't read it again here.
+ */
+static int csync_add_poller_config(struct csync_session *s, merlin_node *node)
+{
+	static const unsigned char no_hash[20];
+	const unsigned char *sha1 = NULL;
+	char *path;
+	int ret;
+
+	if (memcmp(node->expected.config_hash, no_hash, sizeof(no_hash)))
+		sha1 = node->expected.config_hash;
+	nm_asprintf(&path, "%s%s.cfg", split_config_dir(), node->name);
+	ret = csync_push_file(s, CSYNC_POLLER_OCONF, path, sha1);
+	free(path);
+	return ret;
+}
+
+/* peers get all of our object config */
+static int csync_add_oconf(struct csync_session *s)
+{
+	struct file_list **sorted_flist;
+	unsigned int num_files = 0, i;
+	size_t dirlen;
+	int ret = 0;
+
+	dirlen = strlen(config_file_dir);
+	while (dirlen > 1 && config_file_dir[dirlen - 1] == '/')
+		dirlen--;
+
+	sorted_flist = get_sorted_oconf_files(&num_files);
+	for (i = 0; i < num_files; i++) {
+		const char *path = sorted_flist[i]->name;
+
+		if (!ret) {
+			if (strncmp(path, config_file_dir, dirlen) || path[dirlen] != '/') {
+				lwarn("CSYNC: %s is outside %s. Not syncing it", path, config_file_dir);
+			} else {
+				ret = csync_push_file(s, path + dirlen + 1, path, NULL);
+			}
+		}
+		sorted_flist[i]->next = NULL;
+		file_list_free(sorted_flist[i]);
+	}
+	free(sorted_flist);
+
+	return ret;
+}
+
+static int csync_send_manifest(merlin_node *node, struct csync_session *s)
+{
+	struct csync_msg *msg = csync_msg(CSYNC_MANIFEST, s->id);
+	unsigned int i;
+
+	for (i = 0; i < s->num_files; i++) {
+		struct csync_file *f = &s->files[i];
+		struct csync_entry *e;
+		uint32_t name_len = (strlen(f->name) + 1 + 7) & ~7U;
+
+		if (sizeof(*msg) + msg->len + sizeof(*e) + name_len > CSYNC_MSG_MAX) {
+			if (csync_send(node, msg) < 0)
+				return -1;
+			msg = csync_msg(CSYNC_MANIFEST, s->id);
+			msg->index = i;
+		}
+		e = (struct csync_entry *)(msg->data + msg->len);
+		memset(e, 0, sizeof(*e) + name_len);
+		e->size = f->size;
+		e->mode = f->mode;
+		e->name_len = name_len;
+		memcpy(e->sha1, f->sha1, sizeof(e->sha1));
+		strcpy((char *)(e + 1), f->name);
+		msg->len += sizeof(*e) + name_len;
+		msg->count++;
+	}
+	msg->flags = CSYNC_F_LAST;
+	return csync_send(node, msg);
+}
+
+/*
+ * Starts a native push to the node. The connection is kept open
+ * while the session runs, and closed when it's done so the nodes
+ * negotiate again with the new config.
+ */
+int csync_native_push(merlin_node *node)
+{
+	struct csync_session *s;
+	struct timeval tv;
+	int ret;
+
+	gettimeofday(&tv, NULL);
+	s = csync_session_new(node, (uint32_t)(tv.tv_sec ^ (tv.tv_usec << 12)) | 1, 1);
+	if (!s) {
+		lerr("CSYNC: %s %s: Failed to start native push", node_type(node), node->name);
+		return -1;
+	}
+
+	if (node->type == MODE_POLLER)
+		ret = csync_add_poller_config(s, node);
+	else
+		ret = csync_add_oconf(s);
+
+	if (ret < 0) {
+		csync_session_free(node);
+		return -1;
+	}
+
+	linfo("CSYNC: %s %s: Sending manifest of %u files", node_type(node), node->name, s->num_files);
+	if (csync_send_manifest(node, s) < 0) {
+		csync_session_free(node);
+		return -1;
+	}
+	return 0;
+}
+
+static void csync_pump(merlin_node *node);
+
+/* sends what's queued, and then more file data if we're pushing */
+static void csync_resume(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+
+	if (!s || csync_flush(node) < 0)
+		return;
+	if (s->out_head) {
+		csync_wait_writable(node);
+		return;
+	}
+	if (s->pushing)
+		csync_pump(node);
+}
+
+static void csync_retry(struct nm_event_execution_properties *evprop)
+{
+	merlin_node *node = (merlin_node *)evprop->user_data;
+	struct csync_session *s = node->csync_session;
+
+	if (evprop->execution_type != EVENT_EXEC_NORMAL || !s)
+		return;
+	s->retry = NULL;
+	csync_resume(node);
+}
+
+/*
+ * Sends file data until the window is full or the next chunk doesn't
+ * fit on the socket. ACKs from the receiver keep it going, and if the
+ * socket is what's holding us back we go on once it has room.
+ */
+static void csync_pump(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+	struct csync_msg *msg;
+
+	while (s->next_want < s->num_want) {
+		uint32_t idx = s->want[s->next_want];
+		struct csync_file *f = &s->files[idx];
+		uint64_t left = f->size - f->done;
+		uint32_t len = left > CSYNC_CHUNK ? CSYNC_CHUNK : left;
+
+		if (s->total - s->acked >= CSYNC_WINDOW)
+			return;
+
+		if (node->sock < 0 || s->out_head)
+			return;
+		if (!csync_fits(node, sizeof(*msg) + len)) {
+			csync_wait_writable(node);
+			return;
+		}
+
+		if (f->fd < 0 && (f->fd = open(f->path, O_RDONLY)) < 0) {
+			csync_fail(node, errno, "Failed to open %s: %s", f->path, strerror(errno));
+			return;
+		}
+
+		msg = csync_msg(CSYNC_DATA, s->id);
+		msg->index = idx;
+		msg->offset = f->done;
+		msg->len = len;
+		if (len && pread(f->fd, msg->data, len, f->done) != (ssize_t)len) {
+			csync_fail(node, EIO, "%s changed while it was being sent", f->path);
+			return;
+		}
+		/* on failure the node is disconnected, which frees the session */
+		if (csync_send(node, msg) < 0)
+			return;
+
+		f->done += len;
+		s->total += len;
+		if (f->done == f->size) {
+			close(f->fd);
+			f->fd = -1;
+			s->next_want++;
+		}
+	}
+
+	if (s->want_done && !s->done_sent) {
+		s->done_sent = 1;
+		msg = csync_msg(CSYNC_DONE, s->id);
+		msg->count = s->num_want;
+		csync_send(node, msg);
+	}
+}
+
+static void csync_push_input(merlin_node *node, struct csync_msg *msg)
+{
+	struct csync_session *s = node->csync_session;
+	uint32_t i, *idx = (uint32_t *)msg->data;
+	struct timeval now;
+
+	switch (msg->op) {
+	case CSYNC_WANT:
+		if (msg->len < msg->count * sizeof(uint32_t)) {
+			csync_fail(node, EPROTO, "Truncated WANT message");
+			return;
+		}
+		for (i = 0; i < msg->count; i++) {
+			if (csync_want_add(s, idx[i]) < 0) {
+				csync_fail(node, EPROTO, "Bogus file index %u in WANT message", idx[i]);
+				return;
+			}
+		}
+		if (msg->flags & CSYNC_F_LAST) {
+			s->want_done = 1;
+			linfo("CSYNC: %s %s: Sending %u of %u files", node_type(node), node->name,
+			      s->num_want, s->num_files);
+		}
+		csync_pump(node);
+		break;
+
+	case CSYNC_ACK:
+		s->acked = msg->offset;
+		csync_pump(node);
+		break;
+
+	case CSYNC_RESULT:
+		gettimeofday(&now, NULL);
+		if (msg->flags) {
+			lerr("CSYNC: %s %s: Native push failed on the receiving end: %s",
+			     node_type(node), node->name, strerror(msg->flags));
+		} else {
+			linfo("CSYNC: %s %s: Native push done. %u of %u files (%s) updated in %s",
+			      node_type(node), node->name, msg->count, s->num_files,
+			      human_bytes(s->total), tv_delta(&s->start, &now));
+		}
+		csync_push_finished(node, !msg->flags);
+		node_disconnect(node, "Native config sync finished");
+		break;
+
+	default:
+		csync_fail(node, EPROTO, "Unexpected message %u", msg->op);
+	}
+}
+
+/*
+ * receiver side
+ */
+
+/* only relative paths without "." or ".." components get past this */
+static int csync_name_ok(const char *name)
+{
+	const char *p = name;
+
+	if (!*name || *name == '/')
+		return 0;
+
+	while (*p) {
+		const char *end = strchrnul(p, '/');
+		size_t len = end - p;
+
+		if (!len || (len == 1 && *p == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		p = *end ? end + 1 : end;
+		if (*end && !*p)
+			return 0;
+	}
+	return 1;
+}
+
+static int csync_read_manifest(merlin_node *node, struct csync_msg *msg)
+{
+	struct csync_session *s = node->csync_session;
+	uint32_t off = 0, i;
+
+	for (i = 0; i < msg->count; i++) {
+		struct csync_entry *e = (struct csync_entry *)(msg->data + off);
+		struct csync_file *f;
+		const char *name;
+		char *path;
+
+		if (off + sizeof(*e) > msg->len || !e->name_len ||
+		    e->name_len > msg->len - off - sizeof(*e))
+		{
+			csync_fail(node, EPROTO, "Truncated manifest");
+			return -1;
+		}
+		name = (const char *)(e + 1);
+		if (!memchr(name, 0, e->name_len) || !csync_name_ok(name)) {
+			csync_fail(node, EPERM, "Refusing to write to '%.*s'", (int)e->name_len, name);
+			return -1;
+		}
+
+		nm_asprintf(&path, "%s/%s", config_file_dir, name);
+		f = csync_file_add(s, name, path);
+		free(path);
+		if (!f) {
+			csync_fail(node, ENOMEM, "Failed to add %s to the manifest", name);
+			return -1;
+		}
+		f->size = e->size;
+		f->mode = (e->mode & 0777) | 0600;
+		memcpy(f->sha1, e->sha1, sizeof(f->sha1));
+		off += sizeof(*e) + e->name_len;
+	}
+
+	return 0;
+}
+
+/* asks for the files that differ from ours, in the order they're listed */
+static void csync_send_want(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+	struct csync_msg *msg;
+	unsigned int i, per_msg = (CSYNC_MSG_MAX - sizeof(*msg)) / sizeof(uint32_t);
+
+	for (i = 0; i < s->num_files; i++) {
+		struct csync_file *f = &s->files[i];
+		unsigned char sha1[20];
+		struct stat st;
+
+		if (!stat(f->path, &st) && S_ISREG(st.st_mode) && (uint64_t)st.st_size == f->size &&
+		    !csync_file_sha1(f->path, &st, sha1) && !memcmp(sha1, f->sha1, sizeof(sha1)))
+		{
+			continue;
+		}
+		csync_want_add(s, i);
+	}
+
+	if (!s->num_want) {
+		linfo("CSYNC: %s %s: All %u files in the manifest are already up to date",
+		      node_type(node), node->name, s->num_files);
+		msg = csync_msg(CSYNC_RESULT, s->id);
+		csync_session_free(node);
+		csync_send(node, msg);
+		return;
+	}
+
+	linfo("CSYNC: %s %s: Fetching %u of %u files", node_type(node), node->name,
+	      s->num_want, s->num_files);
+	for (i = 0; i < s->num_want; i += per_msg) {
+		unsigned int count = s->num_want - i > per_msg ? per_msg : s->num_want - i;
+
+		msg = csync_msg(CSYNC_WANT, s->id);
+		msg->index = i;
+		msg->count = count;
+		msg->len = count * sizeof(uint32_t);
+		memcpy(msg->data, &s->want[i], msg->len);
+		if (i + count == s->num_want)
+			msg->flags = CSYNC_F_LAST;
+		if (csync_send(node, msg) < 0)
+			return;
+	}
+}
+
+/* creates the directories leading up to path */
+static int csync_mkdirs(const char *path)
+{
+	char *dir = strdup(path), *p;
+
+	if (!dir)
+		return -1;
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			free(dir);
+			return -1;
+		}
+		*p = '/';
+	}
+	free(dir);
+	return 0;
+}
+
+static int csync_write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void csync_data(merlin_node *node, struct csync_msg *msg)
+{
+	struct csync_session *s = node->csync_session;
+	struct csync_file *f;
+	unsigned char sha1[20];
+
+	if (s->next_want >= s->num_want || msg->index != s->want[s->next_want]) {
+		csync_fail(node, EPROTO, "Got data for file %u out of order", msg->index);
+		return;
+	}
+	f = &s->files[msg->index];
+	if (msg->offset != f->done || msg->len > f->size - f->done) {
+		csync_fail(node, EPROTO, "Got data for %s at the wrong offset", f->name);
+		return;
+	}
+
+	if (!f->tmp) {
+		nm_asprintf(&f->tmp, "%s.csync-XXXXXX", f->path);
+		if (csync_mkdirs(f->path) < 0 || (f->fd = mkstemp(f->tmp)) < 0) {
+			csync_fail(node, errno, "Failed to create %s: %s", f->tmp, strerror(errno));
+			return;
+		}
+		blk_SHA1_Init(&f->ctx);
+	}
+
+	if (csync_write_all(f->fd, msg->data, msg->len) < 0) {
+		csync_fail(node, errno, "Failed to write to %s: %s", f->tmp, strerror(errno));
+		return;
+	}
+	blk_SHA1_Update(&f->ctx, msg->data, msg->len);
+	f->done += msg->len;
+	s->total += msg->len;
+
+	if (f->done == f->size) {
+		blk_SHA1_Final(sha1, &f->ctx);
+		if (memcmp(sha1, f->sha1, sizeof(sha1))) {
+			csync_fail(node, EIO, "Checksum mismatch for %s", f->name);
+			return;
+		}
+		if (fchmod(f->fd, f->mode) < 0 || fsync(f->fd) < 0 || close(f->fd) < 0) {
+			f->fd = -1;
+			csync_fail(node, errno, "Failed to write %s: %s", f->tmp, strerror(errno));
+			return;
+		}
+		f->fd = -1;
+		s->next_want++;
+	}
+
+	if (s->total - s->acked >= CSYNC_ACK_EVERY) {
+		s->acked = s->total;
+		msg = csync_msg(CSYNC_ACK, s->id);
+		msg->offset = s->total;
+		csync_send(node, msg);
+	}
+}
+
+static void csync_reload_done(wproc_result *wpres, void *arg, __attribute__((unused)) int flags)
+{
+	merlin_node *node = (merlin_node *)arg;
+
+	log_child_result(wpres, "CSYNC: Reload after native fetch from %s %s",
+	                 node_type(node), node->name);
+}
+
+/* every file is verified, so move them all into place and reload once */
+static void csync_done(merlin_node *node)
+{
+	struct csync_session *s = node->csync_session;
+	struct csync_msg *msg;
+	const char *reload;
+	unsigned int i, num_want = s->num_want;
+
+	if (s->next_want != s->num_want) {
+		csync_fail(node, EPROTO, "Got DONE with %u of %u files received",
+		           s->next_want, s->num_want);
+		return;
+	}
+
+	for (i = 0; i < s->num_want; i++) {
+		struct csync_file *f = &s->files[s->want[i]];
+
+		if (rename(f->tmp, f->path) < 0) {
+			csync_fail(node, errno, "Failed to rename %s to %s: %s",
+			           f->tmp, f->path, strerror(errno));
+			return;
+		}
+		free(f->tmp);
+		f->tmp = NULL;
+	}
+
+	linfo("CSYNC: %s %s: Native fetch done. %u of %u files (%s) updated",
+	      node_type(node), node->name, s->num_want, s->num_files, human_bytes(s->total));
+	msg = csync_msg(CSYNC_RESULT, s->id);
+	msg->count = num_want;
+	csync_session_free(node);
+	csync_send(node, msg);
+
+	reload = node->csync.reload ? node->csync.reload : global_csync.reload;
+	if (!reload)
+		reload = CSYNC_DEFAULT_RELOAD;
+	linfo("CSYNC: Reloading with: %s", reload);
+	if (strcmp(reload, ":"))
+		wproc_run_callback((char *)reload, 600, csync_reload_done, node, NULL);
+}
+
+static void csync_fetch_input(merlin_node *node, struct csync_msg *msg)
+{
+	struct csync_session *s = node->csync_session;
+
+	if (msg->op == CSYNC_MANIFEST && !msg->index) {
+		if (!csync_is_native(node->csync.fetch.cmd)) {
+			lwarn("CSYNC: %s %s: Refusing native push, as we're not configured to fetch from it",
+			      node_type(node), node->name);
+			msg = csync_msg(CSYNC_RESULT, msg->session);
+			msg->flags = EPERM;
+			csync_send(node, msg);
+			return;
+		}
+		/* don't tear down our own push to make room for theirs */
+		if (s && s->pushing) {
+			lwarn("CSYNC: %s %s: Refusing native push, as we're pushing to it ourselves",
+			      node_type(node), node->name);
+			msg = csync_msg(CSYNC_RESULT, msg->session);
+			msg->flags = EBUSY;
+			csync_send(node, msg);
+			return;
+		}
+		if (!(s = csync_session_new(node, msg->session, 0))) {
+			lerr("CSYNC: %s %s: Failed to start native fetch", node_type(node), node->name);
+			return;
+		}
+	}
+
+	if (!s || s->pushing || s->id != msg->session) {
+		ldebug("CSYNC: %s %s: Ignoring message %u for stale session %u",
+		       node_type(node), node->name, msg->op, msg->session);
+		return;
+	}
+
+	switch (msg->op) {
+	case CSYNC_MANIFEST:
+		if (msg->index != s->num_files) {
+			csync_fail(node, EPROTO, "Got manifest entries out of order");
+			return;
+		}
+		if (csync_read_manifest(node, msg) < 0)
+			return;
+		if (msg->flags & CSYNC_F_LAST)
+			csync_send_want(node);
+		break;
+
+	case CSYNC_DATA:
+		csync_data(node, msg);
+		break;
+
+	case CSYNC_DONE:
+		csync_done(node);
+		break;
+
+	default:
+		csync_fail(node, EPROTO, "Unexpected message %u", msg->op);
+	}
+}
+
+void csync_native_input(merlin_node *node, merlin_event *pkt)
+{
+	struct csync_msg *msg = (struct csync_msg *)pkt->body;
+
+	if (pkt->hdr.len < sizeof(*msg) || pkt->hdr.len - sizeof(*msg) < msg->len) {
+		lerr("CSYNC: %s %s: Truncated CTRL_CSYNC packet", node_type(node), node->name);
+		return;
+	}
+
+	if (node->csync_session)
+		node->csync_session->last_input = time(NULL);
+
+	switch (msg->op) {
+	case CSYNC_WANT: case CSYNC_ACK: case CSYNC_RESULT:
+		if (!node->csync_session || !node->csync_session->pushing ||
+		    node->csync_session->id != msg->session)
+		{
+			ldebug("CSYNC: %s %s: Ignoring message %u for stale session %u",
+			       node_type(node), node->name, msg->op, msg->session);
+			return;
+		}
+		csync_push_input(node, msg);
+		break;
+	default:
+		csync_fetch_input(node, msg);
+	}
+}
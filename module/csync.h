@@ -0,0 +1,54 @@
+#ifndef INCLUDE_module_csync_h__
+#define INCLUDE_module_csync_h__
+#include <stdint.h>
+#include "node.h"
+
+/*
+ * Native config sync. Instead of running a push or fetch command,
+ * a node configured with "push = native" sends a manifest of its
+ * object config files, with the sha1 of each, over the connection
+ * it already has to the other node. The other node (which must be
+ * configured with "fetch = native") asks for the files that differ
+ * from its own, and only those are sent, in CTRL_CSYNC packets.
+ * Once all of them are written and verified they're renamed into
+ * place and the reload command is run, once.
+ *
+ * Pollers get the config split out for them by oconfsplit, stored
+ * as oconf/from-master.cfg. Everyone else gets the files in our
+ * config, relative to the directory naemon.cfg lives in.
+ */
+#define CSYNC_MANIFEST 1 /* pusher: entries "index" to "index + count" of the manifest */
+#define CSYNC_WANT     2 /* receiver: "count" uint32_t indexes of files to send */
+#define CSYNC_DATA     3 /* pusher: "len" bytes of file "index" at "offset" */
+#define CSYNC_ACK      4 /* receiver: "offset" bytes received in total */
+#define CSYNC_DONE     5 /* pusher: all wanted files are sent */
+#define CSYNC_RESULT   6 /* receiver: "count" files updated. "flags" is an errno */
+
+/* for csync_msg->flags in MANIFEST and WANT messages */
+#define CSYNC_F_LAST 1
+
+struct csync_msg {
+	uint32_t op;
+	uint32_t session;
+	uint32_t index;
+	uint32_t count;
+	uint64_t offset;
+	uint32_t len;
+	uint32_t flags;
+	char data[];
+};
+
+/* one per file in a MANIFEST message, followed by the nul-terminated name */
+struct csync_entry {
+	uint64_t size;
+	uint32_t mode;
+	uint32_t name_len; /* including the nul byte and padding to 8 bytes */
+	unsigned char sha1[20];
+	uint32_t pad;
+};
+
+extern int csync_is_native(const char *cmd);
+extern int csync_native_push(merlin_node *node);
+extern void csync_native_input(merlin_node *node, merlin_event *pkt);
+extern void csync_native_abort(merlin_node *node, const char *reason);
+#endif
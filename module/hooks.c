@@ -17,6 +17,8 @@
 #include "ipc.h"
 #include "pgroup.h"
 #include "net.h"
+#include "routing.h"
+#include "trace.h"
 #include <string.h>
 #include <naemon/naemon.h>
 
@@ -24,10 +26,21 @@ extern merlin_event *recv_event;
 
 static nebstruct_comment_data *block_comment;
 static int check_dupes;
-static merlin_event last_pkt;
-static unsigned long long dupes, dupe_bytes;
 static uint32_t ev_mask;
 
+/*
+ * Duplicate suppression. Rather than keeping a full copy of the
+ * last packet sent, we keep a hash of the last status packet sent
+ * for each host and service and drop a new one only if it matches
+ * that. Status that goes A, B, A is sent all three times, since
+ * the third one changes what the other side has.
+ */
+static int suppress_dupes = 1;
+static uint64_t *last_host_hash, *last_service_hash;
+static unsigned int last_host_hash_len, last_service_hash_len;
+static unsigned long long dupe_hits[NEBCALLBACK_NUMITEMS + 1];
+static unsigned long long dupes, dupe_bytes;
+
 static merlin_event tmp_notif_pkt;
 static nebstruct_notification_data *tmp_notif_data;
 
@@ -36,77 +49,114 @@ struct merlin_check_stats {
 };
 static struct merlin_check_stats service_checks, host_checks;
 
-static int is_dupe(merlin_event *pkt)
+/*
+ * Hash the parts of an encoded packet that identify it. hdr.sent
+ * is stamped when the packet is shipped, so we leave it out. The
+ * length needn't be added, since every byte of the body changes
+ * the hash.
+ */
+static uint64_t packet_hash(merlin_event *pkt)
 {
-	if (!check_dupes) {
-		return 0;
-	}
+	uint64_t h;
 
-	if (last_pkt.hdr.type != pkt->hdr.type) {
-		return 0;
-	}
+	h = hash64(((uint64_t)pkt->hdr.type << 48) | ((uint64_t)pkt->hdr.code << 32) |
+	           ((uint64_t)pkt->hdr.selection << 16), pkt->body, pkt->hdr.len);
 
-	if (packet_size(&last_pkt) != packet_size(pkt)) {
-		return 0;
+	/* 0 marks an empty slot */
+	return h ? h : 1;
+}
+
+/*
+ * Returns where to keep the hash of the last status packet sent
+ * for the object the packet is about, or NULL if it isn't one we
+ * check. The tables are sized when first used, since the object
+ * counts aren't known before the config is read.
+ */
+static uint64_t *last_hash_slot(merlin_event *pkt)
+{
+	uint64_t **ary;
+	unsigned int *len, want, id = pkt->hdr.object_id;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		ary = &last_host_hash;
+		len = &last_host_hash_len;
+		want = num_objects.hosts;
+		break;
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		ary = &last_service_hash;
+		len = &last_service_hash_len;
+		want = num_objects.services;
+		break;
+	default:
+		return NULL;
 	}
 
-	/* if this is truly a dupe, return 1 and log every 100'th */
-	if (!memcmp(&last_pkt, pkt, packet_size(pkt))) {
-		dupe_bytes += packet_size(pkt);
-		if (!(++dupes % 100)) {
-			ldebug("%s in %llu duplicate packets dropped",
-				   human_bytes(dupe_bytes), dupes);
-		}
-		return 1;
+	/* object_id is the object's id + 1, so 0 means we don't know */
+	if (!id || id > want)
+		return NULL;
+
+	if (*len < want) {
+		uint64_t *tmp = realloc(*ary, want * sizeof(uint64_t));
+		if (!tmp)
+			return NULL;
+		memset(tmp + *len, 0, (want - *len) * sizeof(uint64_t));
+		*ary = tmp;
+		*len = want;
 	}
 
-	return 0;
+	return &(*ary)[id - 1];
 }
 
-static int send_generic(merlin_event *pkt, void *data)
+static int is_dupe(merlin_event *pkt, uint64_t hash)
 {
-	int result = 0;
-	uint i, ntable_stop = num_masters + num_peers;
-	linked_item *li;
+	uint64_t *last;
 
-	if ((!num_nodes || pkt->hdr.code == MAGIC_NONET) && !daemon_wants(pkt->hdr.type)) {
-		ldebug("ipcfilter: Not sending %s event. %s, and daemon doesn't want it",
-			   callback_name(pkt->hdr.type),
-			   pkt->hdr.code == MAGIC_NONET ? "No-net magic" : "No nodes");
+	if (!check_dupes || !suppress_dupes)
 		return 0;
-	}
-	if (!pkt->hdr.code == MAGIC_NONET && !daemon_wants(pkt->hdr.type)) {
-		ldebug("ipcfilter: Not sending %s event. No-net magic and daemon doesn't want it",
-			   callback_name(pkt->hdr.type));
+
+	last = last_hash_slot(pkt);
+	if (!last || *last != hash)
 		return 0;
-	}
 
-	pkt->hdr.len = merlin_encode_event(pkt, data);
-	if (!pkt->hdr.len) {
-		lerr("Header len is 0 for callback %d. Update offset in hookinfo.h", pkt->hdr.type);
-		return -1;
+	/* if this is truly a dupe, return 1 and log every 100'th */
+	dupe_hits[pkt->hdr.type]++;
+	dupe_bytes += packet_size(pkt);
+	if (!(++dupes % 100)) {
+		ldebug("%s in %llu duplicate packets dropped",
+			   human_bytes(dupe_bytes), dupes);
 	}
+	return 1;
+}
 
-	if (is_dupe(pkt)) {
-		ldebug("ipcfilter: Not sending %s event: Duplicate packet",
-		       callback_name(pkt->hdr.type));
-		return 0;
-	}
+static void remember_packet(merlin_event *pkt, uint64_t hash)
+{
+	uint64_t *last;
 
-	if (daemon_wants(pkt->hdr.type)) {
-		result = ipc_send_event(pkt);
-		/*
-		 * preserve the event so we can check for dupes,
-		 * but only if we successfully sent it
-		 */
-		if (result < 0)
-			memset(&last_pkt, 0, sizeof(last_pkt));
-		else
-			memcpy(&last_pkt, pkt, packet_size(pkt));
-	}
+	if (!check_dupes || !suppress_dupes)
+		return;
 
-	if (!num_nodes)
-		return 0;
+	if ((last = last_hash_slot(pkt)))
+		*last = hash;
+}
+
+static void forget_packets(void)
+{
+	safe_free(last_host_hash);
+	safe_free(last_service_hash);
+	last_host_hash_len = last_service_hash_len = 0;
+}
+
+/*
+ * Ships an encoded packet off to all nodes that should have it.
+ * The packet is only ever copied once, regardless of how many
+ * disconnected nodes have to stash it in their backlogs.
+ */
+static int send_to_nodes(merlin_fanout *fo)
+{
+	merlin_event *pkt = fo->pkt;
+	uint i, ntable_stop = num_masters + num_peers;
+	const struct routing_dest *dest;
 
 	/*
 	 * The module can mark certain packets with a magic destination.
@@ -116,17 +166,17 @@ static int send_generic(merlin_event *pkt, void *data)
 	if (magic_destination(pkt)) {
 		if ((pkt->hdr.selection & DEST_MASTERS) == DEST_MASTERS) {
 			for (i = 0; i < num_masters; i++) {
-				net_sendto(node_table[i], pkt);
+				net_fanout_sendto(node_table[i], fo);
 			}
 		}
 		if ((pkt->hdr.selection & DEST_PEERS) == DEST_PEERS) {
 			for (i = 0; i < num_peers; i++) {
-				net_sendto(peer_table[i], pkt);
+				net_fanout_sendto(peer_table[i], fo);
 			}
 		}
 		if ((pkt->hdr.selection & DEST_POLLERS) == DEST_POLLERS) {
 			for (i = 0; i < num_pollers; i++) {
-				net_sendto(poller_table[i], pkt);
+				net_fanout_sendto(poller_table[i], fo);
 			}
 		}
 
@@ -145,29 +195,115 @@ static int send_generic(merlin_event *pkt, void *data)
 
 	/* Send this to all who should have it */
 	for (i = 0; i < ntable_stop; i++) {
-		net_sendto(node_table[i], pkt);
+		net_fanout_sendto(node_table[i], fo);
 	}
 
 	/* if we've already sent to everyone we return early */
 	if (ntable_stop == num_nodes || !num_pollers)
 		return 0;
 
-	li = nodes_by_sel_id(pkt->hdr.selection);
-	if (!li) {
+	dest = routing_dest(pkt->hdr.selection);
+	if (!dest) {
 		lerr("No matching selection for id %d", pkt->hdr.selection);
 		return -1;
 	}
 
-	for (; li; li = li->next_item) {
-		net_sendto((merlin_node *)li->item, pkt);
+	for (i = 0; i < dest->num_nodes; i++) {
+		net_fanout_sendto(dest->nodes[i], fo);
+	}
+
+	return 0;
+}
+
+static int send_generic(merlin_event *pkt, void *data)
+{
+	int result = 0, to_ipc;
+	uint64_t hash = 0;
+	merlin_fanout fo = MERLIN_FANOUT_INIT(pkt);
+
+	/* ask before encoding, so we don't encode what nobody wants */
+	to_ipc = ipc_wants(pkt->hdr.type, data);
+	if ((!num_nodes || pkt->hdr.code == MAGIC_NONET) && !to_ipc) {
+		ldebug("ipcfilter: Not sending %s event. %s, and daemon doesn't want it",
+			   callback_name(pkt->hdr.type),
+			   pkt->hdr.code == MAGIC_NONET ? "No-net magic" : "No nodes");
+		return 0;
+	}
+	if (!pkt->hdr.code == MAGIC_NONET && !daemon_wants(pkt->hdr.type)) {
+		ldebug("ipcfilter: Not sending %s event. No-net magic and daemon doesn't want it",
+			   callback_name(pkt->hdr.type));
+		return 0;
+	}
+
+	pkt->hdr.len = merlin_encode_event(&ipc, pkt, data);
+	if (!pkt->hdr.len) {
+		lerr("Header len is 0 for callback %d. Update offset in hookinfo.h", pkt->hdr.type);
+		return -1;
+	}
+
+	if (check_dupes && suppress_dupes) {
+		hash = packet_hash(pkt);
+		if (is_dupe(pkt, hash)) {
+			ldebug("ipcfilter: Not sending %s event: Duplicate packet",
+			       callback_name(pkt->hdr.type));
+			return 0;
+		}
 	}
 
+	/*
+	 * stamp it here rather than only in ipc_send_event(), so nodes
+	 * can tell how long our check results took to reach them even
+	 * if the daemon doesn't want this event
+	 */
+	gettimeofday(&pkt->hdr.sent, NULL);
+
+	trace_event(TRACE_HOOK_SEND, NULL, pkt);
+
+	if (to_ipc) {
+		result = ipc_send_event(pkt);
+	}
+
+	/*
+	 * remember the event so we can check for dupes,
+	 * but only if we successfully sent it
+	 */
+	if (result >= 0)
+		remember_packet(pkt, hash);
+
+	if (!num_nodes)
+		return 0;
+
+	if (send_to_nodes(&fo) < 0)
+		result = -1;
+	node_fanout_release(&fo);
+
 	return result;
 }
 
+/*
+ * Finds a host by the first len bytes of name. Comments, downtimes
+ * and commands only tell us the name of their host, and GUIs tend
+ * to send them for all the services on a host in a row, so we
+ * remember the id of the last one we found
+ */
+static host *find_host_cached(const char *name, size_t len)
+{
+	static unsigned int last_id;
+	host *hst;
+
+	hst = last_id < num_objects.hosts ? host_ary[last_id] : NULL;
+	if (hst && !strncmp(hst->name, name, len) && !hst->name[len])
+		return hst;
+
+	hst = find_host(strndupa(name, len));
+	if (hst)
+		last_id = hst->id;
+	return hst;
+}
+
 static int get_selection(const char *key)
 {
-	node_selection *sel = node_selection_by_hostname(key);
+	node_selection *sel = routing_host_selection(find_host_cached(key, strlen(key)));
 
 	return sel ? sel->id & 0xffff : DEST_PEERS_MASTERS;
 }
@@ -182,7 +318,6 @@ static int get_hostgroup_selection(const char *key)
 static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 {
 	merlin_host_status st_obj;
-	static host *last_obj = NULL;
 
 	if (obj == merlin_recv_host)
 		return 0;
@@ -192,13 +327,9 @@ static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 		return -1;
 	}
 	memset(&st_obj, 0, sizeof(st_obj));
-	if (obj == last_obj) {
-		check_dupes = 1;
-	} else {
-		check_dupes = 0;
-		last_obj = obj;
-	}
+	check_dupes = 1;
 
+	pkt->hdr.object_id = obj->id + 1;
 	st_obj.nebattr = nebattr;
 	st_obj.name = obj->name;
 	MOD2NET_STATE_VARS(st_obj.state, obj);
@@ -209,20 +340,15 @@ static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 static int send_service_status(merlin_event *pkt, int nebattr, service *obj)
 {
 	merlin_service_status st_obj;
-	static service *last_obj = NULL;
 
 	if (!obj) {
 		lerr("send_service_status() called with NULL obj");
 		return -1;
 	}
 	memset(&st_obj, 0, sizeof(st_obj));
-	if (obj == last_obj) {
-		check_dupes = 1;
-	} else {
-		check_dupes = 0;
-		last_obj = obj;
-	}
+	check_dupes = 1;
 
+	pkt->hdr.object_id = obj->id + 1;
 	st_obj.nebattr = nebattr;
 	st_obj.host_name = obj->host_name;
 	st_obj.service_description = obj->description;
@@ -513,9 +639,19 @@ static int hook_downtime(merlin_event *pkt, void *data)
 	return send_generic(pkt, data);
 }
 
+/* the host a command is for */
+static host *get_cmd_host(const char *cmd)
+{
+	const char *semi_colon;
+
+	semi_colon = strchr(cmd, ';');
+	return find_host_cached(cmd, semi_colon ? (size_t)(semi_colon - cmd) : strlen(cmd));
+}
+
 static int get_cmd_selection(char *cmd, int hostgroup)
 {
 	char *semi_colon;
+	node_selection *sel;
 	int ret;
 
 	/*
@@ -528,24 +664,130 @@ static int get_cmd_selection(char *cmd, int hostgroup)
 		return DEST_PEERS_POLLERS;
 	}
 
+	if (!hostgroup) {
+		sel = routing_host_selection(get_cmd_host(cmd));
+		return sel ? sel->id & 0xffff : DEST_PEERS_MASTERS;
+	}
+
 	semi_colon = strchr(cmd, ';');
 	if (semi_colon)
 		*semi_colon = '\0';
-	if (!hostgroup) {
-		ret = get_selection(cmd);
-	} else {
-		ret = get_hostgroup_selection(cmd);
-	}
+	ret = get_hostgroup_selection(cmd);
 	if (semi_colon)
 		*semi_colon = ';';
 
 	return ret;
 }
 
+/*
+ * Batching external commands. With batch_commands set, commands for
+ * single hosts and services are collected per selection, and sent as
+ * one CMD_BATCH_PACKET per selection once naemon is done with the
+ * commands it read in one go, so acknowledging or rescheduling
+ * thousands of services doesn't mean thousands of packets.
+ * Commands for the same host always end up in the same batch, so
+ * they stay in order. Commands for groups of objects, or for
+ * everything, may affect any host, so pending batches are sent
+ * before them.
+ */
+struct cmd_batch {
+	merlin_event *pkt;
+	uint32_t len;
+};
+static int batch_commands;
+static struct cmd_batch *cmd_batch; /* by selection, and DEST_PEERS_MASTERS last */
+static unsigned int cmd_batches, cmd_batches_pending;
+static timed_event *cmd_batch_evt;
+
+static void cmd_batch_send(struct cmd_batch *b, uint16_t selection)
+{
+	merlin_fanout fo = MERLIN_FANOUT_INIT(b->pkt);
+
+	b->pkt->hdr.type = CMD_BATCH_PACKET;
+	b->pkt->hdr.code = 0;
+	b->pkt->hdr.selection = selection;
+	b->pkt->hdr.len = b->len;
+	b->pkt->hdr.object_id = 0;
+	gettimeofday(&b->pkt->hdr.sent, NULL);
+	trace_event(TRACE_HOOK_SEND, NULL, b->pkt);
+
+	b->len = 0;
+	cmd_batches_pending--;
+	send_to_nodes(&fo);
+	node_fanout_release(&fo);
+}
+
+static void cmd_batch_flush(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < cmd_batches && cmd_batches_pending; i++) {
+		if (cmd_batch[i].len)
+			cmd_batch_send(&cmd_batch[i], i == cmd_batches - 1 ? DEST_PEERS_MASTERS : i);
+	}
+}
+
+static void cmd_batch_flush_event(struct nm_event_execution_properties *evprop)
+{
+	if (evprop->execution_type == EVENT_EXEC_NORMAL)
+		cmd_batch_flush();
+	cmd_batch_evt = NULL;
+}
+
+/* returns 0 if the command was added to a batch */
+static int cmd_batch_add(uint16_t selection, nebstruct_external_command_data *ds)
+{
+	struct merlin_cmd_entry *ent;
+	struct cmd_batch *b;
+	uint32_t args_len, size;
+	unsigned int i;
+
+	if (!batch_commands || !ds->command_args)
+		return -1;
+
+	if (!cmd_batch) {
+		cmd_batches = get_num_selections() + 1;
+		cmd_batch = calloc(cmd_batches, sizeof(*cmd_batch));
+		if (!cmd_batch)
+			return -1;
+	}
+
+	i = selection == DEST_PEERS_MASTERS ? cmd_batches - 1 : selection;
+	if (i >= cmd_batches)
+		return -1;
+	b = &cmd_batch[i];
+
+	args_len = strlen(ds->command_args) + 1;
+	args_len += (8 - (args_len & 7)) & 7;
+	size = sizeof(*ent) + args_len;
+	if (size > sizeof(b->pkt->body))
+		return -1;
+
+	if (!b->pkt && !(b->pkt = calloc(1, sizeof(*b->pkt))))
+		return -1;
+	if (b->len + size > sizeof(b->pkt->body))
+		cmd_batch_send(b, selection);
+
+	ent = (struct merlin_cmd_entry *)(b->pkt->body + b->len);
+	memset(ent, 0, size);
+	ent->entry_time = ds->entry_time;
+	ent->command_type = ds->command_type;
+	ent->len = args_len;
+	strcpy(ent->args, ds->command_args);
+	if (!b->len)
+		cmd_batches_pending++;
+	b->len += size;
+
+	if (!cmd_batch_evt)
+		cmd_batch_evt = schedule_event(0, cmd_batch_flush_event, NULL);
+
+	return 0;
+}
+
 static int hook_external_command(merlin_event *pkt, void *data)
 {
 	nebstruct_external_command_data *ds = (nebstruct_external_command_data *)data;
-	int cb_result = NEB_OK;
+	int cb_result = NEB_OK, batch = 0;
 
 	/*
 	 * all comments generate two events, but we only want to
@@ -675,6 +917,7 @@ static int hook_external_command(merlin_event *pkt, void *data)
 		 */
 		if (!merlin_sender)
 			pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
+		batch = 1;
 		break;
 
 	case CMD_SEND_CUSTOM_HOST_NOTIFICATION:
@@ -683,6 +926,7 @@ static int hook_external_command(merlin_event *pkt, void *data)
 			/* Send to correct node */
 			pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
 		}
+		batch = 1;
 		/*
 		 * Processing check results should only be done by the node owning the
 		 * object. Thus, forward to all nodes, but execute it only on the node
@@ -702,7 +946,7 @@ static int hook_external_command(merlin_event *pkt, void *data)
 				break;
 			}
 
-			this_host = find_host(strndupa(ds->command_args, delim - ds->command_args));
+			this_host = get_cmd_host(ds->command_args);
 			if(this_host == NULL) {
 				/*
 				 * Unknown host. Thus, nothing we know that we should handle.
@@ -726,6 +970,7 @@ static int hook_external_command(merlin_event *pkt, void *data)
 			/* Send to correct node */
 			pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
 		}
+		batch = 1;
 		/*
 		 * Processing check results should only be done by the node owning the
 		 * object. Thus, forward to all nodes, but execute it only on the node
@@ -833,6 +1078,10 @@ static int hook_external_command(merlin_event *pkt, void *data)
 
 	if (merlin_sender)
 		pkt->hdr.code = MAGIC_NONET;
+	else if (batch && !cmd_batch_add(pkt->hdr.selection, ds))
+		return cb_result;
+	else if (cmd_batches_pending)
+		cmd_batch_flush();
 
 	if(0 != send_generic(pkt, data)) {
 		ldebug("Can't send merlin packet for command %d",
@@ -1053,7 +1302,7 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 	merlin_event pkt;
 	int result = 0;
 	neb_cb_result *neb_result = NULL;
-	static time_t last_pulse = 0, last_flood_warning = 0;
+	static time_t last_flood_warning = 0;
 	time_t now;
 
 	if (!data) {
@@ -1070,12 +1319,6 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 	 */
 	check_dupes = 0;
 
-	/* self-heal nodes that have missed out on the fact that we're up */
-	now = time(NULL);
-	if(!last_pulse || now - last_pulse > 15)
-		node_send_ctrl_active(&ipc, CTRL_GENERIC, &ipc.info);
-	last_pulse = now;
-
 	memset(&pkt, 0, sizeof(pkt));
 	pkt.hdr.type = cb;
 	pkt.hdr.selection = DEST_BROADCAST;
@@ -1148,6 +1391,7 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 		neb_result = neb_cb_result_create_full(result, "No callback result description available");
 	}
 
+	now = time(NULL);
 	if (result < 0 && now - last_flood_warning > 30) {
 		/* log a warning every 30 seconds */
 		last_flood_warning = now;
@@ -1237,6 +1481,17 @@ int merlin_hooks_deinit(void)
 		neb_deregister_callback(cb->type, merlin_mod_hook);
 	}
 
+	if (cmd_batch_evt) {
+		destroy_event(cmd_batch_evt);
+		cmd_batch_evt = NULL;
+	}
+	cmd_batch_flush();
+	for (i = 0; i < cmd_batches; i++)
+		free(cmd_batch[i].pkt);
+	safe_free(cmd_batch);
+	cmd_batches = 0;
+	forget_packets();
+
 	return 0;
 }
 
@@ -1244,3 +1499,21 @@ void merlin_set_block_comment(nebstruct_comment_data *cmnt)
 {
 	block_comment = cmnt;
 }
+
+void merlin_set_batch_commands(int on)
+{
+	batch_commands = on;
+}
+
+void merlin_set_suppress_dupes(int on)
+{
+	suppress_dupes = on;
+	forget_packets();
+}
+
+unsigned long long merlin_dupe_hits(int cb_type)
+{
+	if (cb_type < 0 || cb_type > NEBCALLBACK_NUMITEMS)
+		return 0;
+	return dupe_hits[cb_type];
+}
@@ -9,5 +9,8 @@ extern void *neb_handle;
 extern int merlin_hooks_init(uint32_t mask);
 extern int merlin_hooks_deinit(void);
 extern void merlin_set_block_comment(nebstruct_comment_data *cmnt);
+extern void merlin_set_suppress_dupes(int on);
+extern void merlin_set_batch_commands(int on);
+extern unsigned long long merlin_dupe_hits(int cb_type);
 
 #endif
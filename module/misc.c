@@ -10,6 +10,7 @@
 #include <naemon/naemon.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <stdint.h>
 
 /* does a deep free of a file_list struct */
 void file_list_free(struct file_list *list)
@@ -183,7 +184,8 @@ static struct file_list *get_cfg_files(char *str, struct file_list *list)
 			list->name = nspath_absolute(&p[i], base_path);
 			if (!list->name)
 				return list;
-			stat(list->name, &list->st);
+			if (stat(list->name, &list->st) < 0)
+				memset(&list->st, 0, sizeof(list->st));
 		}
 		else if (!prefixcmp(&p[i], "cfg_dir=")) {
 			char *dir;
@@ -238,13 +240,20 @@ int hash_add_file(const char *path, blk_SHA_CTX *ctx)
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return -1;
-	fstat(fd, &st);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
 	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!map)
+	close(fd);
+	if (map == MAP_FAILED)
 		return -1;
 	blk_SHA1_Update(ctx, map, st.st_size);
 	munmap(map, st.st_size);
-	close(fd);
 
 	return 0;
 }
@@ -302,3 +311,245 @@ int get_config_hash(unsigned char *hash)
 
 	return 0;
 }
+
+/*
+ * Cache of the sha1 state after hashing each file in sorted order.
+ * The config hash covers all files concatenated, so it can't be
+ * built from per-file digests without changing its value (and then
+ * nodes running different versions would never agree on it).
+ * Instead we remember the hash state after each file, and when the
+ * config changes we only have to rehash from the first file that
+ * changed. If nothing changed we don't have to read anything at all.
+ * The cache is kept on disk so it survives restarts.
+ */
+struct oconf_hash_entry {
+	char *path;
+	uint64_t dev, ino, size;
+	uint64_t mtime, mtime_nsec;
+	uint64_t ctime, ctime_nsec;
+	blk_SHA_CTX ctx;
+};
+
+#define OCONF_HASH_CACHE_MAGIC 0x4d4f4843 /* "MOHC" */
+#define OCONF_HASH_CACHE_VERSION 1
+#define OCONF_HASH_CACHE_MAX_FILES (1 << 20)
+
+static struct oconf_hash_entry *ohc;
+static unsigned int ohc_len, ohc_loaded;
+
+static void ohc_set_key(struct oconf_hash_entry *e, const struct stat *st)
+{
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->ctime = st->st_ctim.tv_sec;
+	e->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int ohc_match(const struct oconf_hash_entry *e, const file_list *fl)
+{
+	struct oconf_hash_entry cur;
+
+	ohc_set_key(&cur, &fl->st);
+	return !strcmp(e->path, fl->name) &&
+		e->dev == cur.dev && e->ino == cur.ino && e->size == cur.size &&
+		e->mtime == cur.mtime && e->mtime_nsec == cur.mtime_nsec &&
+		e->ctime == cur.ctime && e->ctime_nsec == cur.ctime_nsec;
+}
+
+static void ohc_truncate(unsigned int len)
+{
+	unsigned int i;
+
+	for (i = len; i < ohc_len; i++)
+		free(ohc[i].path);
+	ohc_len = len;
+}
+
+static char *ohc_path(void)
+{
+	char *path;
+
+	nm_asprintf(&path, "%s/oconf-hash.cache", CACHEDIR);
+	return path;
+}
+
+static void ohc_load(void)
+{
+	char *path;
+	FILE *fp;
+	uint32_t hdr[4], i;
+
+	ohc_loaded = 1;
+	path = ohc_path();
+	fp = fopen(path, "r");
+	free(path);
+	if (!fp)
+		return;
+
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr[0] != OCONF_HASH_CACHE_MAGIC ||
+	    hdr[1] != OCONF_HASH_CACHE_VERSION ||
+	    hdr[2] != sizeof(blk_SHA_CTX) ||
+	    hdr[3] > OCONF_HASH_CACHE_MAX_FILES)
+	{
+		fclose(fp);
+		return;
+	}
+
+	ohc = calloc(hdr[3], sizeof(*ohc));
+	if (!ohc) {
+		fclose(fp);
+		return;
+	}
+
+	for (i = 0; i < hdr[3]; i++) {
+		struct oconf_hash_entry *e = &ohc[i];
+		uint32_t len;
+
+		if (fread(&len, sizeof(len), 1, fp) != 1 || !len || len >= PATH_MAX)
+			break;
+		if (!(e->path = malloc(len + 1)))
+			break;
+		if (fread(e->path, len, 1, fp) != 1) {
+			free(e->path);
+			break;
+		}
+		e->path[len] = 0;
+		if (fread(&e->dev, sizeof(uint64_t), 7, fp) != 7 ||
+		    fread(&e->ctx, sizeof(e->ctx), 1, fp) != 1)
+		{
+			free(e->path);
+			break;
+		}
+		ohc_len++;
+	}
+	fclose(fp);
+
+	/* a truncated cache is useless, since the last state is what we need */
+	if (i != hdr[3]) {
+		ldebug("oconf-hash: Ignoring truncated cache");
+		ohc_truncate(0);
+	}
+}
+
+static void ohc_save(void)
+{
+	char *path, *tmp;
+	FILE *fp;
+	uint32_t hdr[4] = {
+		OCONF_HASH_CACHE_MAGIC, OCONF_HASH_CACHE_VERSION,
+		sizeof(blk_SHA_CTX), 0,
+	};
+	unsigned int i;
+	int ret = 0;
+
+	path = ohc_path();
+	nm_asprintf(&tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w"))) {
+		ldebug("oconf-hash: Failed to open %s for writing: %s", tmp, strerror(errno));
+		free(tmp);
+		free(path);
+		return;
+	}
+
+	hdr[3] = ohc_len;
+	ret |= fwrite(hdr, sizeof(hdr), 1, fp) != 1;
+	for (i = 0; i < ohc_len; i++) {
+		struct oconf_hash_entry *e = &ohc[i];
+		uint32_t len = strlen(e->path);
+
+		ret |= fwrite(&len, sizeof(len), 1, fp) != 1;
+		ret |= fwrite(e->path, len, 1, fp) != 1;
+		ret |= fwrite(&e->dev, sizeof(uint64_t), 7, fp) != 7;
+		ret |= fwrite(&e->ctx, sizeof(e->ctx), 1, fp) != 1;
+	}
+	ret |= fclose(fp) != 0;
+
+	if (ret || rename(tmp, path) < 0) {
+		ldebug("oconf-hash: Failed to write %s", path);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+}
+
+/*
+ * Gets the timestamp of the last config change and the config hash
+ * (see get_config_hash()) with a single scan of the config files,
+ * only rehashing the files that changed since last time.
+ * *hash must hold at least 20 bytes
+ */
+int get_config_state(time_t *last_change, unsigned char *hash)
+{
+	struct file_list **sorted_flist;
+	unsigned int num_files = 0, i, resume = 0;
+	time_t mt = 0;
+	blk_SHA_CTX ctx;
+
+	if (!ohc_loaded)
+		ohc_load();
+
+	sorted_flist = get_sorted_oconf_files(&num_files);
+
+	for (i = 0; i < num_files; i++) {
+		if (sorted_flist[i]->st.st_mtime > mt)
+			mt = sorted_flist[i]->st.st_mtime;
+		if (resume == i && i < ohc_len && ohc_match(&ohc[i], sorted_flist[i]))
+			resume++;
+	}
+
+	if (resume == num_files && num_files == ohc_len) {
+		ldebug("oconf-hash: All %u files unchanged", num_files);
+	} else {
+		struct oconf_hash_entry *new_ohc;
+
+		ldebug("oconf-hash: Rehashing %u of %u files", num_files - resume, num_files);
+		ohc_truncate(resume);
+		new_ohc = realloc(ohc, (num_files ? num_files : 1) * sizeof(*ohc));
+		if (!new_ohc) {
+			ohc_truncate(0);
+			resume = 0;
+		} else {
+			ohc = new_ohc;
+		}
+
+		if (resume)
+			ctx = ohc[resume - 1].ctx;
+		else
+			blk_SHA1_Init(&ctx);
+
+		for (i = resume; i < num_files; i++) {
+			hash_add_file(sorted_flist[i]->name, &ctx);
+			if (new_ohc) {
+				struct oconf_hash_entry *e = &ohc[i];
+
+				e->path = strdup(sorted_flist[i]->name);
+				ohc_set_key(e, &sorted_flist[i]->st);
+				e->ctx = ctx;
+				ohc_len++;
+			}
+		}
+		if (new_ohc)
+			ohc_save();
+	}
+
+	if (num_files && ohc_len == num_files)
+		ctx = ohc[num_files - 1].ctx;
+	else if (!num_files)
+		blk_SHA1_Init(&ctx);
+	blk_SHA1_Final(hash, &ctx);
+
+	for (i = 0; i < num_files; i++) {
+		sorted_flist[i]->next = NULL;
+		file_list_free(sorted_flist[i]);
+	}
+	free(sorted_flist);
+
+	if (last_change)
+		*last_change = mt;
+
+	return 0;
+}
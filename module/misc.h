@@ -9,6 +9,7 @@ void file_list_free(struct file_list *list);
 time_t get_last_cfg_change(void);
 file_list **get_sorted_oconf_files(unsigned int *n_files);
 int get_config_hash(unsigned char *hash);
+int get_config_state(time_t *last_change, unsigned char *hash);
 int hash_add_file(const char *path, blk_SHA_CTX *ctx);
 
 #endif
@@ -1,5 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <naemon/naemon.h>
 #include <arpa/inet.h>
 #include "ipc.h"
@@ -13,8 +15,12 @@
 #include "config.h"
 #include "queries.h"
 #include "oconfsplit.h"
+#include "comment-index.h"
+#include "routing.h"
+#include "csync.h"
 #include "script-helpers.h"
 #include "net.h"
+#include "trace.h"
 
 merlin_node **host_check_node = NULL;
 merlin_node **service_check_node = NULL;
@@ -350,7 +356,9 @@ void handle_control(merlin_node *node, merlin_event *pkt)
 		  pkt->hdr.code, ctrl, node ? node->name : "local Merlin daemon");
 
 	/* protect against bogus headers */
-	if (!node && (pkt->hdr.code == CTRL_INACTIVE || pkt->hdr.code == CTRL_ACTIVE)) {
+	if (!node && (pkt->hdr.code == CTRL_INACTIVE || pkt->hdr.code == CTRL_ACTIVE ||
+	              pkt->hdr.code == CTRL_CSYNC))
+	{
 		lerr("Received %s with unknown node id %d", ctrl, pkt->hdr.selection);
 		return;
 	}
@@ -377,12 +385,16 @@ void handle_control(merlin_node *node, merlin_event *pkt)
 			return;
 		}
 		if ((ret = node_oconf_cmp(node, info))) {
-			csync_node_active(node, info, ret);
+			/* a native sync needs the connection, so we stay negotiating */
+			if (csync_node_active(node, info, ret))
+				return;
 			node_disconnect(node, "Incompatible object config (sync triggered)");
 			return;
 		} else {
 			ldebug("CSYNC: %s has object config already up to date", node->name);
 		}
+		node->same_oconf = !memcmp(info->config_hash, ipc.info.config_hash,
+		                           sizeof(info->config_hash));
 
 		/* node sent info we can use, so do that */
 		memcpy(&node->info, pkt->body, sizeof(node->info));
@@ -393,6 +405,9 @@ void handle_control(merlin_node *node, merlin_event *pkt)
 				   node_type(node), node->name);
 		}
 		break;
+	case CTRL_CSYNC:
+		csync_native_input(node, pkt);
+		break;
 	case CTRL_STALL:
 	case CTRL_RESUME:
 		linfo("Received (and ignoring) CTRL_{STALL,RESUME} event.");
@@ -457,13 +472,44 @@ static int handle_checkresult(struct check_result *cr, monitored_object_state *s
 	return ret;
 }
 
+/*
+ * Nodes running the exact same object config as we do have the same
+ * object ids, so events from them can be matched by id instead of
+ * by name. We still check the name, since it's cheap and the cost
+ * of updating the wrong object is not.
+ */
+static host *find_host_by_header(merlin_node *node, merlin_header *hdr, const char *name)
+{
+	if (node->same_oconf && name && hdr->object_id && hdr->object_id <= num_objects.hosts) {
+		host *h = host_ary[hdr->object_id - 1];
+		if (h && !strcmp(h->name, name))
+			return h;
+	}
+
+	return find_host(name);
+}
+
+static service *find_service_by_header(merlin_node *node, merlin_header *hdr,
+                                       const char *host_name, const char *desc)
+{
+	if (node->same_oconf && host_name && desc &&
+	    hdr->object_id && hdr->object_id <= num_objects.services)
+	{
+		service *s = service_ary[hdr->object_id - 1];
+		if (s && !strcmp(s->description, desc) && !strcmp(s->host_name, host_name))
+			return s;
+	}
+
+	return find_service(host_name, desc);
+}
+
 static int handle_host_result(merlin_node *node, merlin_header *hdr, void *buf)
 {
 	host *obj;
 	merlin_host_status *st_obj = (merlin_host_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_host(st_obj->name);
+	obj = find_host_by_header(node, hdr, st_obj->name);
 	if (!obj) {
 		lerr("Host '%s' not found. Ignoring %s event",
 		     st_obj->name, callback_name(hdr->type));
@@ -508,7 +554,7 @@ static int handle_service_result(merlin_node *node, merlin_header *hdr, void *bu
 	merlin_service_status *st_obj = (merlin_service_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_service(st_obj->host_name, st_obj->service_description);
+	obj = find_service_by_header(node, hdr, st_obj->host_name, st_obj->service_description);
 	if (!obj) {
 		lerr("Service '%s' on host '%s' not found. Ignoring %s event",
 		     st_obj->service_description, st_obj->host_name,
@@ -572,14 +618,9 @@ static int handle_notification_data(__attribute__((unused)) merlin_node *node, v
 	return 0;
 }
 
-static int handle_external_command(merlin_node *node, void *buf)
+static int remote_command_allowed(int command_type)
 {
-	nebstruct_external_command_data *ds = (nebstruct_external_command_data *)buf;
-
-	ldebug("EXTCMD: from %s: [%ld] %d;%s",
-		   node->name, ds->entry_time, ds->command_type, ds->command_args);
-
-	switch (ds->command_type) {
+	switch (command_type) {
 	case CMD_RESTART_PROCESS:
 	case CMD_SHUTDOWN_PROCESS:
 		/*
@@ -601,10 +642,52 @@ static int handle_external_command(merlin_node *node, void *buf)
 		return 0;
 	}
 
+	return 1;
+}
+
+static int handle_external_command(merlin_node *node, void *buf)
+{
+	nebstruct_external_command_data *ds = (nebstruct_external_command_data *)buf;
+
+	ldebug("EXTCMD: from %s: [%ld] %d;%s",
+		   node->name, ds->entry_time, ds->command_type, ds->command_args);
+
+	if (!remote_command_allowed(ds->command_type))
+		return 0;
+
 	process_external_command2(ds->command_type, ds->entry_time, ds->command_args);
 	return 1;
 }
 
+/* runs the commands in a CMD_BATCH_PACKET, in the order they were sent */
+static int handle_command_batch(merlin_node *node, merlin_event *pkt)
+{
+	uint32_t offset = 0;
+	int ret = 0;
+
+	while (pkt->hdr.len - offset >= sizeof(struct merlin_cmd_entry)) {
+		struct merlin_cmd_entry *ent = (struct merlin_cmd_entry *)(pkt->body + offset);
+
+		offset += sizeof(*ent);
+		if (!ent->len || ent->len > pkt->hdr.len - offset || ent->args[ent->len - 1]) {
+			lerr("EXTCMD: Malformed command batch from %s %s. Ignoring the rest of it",
+			     node_type(node), node->name);
+			break;
+		}
+		offset += ent->len;
+
+		ldebug("EXTCMD: from %s: [%ld] %u;%s", node->name,
+		       (long)ent->entry_time, ent->command_type, ent->args);
+		if (!remote_command_allowed(ent->command_type))
+			continue;
+
+		process_external_command2(ent->command_type, ent->entry_time, ent->args);
+		ret++;
+	}
+
+	return ret;
+}
+
 static int matching_comment(comment *cmnt, nebstruct_comment_data *ds)
 {
 	/*
@@ -662,28 +745,18 @@ static int handle_comment_data(merlin_node *node, merlin_header *hdr, void *buf)
 	}
 
 	if (ds->type == NEBTYPE_COMMENT_DELETE) {
-		comment *cmnt, *next_cmnt;
-
-		if (ds->comment_type == HOST_COMMENT) {
-			cmnt = get_first_comment_by_host(ds->host_name);
-			for (; cmnt; cmnt = next_cmnt) {
-				next_cmnt = cmnt->nexthash;
-				if (matching_comment(cmnt, ds)) {
-					merlin_set_block_comment(ds);
-					delete_comment(cmnt->comment_type, cmnt->comment_id);
-					merlin_set_block_comment(NULL);
-				}
-			}
-		} else {
-			/* this is *really* expensive. Sort of wtf? */
-			for (cmnt = comment_list; cmnt; cmnt = next_cmnt) {
-				next_cmnt = cmnt->next;
-
-				if (matching_comment(cmnt, ds)) {
-					merlin_set_block_comment(ds);
-					delete_comment(cmnt->comment_type, cmnt->comment_id);
-					merlin_set_block_comment(NULL);
-				}
+		struct comment_ref *ref, *next_ref;
+
+		for (ref = comment_index_lookup(ds); ref; ref = next_ref) {
+			comment *cmnt;
+
+			/* deleting the comment removes ref from the index */
+			next_ref = ref->next;
+			cmnt = find_comment(ref->comment_id, ref->comment_type);
+			if (cmnt && matching_comment(cmnt, ds)) {
+				merlin_set_block_comment(ds);
+				delete_comment(cmnt->comment_type, cmnt->comment_id);
+				merlin_set_block_comment(NULL);
 			}
 		}
 		return 0;
@@ -783,7 +856,7 @@ static int handle_flapping_data(merlin_node *node, void *buf)
 /* Handles an event received from another node */
 int handle_event(merlin_node *node, merlin_event *pkt)
 {
-	uint i;
+	unsigned long long start;
 	int ret = 0;
 
 	if (!pkt) {
@@ -803,6 +876,8 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 		return 0;
 	}
 
+	trace_event(TRACE_HANDLE_EVENT, node, pkt);
+
 	if (pkt->hdr.type == CTRL_PACKET) {
 		handle_control(node, pkt);
 		return 0;
@@ -813,7 +888,17 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 		lerr("Received data from not connected node '%s'. State is %s\n",
 			 node->name, node_state(node));
 		return 0;
-	} else if (node->type == MODE_POLLER && num_masters) {
+	}
+
+	/*
+	 * object ids only mean something between nodes that share the
+	 * same object config, so don't pass on ids from nodes whose
+	 * config differs from ours
+	 */
+	if (!node->same_oconf)
+		pkt->hdr.object_id = 0;
+
+	if (node->type == MODE_POLLER && num_masters) {
 		ldebug("Passing on event from poller %s to %d masters",
 		       node->name, num_masters);
 		net_sendto_many(noc_table, num_masters, pkt);
@@ -825,10 +910,7 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 		if (pkt->hdr.type != NEBCALLBACK_PROGRAM_STATUS_DATA &&
 		    pkt->hdr.type != NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA)
 		{
-			for (i = 0; i < num_pollers; i++) {
-				merlin_node *n = poller_table[i];
-				net_sendto(n, pkt);
-			}
+			net_sendto_many(poller_table, num_pollers, pkt);
 		}
 	}
 
@@ -851,8 +933,27 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 	node->stats.bytes.read += packet_size(pkt);
 	node_log_event_count(node, 0);
 
+	/* how long it took the check result to get here from wherever it ran */
+	if (pkt->hdr.type == NEBCALLBACK_HOST_CHECK_DATA ||
+	    pkt->hdr.type == NEBCALLBACK_SERVICE_CHECK_DATA)
+	{
+		node_latency_since(node, NODE_LAT_PROPAGATION, &pkt->hdr.sent);
+	}
+
+	/* merlind has no use for commands, and couldn't decode a batch */
+	if (pkt->hdr.type == CMD_BATCH_PACKET) {
+		start = histogram_clock();
+		merlin_sender = node;
+		recv_event = pkt;
+		ret = handle_command_batch(node, pkt);
+		merlin_sender = NULL;
+		recv_event = NULL;
+		histogram_add(&node->stats.latency[NODE_LAT_HANDLER], histogram_clock() - start);
+		return ret;
+	}
+
 	/* send to daemon before we decode */
-	if (daemon_wants(pkt->hdr.type)) {
+	if (ipc_wants(pkt->hdr.type, pkt->body)) {
 		ipc_send_event(pkt);
 	}
 
@@ -872,6 +973,8 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 		return 0;
 	}
 
+	start = histogram_clock();
+
 	/* restore the pointers so the various handlers won't have to */
 	if (merlin_decode_event(node, pkt)) {
 		return 0;
@@ -916,116 +1019,33 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 	}
 	merlin_sender = NULL;
 	recv_event = NULL;
+	histogram_add(&node->stats.latency[NODE_LAT_HANDLER], histogram_clock() - start);
 
 	return ret;
 }
 
 
-static int ipc_reaper(int sd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
-{
-	/*
-	 * this function doesn't really do anything anymore,
-	 * but in case we want to handle pingbacks from the daemon,
-	 * this is where they'll end up.
-	 * For now we just empty the socket
-	 */
-	char buf[4096];
-	int ret;
-
-	do {
-		ret = read(sd, buf, sizeof(buf));
-		if (!ret) {
-			node_disconnect(&ipc, "read() returned zero");
-		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-			/* ignored. if this happens, the iobroker is busted */
-			return 0;
-		} else {
-			node_disconnect(&ipc, "read() failed with error %d: %s", errno, strerror(errno));
-			return 0;
-		}
-	} while (ret > 0);
-
-	return 0;
-}
-
-GHashTable *host_hash_table;
-node_selection *node_selection_by_hostname(const char *name)
-{
-	return g_hash_table_lookup(host_hash_table, name);
-}
-
-struct host_hash_table_add_parameters
-{
-	node_selection *sel;
-	int *num_ents;
-};
-
-static gboolean host_hash_table_add_host(gpointer _name, gpointer _hst, gpointer user_data)
-{
-	struct host_hash_table_add_parameters *params = (struct host_hash_table_add_parameters *)user_data;
-	host *hst = (host *)_hst;
-	node_selection *cur = node_selection_by_hostname(hst->name);
-
-	/*
-	 * this should never happen, but if it does
-	 * we just ignore it and move on
-	 */
-	if (cur == params->sel)
-		return FALSE;
-
-	if (cur) {
-		lwarn("'%s' is checked by selection '%s', so can't add to selection '%s'",
-			  hst->name, cur->name, params->sel->name);
-		return FALSE;
-	}
-	params->num_ents[params->sel->id]++;
-
-	g_hash_table_insert(host_hash_table, hst->name, params->sel);
-	return FALSE;
-}
-
-static void setup_host_hash_tables(void)
+static int ipc_reaper(__attribute__((unused)) int sd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
 {
-	hostgroup *hg;
-	int i, nsel;
-	int *num_ents = NULL;
-
-	nsel = get_num_selections();
-
-	host_hash_table = g_hash_table_new(g_str_hash, g_str_equal);
-
-	/*
-	 * only bother if we've got hostgroups, pollers and selections.
-	 * Otherwise we'll just be wasting perfectly good memory
-	 * for no good reason
-	 */
-	if (!hostgroup_list || !num_pollers || !nsel)
-		return;
-
-	num_ents = calloc(nsel, sizeof(int));
-
 	/*
-	 * we must loop each hostgroup once, or we'll log a lot of
-	 * spurious warnings that aren't exactly accurate
+	 * merlind only talks back to tell us which events it wants
+	 * and to offer us a shared memory ring for them. Everything
+	 * else it might send is ignored.
 	 */
-	for (hg = hostgroup_list; hg; hg = hg->next) {
-		struct host_hash_table_add_parameters params;
-		params.sel = node_selection_by_name(hg->group_name);
-		params.num_ents = num_ents;
-
-		if (!params.sel)
-			continue;
+	merlin_event *pkt;
 
-		g_tree_foreach(hg->members, host_hash_table_add_host, &params);
-	}
+	if (ipc_recv() <= 0)
+		return 0;
 
-	for (i = 0; i < nsel; i++) {
-		if (!num_ents[i])
-			lwarn("'%s' is a selection without hosts. Are you sure you want this?",
-				  get_sel_name(i));
+	while ((pkt = node_get_event(&ipc))) {
+		if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_SHMRING)
+			ipc_ring_attach();
+		else if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_FILTER)
+			ipc_filter_set(pkt);
+		free(pkt);
 	}
 
-	free(num_ents);
+	return 0;
 }
 
 static int parse_event_filter(const char *orig_str, uint32_t *evt_mask)
@@ -1106,6 +1126,14 @@ static void grok_module_compound(struct cfg_comp *comp)
 				cfg_error(comp, v, "Illegal value for %s", v->key);
 			continue;
 		}
+		if (!strcmp(v->key, "suppress_dupes")) {
+			merlin_set_suppress_dupes(strtobool(v->value));
+			continue;
+		}
+		if (!strcmp(v->key, "batch_commands")) {
+			merlin_set_batch_commands(strtobool(v->value));
+			continue;
+		}
 		if (!strcmp(v->key, "notifies")) {
 			if (!strtobool(v->value)) {
 				ipc.flags &= ~(MERLIN_NODE_NOTIFIES);
@@ -1223,73 +1251,141 @@ NEB_API_VERSION(CURRENT_NEB_API_VERSION);
 void *neb_handle = NULL;
 
 /*
- * Attempt to connect to as-yet unconnected nodes. We run this
- * every second
+ * Node maintenance. Every node, and the ipc connection, has a timer
+ * of its own that sends pulses so our fellow nodes don't forget about
+ * us, disconnects nodes that have been silent for more than their
+ * data_timeout, gives up on connection attempts and handshakes that
+ * take too long and tries connecting to nodes we've lost. The timer
+ * fires when the earliest of those is due. Since connects are never
+ * waited for, any number of them can be in progress at once.
+ *
+ * Pulses and connect attempts are spread out a bit at random, so we
+ * don't talk to every node in the same second, and connect attempts
+ * back off exponentially while a node stays unreachable. That way a
+ * master coming back up isn't hit by all its pollers at once.
  */
-static time_t connect_interval = 1;
-static void connect_to_all(struct nm_event_execution_properties *evprop)
-{
-	unsigned int i;
+#define NODE_SCHED_BACKOFF_MAX 60
+static unsigned int sched_seed;
 
-	if (evprop->execution_type != EVENT_EXEC_NORMAL)
-		return;
+static void node_sched_run(struct nm_event_execution_properties *evprop);
 
-	schedule_event(connect_interval, connect_to_all, NULL);
+/*
+ * between 0.75 * interval and interval seconds after now. Jitter is
+ * only ever subtracted, so pulses never come further apart than
+ * pulse_interval and nodes don't get closer to their data_timeout.
+ */
+static time_t node_sched_jitter(time_t now, unsigned int interval)
+{
+	return now + interval - rand_r(&sched_seed) % (interval / 4 + 1);
+}
 
-	if (!ipc_is_connected(0)) {
-		ipc_init();
+static time_t node_sched_next(merlin_node *node, time_t now)
+{
+	time_t next;
+
+	if (node->state == STATE_CONNECTED) {
+		next = node->next_pulse;
+		if (node != &ipc && node->data_timeout && node->last_recv + node->data_timeout < next)
+			next = node->last_recv + node->data_timeout;
+	} else if (node == &ipc) {
+		next = node->next_connect < node->next_pulse ? node->next_connect : node->next_pulse;
+	} else if (node->state == STATE_NONE) {
+		next = node->next_connect;
+	} else {
+		next = node->conn_deadline ? node->conn_deadline : now + MERLIN_CONNECT_TIMEOUT;
 	}
 
-	for (i = 0; i < num_nodes; i++) {
-		merlin_node *node = node_table[i];
-		if (node->state == STATE_CONNECTED || node->state == STATE_PENDING)
-			continue;
-		net_try_connect(node);
-	}
+	return next;
 }
 
 /*
- * This is a scheduled event. Its occurence is stated in seconds in the
- * variable 'pulse_interval (shared.c)'. We send this pulse because we don't
- * want our fellow nodes to forget about us. It shouldn't happen, but there are
- * stranger things than random bugs in computer programs.
+ * Makes sure the node's timer fires no later than its next deadline.
+ * An event that's superseded by an earlier one is left in the queue
+ * and ignored by node_sched_run() when it fires.
  */
-static void send_pulse(struct nm_event_execution_properties *evprop)
+static void node_sched_update(merlin_node *node)
 {
-	unsigned int i;
+	time_t now = time(NULL), next;
 
-	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+	next = node_sched_next(node, now);
+	if (next <= now)
+		next = now + 1;
+	if (node->sched_evt && node->sched_at <= next)
 		return;
 
-	schedule_event(pulse_interval, send_pulse, NULL);
-	node_send_ctrl_active(&ipc, CTRL_GENERIC, &ipc.info);
-	for (i = 0; i < num_nodes; i++) {
-		merlin_node *node = noc_table[i];
-		if (node->state == STATE_CONNECTED) {
-			node_send_ctrl_active(node, CTRL_GENERIC, &ipc.info);
+	node->sched_at = next;
+	node->sched_evt = schedule_event(next - now, node_sched_run, node);
+}
+
+static void node_sched_connect(merlin_node *node, time_t now)
+{
+	if (node == &ipc) {
+		node->next_connect = now + 1;
+		if (!ipc_is_connected(0)) {
+			ipc_init();
 		}
+		return;
 	}
+
+	if (!node->connect_backoff)
+		node->connect_backoff = MERLIN_CONNECT_INTERVAL;
+	else if (node->connect_backoff < NODE_SCHED_BACKOFF_MAX / 2)
+		node->connect_backoff *= 2;
+	else
+		node->connect_backoff = NODE_SCHED_BACKOFF_MAX;
+	node->next_connect = node_sched_jitter(now, node->connect_backoff);
+	net_try_connect(node);
 }
 
-/*
- * This is a scheduled event. Its occurence is stated in seconds in the
- * variable 'node_activity_check_interval (shared.c)'. We check if our fellow
- * nodes have been active lately and if a node has been silent for
- * more than their data_timeout parameter they should be considered down.
- */
-static void disconnect_inactive_nodes(struct nm_event_execution_properties *evprop)
+static void node_sched_run(struct nm_event_execution_properties *evprop)
 {
-	unsigned int i;
+	merlin_node *node = (merlin_node *)evprop->user_data;
+	time_t now;
 
 	if (evprop->execution_type != EVENT_EXEC_NORMAL)
 		return;
+	if (evprop->attributes.timed.event != node->sched_evt)
+		return;
+
+	node->sched_evt = NULL;
+	now = time(NULL);
+
+	/* ipc gets its pulse even when it's down, which reconnects it */
+	if ((node == &ipc || node->state == STATE_CONNECTED) && now >= node->next_pulse) {
+		node->next_pulse = node_sched_jitter(now, pulse_interval);
+		node_send_ctrl_active(node, CTRL_GENERIC, &ipc.info);
+	}
+
+	if (node != &ipc && node->state == STATE_CONNECTED)
+		disconnect_inactive(node);
+	else if (node != &ipc && node->state != STATE_NONE)
+		disconnect_stalled(node);
+
+	if (node == &ipc && node->state != STATE_CONNECTED && now >= node->next_connect)
+		node_sched_connect(node, now);
+	else if (node->state == STATE_NONE && now >= node->next_connect)
+		node_sched_connect(node, now);
+
+	node_sched_update(node);
+}
+
+static void node_sched_init(void)
+{
+	time_t now = time(NULL);
+	unsigned int i;
+
+	sched_seed = now ^ getpid();
+
+	/* merlind should hear from us right away */
+	ipc.next_connect = ipc.next_pulse = now;
+	node_sched_update(&ipc);
 
-	schedule_event(node_activity_check_interval, disconnect_inactive_nodes, NULL);
 	for (i = 0; i < num_nodes; i++) {
-		merlin_node *node = noc_table[i];
-		if(node->state != STATE_NONE) {
-			disconnect_inactive(node);
-		}
+		merlin_node *node = node_table[i];
+		node->connect_backoff = 0;
+		node->next_connect = now + rand_r(&sched_seed) % MERLIN_CONNECT_INTERVAL;
+		node->next_pulse = node_sched_jitter(now, pulse_interval);
+		node_sched_update(node);
 	}
 }
 
@@ -1330,7 +1426,7 @@ static int post_config_init(int cb, void *ds)
 		linfo("Object configuration parsed.");
 		if (pgroup_init() < 0)
 			return -1;
-		setup_host_hash_tables();
+		routing_init();
 		pgroup_assign_peer_ids(ipc.pgroup);
 
 		expired_hosts = calloc(num_objects.hosts, sizeof(void *));
@@ -1344,11 +1440,9 @@ static int post_config_init(int cb, void *ds)
 		/*
 		 * it's safe to send the hash of the config we're using now that
 		 * we know the local host could parse it properly.
-		 * Note that this also sets up the repeating pulse-timer.
+		 * Note that this also sets up the per-node maintenance timers.
 		 */
-		schedule_event(0, connect_to_all, NULL);
-		schedule_event(0, send_pulse, NULL);
-		schedule_event(0, disconnect_inactive_nodes, NULL);
+		node_sched_init();
 
 		/*
 	 	* now we register the hooks we're interested in, avoiding
@@ -1388,7 +1482,12 @@ static int ipc_action_handler(merlin_node *node, int prev_state)
 	}
 
 	if (ipc.state != STATE_CONNECTED) {
-		/* everything is handled in node_disconnect() */
+		/*
+		 * everything else is handled in node_disconnect(). Events
+		 * for the backlog must suit whichever merlind comes next
+		 */
+		ipc_filter_reset();
+		node_sched_update(&ipc);
 		return 0;
 	}
 
@@ -1416,17 +1515,34 @@ static int ipc_action_handler(merlin_node *node, int prev_state)
 
 static int node_action_handler(merlin_node *node, int prev_state)
 {
+	time_t now = time(NULL);
+	unsigned int backoff;
+
 	switch (node->state) {
 	case STATE_CONNECTED:
 		pgroup_assign_peer_ids(node->pgroup);
+		node->connect_backoff = 0;
+		node->next_connect = 0;
+		node->conn_deadline = 0;
+		node->next_pulse = node_sched_jitter(now, pulse_interval);
+		node_sched_update(node);
 		break;
+	case STATE_PENDING:
 	case STATE_NEGOTIATING:
-		node_send_ctrl_active(node, 0, &ipc.info);
+		node->conn_deadline = now + MERLIN_CONNECT_TIMEOUT;
+		node_sched_update(node);
 		break;
 	case STATE_NONE:
+		csync_native_abort(node, "Disconnected");
 		memset(&node->info, 0, sizeof(node->info));
-		pgroup_assign_peer_ids(node->pgroup);
+		if (prev_state == STATE_CONNECTED)
+			pgroup_assign_peer_ids(node->pgroup);
 		node->sock = -1;
+		node->conn_deadline = 0;
+		backoff = node->connect_backoff ? node->connect_backoff : MERLIN_CONNECT_INTERVAL;
+		if (node->next_connect < now)
+			node->next_connect = node_sched_jitter(now, backoff);
+		node_sched_update(node);
 		break;
 	}
 
@@ -1450,7 +1566,9 @@ static void post_process_nodes(void)
 			memcpy(node->expected.config_hash, ipc.info.config_hash, sizeof(ipc.info.config_hash));
 		}
 		/* set the default push command for everything but masters */
-		if (node->type != MODE_MASTER && !node->csync.configured && global_csync.push.cmd) {
+		if (node->type != MODE_MASTER && !node->csync.configured && csync_is_native(global_csync.push.cmd)) {
+			node->csync.push.cmd = strdup(global_csync.push.cmd);
+		} else if (node->type != MODE_MASTER && !node->csync.configured && global_csync.push.cmd) {
 			if (asprintf(&node->csync.push.cmd, "%s %s", global_csync.push.cmd, node->name) < 0)
 				lerr("CSYNC: Failed to add per-node push command for %s %s: %s",
 					 node_type(node), node->name, strerror(errno));
@@ -1459,7 +1577,9 @@ static void post_process_nodes(void)
 					   node_type(node), node->name, node->csync.push.cmd);
 		}
 		/* set the default fetch command for all masters */
-		if (node->type == MODE_MASTER && !node->csync.configured && global_csync.fetch.cmd) {
+		if (node->type == MODE_MASTER && !node->csync.configured && csync_is_native(global_csync.fetch.cmd)) {
+			node->csync.fetch.cmd = strdup(global_csync.fetch.cmd);
+		} else if (node->type == MODE_MASTER && !node->csync.configured && global_csync.fetch.cmd) {
 			if (asprintf(&node->csync.fetch.cmd, "%s %s", global_csync.fetch.cmd, node->name) < 0) {
 				lerr("CSYNC: Failed to add per-node fetch command for %s %s: %s",
 					 node_type(node), node->name, strerror(errno));
@@ -1556,6 +1676,7 @@ int nebmodule_init(__attribute__((unused)) int flags, char *arg, nebmodule *hand
 		return -1;
 	}
 	log_init();
+	trace_init();
 
 
 	/*
@@ -1587,12 +1708,14 @@ int nebmodule_init(__attribute__((unused)) int flags, char *arg, nebmodule *hand
 	ipc.info.monitored_object_state_size = sizeof(monitored_object_state);
 	ipc.info.object_structure_version = CURRENT_OBJECT_STRUCTURE_VERSION;
 	gettimeofday(&ipc.info.start, NULL);
-	ipc.info.last_cfg_change = get_last_cfg_change();
-	get_config_hash(ipc.info.config_hash);
+	get_config_state(&ipc.info.last_cfg_change, ipc.info.config_hash);
 
 	/* make sure we can catch whatever we want */
 	event_broker_options = BROKER_EVERYTHING;
 
+	if (comment_index_init(neb_handle) < 0)
+		lerr("Failed to register comment index callback");
+
 	/* this gets de-registered immediately, so we need to add it manually */
 	neb_register_callback(NEBCALLBACK_PROCESS_DATA, neb_handle, 0, post_config_init);
 
@@ -1641,7 +1764,8 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 	}
 	safe_free(node_table);
 
-	g_hash_table_destroy(host_hash_table);
+	routing_deinit();
+	comment_index_deinit();
 
 	binlog_wipe(ipc.binlog, BINLOG_UNLINK);
 
@@ -1657,6 +1781,7 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 	 * deinit logfiles last, so nothing reopens them while
 	 * we're shutting down other parts
 	 */
+	trace_deinit();
 	log_deinit();
 
 	return 0;
@@ -51,9 +51,6 @@ extern merlin_node **host_check_node;
 extern merlin_node **service_check_node;
 extern merlin_node *merlin_sender;
 
-extern GHashTable *host_hash_table;
-extern node_selection *node_selection_by_hostname(const char *name);
-
 /** global variables exported by Nagios **/
 extern int __nagios_object_structure_version;
 
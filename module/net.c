@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include "module.h"
@@ -11,9 +12,6 @@
 #include "ipc.h"
 #include "net.h"
 
-#define MERLIN_CONNECT_TIMEOUT 20 /* the (hardcoded) connect timeout we use */
-#define MERLIN_CONNECT_INTERVAL 5 /* connect interval */
-
 static int net_sock = -1; /* listening sock descriptor */
 
 static unsigned short net_source_port(merlin_node *node)
@@ -21,6 +19,41 @@ static unsigned short net_source_port(merlin_node *node)
 	return ntohs(node->sain.sin_port) + default_port;
 }
 
+static void net_setsockopt(merlin_node *node, int sd, int level, int opt, const char *name, int val)
+{
+	if (val < 0)
+		return;
+
+	if (setsockopt(sd, level, opt, &val, sizeof(val)) < 0) {
+		lwarn("CONN: Failed to set %s to %d on socket %d for node %s: %s",
+		      name, val, sd, node->name, strerror(errno));
+	}
+}
+
+/*
+ * Apply the node's configured transport options. Buffer sizes must
+ * be set before connect() for the window scaling to make use of them
+ */
+static void net_set_sockopts(merlin_node *node, int sd)
+{
+	struct merlin_sockopts *so = &node->sockopts;
+
+	net_setsockopt(node, sd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", so->sndbuf);
+	net_setsockopt(node, sd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", so->rcvbuf);
+	net_setsockopt(node, sd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", so->nodelay);
+	if (so->keepidle > 0 || so->keepintvl > 0 || so->keepcnt > 0)
+		net_setsockopt(node, sd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+	net_setsockopt(node, sd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", so->keepidle);
+	net_setsockopt(node, sd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", so->keepintvl);
+	net_setsockopt(node, sd, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", so->keepcnt);
+#ifdef TCP_USER_TIMEOUT
+	net_setsockopt(node, sd, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", so->user_timeout);
+#endif
+#ifdef SO_BUSY_POLL
+	net_setsockopt(node, sd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", so->busy_poll);
+#endif
+}
+
 static merlin_node *find_node(struct sockaddr_in *sain)
 {
 	uint i;
@@ -33,7 +66,6 @@ static merlin_node *find_node(struct sockaddr_in *sain)
 		merlin_node *node = node_table[i];
 		unsigned short source_port = ntohs(sain->sin_port);
 		unsigned short in_port = net_source_port(node);
-		ldebug("FINDNODE: node->sain.sin_addr.s_addr: %d", node->sain.sin_addr.s_addr);
 		if (node->sain.sin_addr.s_addr == sain->sin_addr.s_addr) {
 			if (source_port == in_port) {
 				/* perfect match */
@@ -151,6 +183,8 @@ int net_input(int sd, int io_evt, void *node_)
 
 	while ((pkt = node_get_event(node))) {
 		events++;
+		/* it speaks merlin, so the handshake is up to the protocol now */
+		node->conn_deadline = 0;
 		handle_event(node, pkt);
 		free(pkt);
 	}
@@ -252,8 +286,8 @@ static int conn_writable(int sd, int events, void *node_)
 		node->sock = sd;
 		node->conn_sock = -1;
 		if (!net_is_connected(node)) {
+			/* this closes sd, since it's node->sock now */
 			node_disconnect(node, "Connection attempt failed: %s", strerror(errno));
-			close(sd);
 			return 0;
 		}
 		iobroker_register(nagios_iobs, sd, node, net_input);
@@ -381,6 +415,8 @@ int net_try_connect(merlin_node *node)
 		}
 	}
 
+	net_set_sockopts(node, node->conn_sock);
+
 	if (fcntl(node->conn_sock, F_SETFL, O_NONBLOCK) < 0) {
 		lwarn("CONN: Failed to set socket %d for %s non-blocking: %s", node->conn_sock, node->name, strerror(errno));
 	}
@@ -466,6 +502,7 @@ static int net_accept_one(int sd, int events, void *discard)
 		close(sock);
 		return 0;
 	}
+	net_set_sockopts(node, sock);
 
 	switch (node->state) {
 	case STATE_NEGOTIATING:
@@ -524,9 +561,22 @@ int net_deinit(void)
 /*
  * set up the listening socket (if applicable)
  */
+/* a node's batch of events has waited long enough */
+static int coalesce_timeout(int sd, __attribute__((unused)) int events, void *arg)
+{
+	merlin_node *node = (merlin_node *)arg;
+	uint64_t expirations;
+
+	if (read(sd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		lerr("Failed to read batch timer for %s: %s", node->name, strerror(errno));
+	node_coalesce_flush(node);
+	return 0;
+}
+
 int net_init(void)
 {
-	int result, sockopt = 1;
+	unsigned int i;
+	int result, sockopt = 1, rcvbuf = 0;
 	struct sockaddr_in sain, inbound;
 	struct sockaddr *sa = (struct sockaddr *)&sain;
 	socklen_t addrlen = sizeof(inbound);
@@ -547,6 +597,17 @@ int net_init(void)
 	/* if this fails we can do nothing but try anyway */
 	(void)setsockopt(net_sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(int));
 
+	/*
+	 * accepted sockets get their window scaling from the listening
+	 * one, so it needs the largest receive buffer any node wants
+	 */
+	for (i = 0; i < num_nodes; i++) {
+		if (node_table[i]->sockopts.rcvbuf > rcvbuf)
+			rcvbuf = node_table[i]->sockopts.rcvbuf;
+	}
+	if (rcvbuf)
+		(void)setsockopt(net_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+
 	result = bind(net_sock, sa, addrlen);
 	if (result < 0)
 		return -1;
@@ -561,6 +622,24 @@ int net_init(void)
 		return -1;
 	}
 
+	for (i = 0; i < num_masters; i++) {
+		merlin_node *node = noc_table[i];
+		int sd = node_coalesce_init(node);
+
+		if (sd < 0)
+			continue;
+		result = iobroker_register(nagios_iobs, sd, node, coalesce_timeout);
+		if (result < 0) {
+			lerr("IOB: Failed to register batch timer for %s: %s. Not batching events",
+			     node->name, iobroker_strerror(result));
+			close(sd);
+			node->coalesce_timer = -1;
+			continue;
+		}
+		linfo("Sending events to %s in batches of %u bytes or %u msec",
+		      node->name, node->coalesce_size, node->coalesce_msec);
+	}
+
 	return 0;
 }
 
@@ -576,17 +655,30 @@ int net_sendto(merlin_node *node, merlin_event *pkt)
 	return node_send_event(node, pkt, 0);
 }
 
+/* send a packet shared with other nodes to a specific host */
+int net_fanout_sendto(merlin_node *node, merlin_fanout *fo)
+{
+	if (!fo || !fo->pkt || !node) {
+		lerr("net_fanout_sendto() called with neither node nor pkt");
+		return -1;
+	}
+
+	return node_fanout_send(node, fo, 0);
+}
+
 int net_sendto_many(merlin_node **ntable, uint num, merlin_event *pkt)
 {
 	uint i;
+	merlin_fanout fo = MERLIN_FANOUT_INIT(pkt);
 
 	if (!ntable || !pkt || !num || !*ntable)
 		return -1;
 
 	for (i = 0; i < num; i++) {
 		merlin_node *node = ntable[i];
-		net_sendto(node, pkt);
+		net_fanout_sendto(node, &fo);
 	}
+	node_fanout_release(&fo);
 
 	return 0;
 }
@@ -612,3 +704,23 @@ void disconnect_inactive(merlin_node *node)
 	if (delta_receive_time >= node->data_timeout)
 		node_disconnect(node, "Too long since last action");
 }
+
+/*
+ * Gives up on a connect() that hasn't completed, or a connection
+ * the other end hasn't sent anything on, within the deadline set
+ * when the attempt started. The connection attempt is retried
+ * later, like any other failed one.
+ */
+void disconnect_stalled(merlin_node *node)
+{
+	if (!node->conn_deadline || node->conn_deadline > time(NULL))
+		return;
+
+	if (node->conn_sock >= 0) {
+		iobroker_close(nagios_iobs, node->conn_sock);
+		node->conn_sock = -1;
+	}
+	node_disconnect(node, "%s timed out after %d seconds",
+	                node->state == STATE_PENDING ? "connect()" : "Handshake",
+	                MERLIN_CONNECT_TIMEOUT);
+}
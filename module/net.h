@@ -4,6 +4,9 @@
 #include <netdb.h>
 #include "shared.h"
 
+#define MERLIN_CONNECT_INTERVAL 5 /* seconds between connect attempts, at least */
+#define MERLIN_CONNECT_TIMEOUT 20 /* seconds for connect() and handshake, each */
+
 extern unsigned short default_port;
 extern unsigned int default_addr;
 
@@ -13,7 +16,9 @@ extern int net_send_ipc_data(merlin_event *pkt);
 extern int net_is_connected(merlin_node *node);
 extern int net_try_connect(merlin_node *node);
 extern int net_sendto(merlin_node *node, merlin_event *pkt);
+extern int net_fanout_sendto(merlin_node *node, merlin_fanout *fo);
 extern int net_sendto_many(merlin_node **ntable, uint num, merlin_event *pkt);
 extern int net_input(int sd, int io_evt, void *node_);
 extern void disconnect_inactive(merlin_node *node);
+extern void disconnect_stalled(merlin_node *node);
 #endif /* INCLUDE_net_h__ */
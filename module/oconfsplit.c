@@ -7,6 +7,10 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <glib.h>
 
 static struct {
@@ -26,6 +30,13 @@ static FILE *fp;
 
 static char *poller_config_dir = NULL;
 
+/*
+ * max number of pollers to split config for at the same time. The
+ * default is to split them one by one in-process, and 0 means one
+ * worker process per CPU
+ */
+static long split_workers = 1;
+
 void split_init(void) {
 	nm_asprintf(&poller_config_dir, "%s/config/", CACHEDIR);
 }
@@ -47,9 +58,23 @@ int split_grok_var(const char *var, const char *value) {
 		nm_free(cfgdir);
 		return 1;
 	}
+	if (0 == strcmp("oconfsplit_workers", var)) {
+		char *endp;
+
+		split_workers = strtol(value, &endp, 0);
+		if (*endp || split_workers < 0)
+			return 0;
+		return 1;
+	}
 	return 0;
 }
 
+/* where the split config for each poller ends up, as <dir><poller>.cfg */
+const char *split_config_dir(void)
+{
+	return poller_config_dir;
+}
+
 static inline void nsplit_cache_command(struct command *cmd)
 {
 	if (!cmd || bitmap_isset(map.commands, cmd->id))
@@ -346,12 +371,228 @@ static int nsplit_cache_stuff(const char *orig_groups)
 	return 0;
 }
 
-int split_config(void)
+/*
+ * Writes buf to outfile through a temporary file, so nothing ever
+ * sees a half-written config, and stamps it with the time of the
+ * last config change.
+ */
+static int split_write(const char *outfile, const char *buf, size_t len)
 {
-	unsigned int i;
+	char *temp_file = NULL;
+	struct timeval times[2] = {{0,0}, {0,0}};
+	size_t written = 0;
+	int fd;
+
+	if (asprintf(&temp_file, "%s.XXXXXX", outfile) == -1) {
+		lerr("Cannot nodesplit: there was an error generating temporary file name: %s", strerror(errno));
+		return -1;
+	}
+	fd = mkstemp(temp_file);
+	if (fd < 0) {
+		lerr("Cannot nodesplit: Failed to create temporary file '%s' for writing: %s", temp_file, strerror(errno));
+		free(temp_file);
+		return -1;
+	}
+	while (written < len) {
+		ssize_t wlen = write(fd, buf + written, len - written);
+		if (wlen < 0) {
+			if (errno == EINTR)
+				continue;
+			lerr("Cannot nodesplit: Failed to write '%s': %s", temp_file, strerror(errno));
+			close(fd);
+			unlink(temp_file);
+			free(temp_file);
+			return -1;
+		}
+		written += wlen;
+	}
+	close(fd);
+
+	if (rename(temp_file, outfile)) {
+		lerr("Cannot nodesplit: Failed to create '%s' from temporary file %s: %s", outfile, temp_file, strerror(errno));
+		unlink(temp_file);
+		free(temp_file);
+		return -1;
+	}
+	free(temp_file);
+
+	times[0].tv_sec = times[1].tv_sec = ipc.info.last_cfg_change;
+	if (utimes(outfile, times) == -1) {
+		lerr("Error in nodesplit: Failed to set mtime of '%s': %s", outfile, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the file at path has exactly the given hash. The
+ * size is checked first, since that's what usually differs.
+ */
+static int split_unchanged(const char *path, size_t len, const unsigned char *hash)
+{
+	struct stat st;
+	unsigned char old_hash[20];
+	blk_SHA_CTX ctx;
+
+	if (stat(path, &st) < 0 || (size_t)st.st_size != len)
+		return 0;
+
+	blk_SHA1_Init(&ctx);
+	if (hash_add_file(path, &ctx) < 0)
+		return 0;
+	blk_SHA1_Final(old_hash, &ctx);
+	return !memcmp(old_hash, hash, sizeof(old_hash));
+}
+
+/*
+ * Renders the config for a single poller and stores its hash in
+ * node->expected.config_hash. The config is built in memory and
+ * the file on disk is only replaced if its content changed, so
+ * pollers whose hosts, commands, timeperiods and contacts are the
+ * same as last time keep the file and its mtime from back then.
+ * This expects the tracker maps to be allocated.
+ */
+static int split_one(merlin_node *node)
+{
+	char *outfile = NULL, *buf = NULL;
+	size_t len = 0;
+	int ret = -1;
+	unsigned char hash[20];
+	blk_SHA_CTX ctx;
+
+	if (asprintf(&outfile, "%s%s.cfg", poller_config_dir, node->name) == -1) {
+		lerr("Cannot nodesplit: there was an error generating file name: %s", strerror(errno));
+		return -1;
+	}
+	fp = open_memstream(&buf, &len);
+	if (!fp) {
+		lerr("Cannot nodesplit: Failed to create output buffer for '%s': %s", outfile, strerror(errno));
+		goto out;
+	}
+
+	bitmap_clear(htrack);
+	bitmap_clear(map.hosts);
+	bitmap_clear(map.commands);
+	bitmap_clear(map.timeperiods);
+	bitmap_clear(map.contacts);
+	bitmap_clear(map.contactgroups);
+	bitmap_clear(map.hostgroups);
+
+	/* global commands are always included */
+	nsplit_cache_command(ochp_command_ptr);
+	nsplit_cache_command(ocsp_command_ptr);
+	nsplit_cache_command(global_host_event_handler_ptr);
+	nsplit_cache_command(global_service_event_handler_ptr);
+	if (host_perfdata_command)
+		nsplit_cache_command(find_command(host_perfdata_command));
+	if (service_perfdata_command)
+		nsplit_cache_command(find_command(service_perfdata_command));
+	if (host_perfdata_file_processing_command)
+		nsplit_cache_command(find_command(host_perfdata_file_processing_command));
+	if (service_perfdata_file_processing_command)
+		nsplit_cache_command(find_command(service_perfdata_file_processing_command));
+
+	if (nsplit_cache_stuff(node->hostgroups) < 0) {
+		lerr("Caching for %s failed. Skipping", node->name);
+		fclose(fp);
+		goto out;
+	}
+	nsplit_partial_groups();
+	if (fclose(fp)) {
+		lerr("Cannot nodesplit: Failed to render config for poller %s: %s", node->name, strerror(errno));
+		goto out;
+	}
+
+	blk_SHA1_Init(&ctx);
+	blk_SHA1_Update(&ctx, buf, len);
+	blk_SHA1_Final(hash, &ctx);
 
-	char *groups = NULL;
+	if (split_unchanged(outfile, len, hash)) {
+		linfo("OCONFSPLIT: Config for poller %s is unchanged in '%s'", node->name, outfile);
+	} else {
+		linfo("OCONFSPLIT: Writing config for poller %s to '%s'", node->name, outfile);
+		if (split_write(outfile, buf, len) < 0)
+			goto out;
+	}
+
+	memcpy(node->expected.config_hash, hash, sizeof(hash));
+	ret = 0;
+
+out:
+	fp = NULL;
+	free(buf);
+	free(outfile);
+	return ret;
+}
+
+/*
+ * Naemon's object cache writers use static buffers internally,
+ * so we can't run several splits in threads. Instead we fork one
+ * child per poller, which gets its own copy of the tracker maps
+ * and the output file, and reads the object tables copy-on-write.
+ * The child hands back the config hash through a pipe.
+ */
+struct split_child {
+	pid_t pid;
+	int fd;
 	merlin_node *node;
+};
+
+static pid_t split_spawn(merlin_node *node, int *fd)
+{
+	int pfd[2];
+	pid_t pid;
+
+	if (pipe(pfd) < 0)
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+
+	if (!pid) {
+		int ret;
+
+		close(pfd[0]);
+		ret = split_one(node);
+		if (!ret && write(pfd[1], node->expected.config_hash, sizeof(node->expected.config_hash)) < 0)
+			ret = -1;
+		close(pfd[1]);
+		/* don't run atexit() handlers or flush naemon's stdio buffers */
+		_exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	*fd = pfd[0];
+	return pid;
+}
+
+static void split_reap(struct split_child *child)
+{
+	int status;
+	unsigned char hash[20];
+	ssize_t len;
+
+	while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	len = read(child->fd, hash, sizeof(hash));
+	close(child->fd);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || len != sizeof(hash)) {
+		lerr("OCONFSPLIT: Failed to split config for %s", child->node->name);
+		return;
+	}
+	memcpy(child->node->expected.config_hash, hash, sizeof(hash));
+}
+
+int split_config(void)
+{
+	unsigned int i, running = 0;
+	long workers = split_workers;
+	struct split_child *children = NULL;
 
 	/* create our tracker maps */
 	htrack = bitmap_create(num_objects.hosts);
@@ -362,78 +603,42 @@ int split_config(void)
 	map.contactgroups = bitmap_create(num_objects.contactgroups);
 	map.hostgroups = bitmap_create(num_objects.hostgroups);
 
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > 1 && num_pollers > 1)
+		children = calloc(workers, sizeof(*children));
+
 	for (i = 0; i < num_pollers; i++) {
-		char *outfile, *temp_file;
-		int fd;
-		struct timeval times[2] = {{0,0}, {0,0}};
-		blk_SHA_CTX ctx;
-
-		node = poller_table[i];
-		if (asprintf(&temp_file, "%s%s.cfg.XXXXXX", poller_config_dir, node->name) == -1) {
-			lerr("Cannot nodesplit: there was an error generating temporary file name: %s", strerror(errno));
-			continue;
-		}
-		if (asprintf(&outfile, "%s%s.cfg", poller_config_dir, node->name) == -1) {
-			lerr("Cannot nodesplit: there was an error generating file name: %s", strerror(errno));
-			continue;
-		}
-		fd = mkstemp(temp_file);
-		if (fd < 0) {
-			lerr("Cannot nodesplit: Failed to create temporary file '%s' for writing: %s", temp_file, strerror(errno));
-			continue;
-		}
-		fp = fdopen(fd, "r+");
-		if (!fp) {
-			lerr("Cannot nodesplit: Failed to open '%s' for writing: %s", temp_file, strerror(errno));
-			continue;
-		}
-		linfo("OCONFSPLIT: Writing config for poller %s to '%s'\n", node->name, outfile);
-
-		groups = node->hostgroups;
-
-		bitmap_clear(htrack);
-		bitmap_clear(map.hosts);
-		bitmap_clear(map.commands);
-		bitmap_clear(map.timeperiods);
-		bitmap_clear(map.contacts);
-		bitmap_clear(map.contactgroups);
-		bitmap_clear(map.hostgroups);
-
-		/* global commands are always included */
-		nsplit_cache_command(ochp_command_ptr);
-		nsplit_cache_command(ocsp_command_ptr);
-		nsplit_cache_command(global_host_event_handler_ptr);
-		nsplit_cache_command(global_service_event_handler_ptr);
-		if (host_perfdata_command)
-			nsplit_cache_command(find_command(host_perfdata_command));
-		if (service_perfdata_command)
-			nsplit_cache_command(find_command(service_perfdata_command));
-		if (host_perfdata_file_processing_command)
-			nsplit_cache_command(find_command(host_perfdata_file_processing_command));
-		if (service_perfdata_file_processing_command)
-			nsplit_cache_command(find_command(service_perfdata_file_processing_command));
-
-		if (nsplit_cache_stuff(groups) < 0) {
-			lerr("Caching for %s failed. Skipping", node->name);
+		merlin_node *node = poller_table[i];
+		struct split_child *child;
+
+		if (!children) {
+			split_one(node);
 			continue;
 		}
-		nsplit_partial_groups();
-		fclose(fp);
-		if (rename(temp_file, outfile)) {
-			lerr("Cannot nodesplit: Failed to create '%s' from temporary file %s: %s", outfile, temp_file, strerror(errno));
-			continue;
+
+		/* wait for the oldest child if all workers are busy */
+		if (running == workers) {
+			split_reap(&children[0]);
+			memmove(children, children + 1, --running * sizeof(*children));
 		}
-		times[0].tv_sec = times[1].tv_sec = ipc.info.last_cfg_change;
-		if (utimes(outfile, times) == -1) {
-			lerr("Error in nodesplit: Failed to set mtime of '%s': %s", outfile, strerror(errno));
+
+		child = &children[running];
+		child->node = node;
+		child->pid = split_spawn(node, &child->fd);
+		if (child->pid < 0) {
+			lwarn("OCONFSPLIT: Failed to fork for %s: %s. Splitting in-process",
+			      node->name, strerror(errno));
+			split_one(node);
 			continue;
 		}
-
-		blk_SHA1_Init(&ctx);
-		hash_add_file(outfile, &ctx);
-		blk_SHA1_Final(node->expected.config_hash, &ctx);
+		running++;
 	}
 
+	for (i = 0; i < running; i++)
+		split_reap(&children[i]);
+	free(children);
+
 	bitmap_destroy(htrack);
 	bitmap_destroy(map.hosts);
 	bitmap_destroy(map.commands);
@@ -6,5 +6,6 @@ void split_deinit(void);
 
 int split_config(void);
 int split_grok_var(const char *var, const char *value);
+const char *split_config_dir(void);
 
 #endif
@@ -4,6 +4,9 @@
 #include "logging.h"
 #include "ipc.h"
 #include "testif_qh.h"
+#include "hooks.h"
+#include "metrics.h"
+#include "script-helpers.h"
 #include <naemon/naemon.h>
 #include <string.h>
 
@@ -14,12 +17,58 @@ static int dump_cbstats(merlin_node *n, int sd)
 	nsock_printf(sd, "name=%s;type=%s;", n->name, node_type(n));
 	for (i = 0; i <= NEBCALLBACK_NUMITEMS; i++) {
 		const char *cb_name = callback_name(i);
+		struct callback_count *cb = &n->stats.cb_count[i];
+
 		/* don't print empty values */
-		if(!n->stats.cb_count[i].in && !n->stats.cb_count[i].in)
+		if (!cb->in && !cb->out && !cb->encoded && !cb->decoded)
 			continue;
-		nsock_printf(sd, "%s_IN=%u;%s_OUT=%u;",
-					 cb_name, n->stats.cb_count[i].in,
-					 cb_name, n->stats.cb_count[i].in);
+		nsock_printf(sd, "%s_IN=%u;%s_OUT=%u;%s_BYTES_IN=%llu;%s_BYTES_OUT=%llu;"
+					 "%s_ENCODE_USEC=%llu;%s_DECODE_USEC=%llu;",
+					 cb_name, cb->in, cb_name, cb->out,
+					 cb_name, cb->bytes_in, cb_name, cb->bytes_out,
+					 cb_name, cb_cpu_estimate(cb->encode_ns, cb->encode_samples, cb->encoded) / 1000,
+					 cb_name, cb_cpu_estimate(cb->decode_ns, cb->decode_samples, cb->decoded) / 1000);
+	}
+	nsock_printf(sd, "\n");
+	return 0;
+}
+
+/*
+ * Print percentiles of each latency histogram, in microseconds,
+ * and reset them so the next query only covers what happened
+ * since this one.
+ */
+static int dump_latency(merlin_node *n, int sd)
+{
+	int i;
+
+	nsock_printf(sd, "name=%s;type=%s;", n->name, node_type(n));
+	for (i = 0; i < NODE_LAT_NUM; i++) {
+		merlin_histogram *h = &n->stats.latency[i];
+		const char *lat_name = node_latency_name(i);
+
+		nsock_printf(sd, "%s_count=%llu;%s_p50=%llu;%s_p90=%llu;%s_p99=%llu;%s_max=%llu;",
+					 lat_name, h->count,
+					 lat_name, histogram_percentile(h, 50),
+					 lat_name, histogram_percentile(h, 90),
+					 lat_name, histogram_percentile(h, 99),
+					 lat_name, h->max);
+		histogram_reset(h);
+	}
+	nsock_printf(sd, "\n");
+	return 0;
+}
+
+static int dump_dupe_stats(int sd)
+{
+	int i;
+
+	nsock_printf(sd, "name=dupes;type=filter;");
+	for (i = 0; i <= NEBCALLBACK_NUMITEMS; i++) {
+		unsigned long long hits = merlin_dupe_hits(i);
+		if (!hits)
+			continue;
+		nsock_printf(sd, "%s_HITS=%llu;", callback_name(i), hits);
 	}
 	nsock_printf(sd, "\n");
 	return 0;
@@ -51,9 +100,13 @@ static int help(int sd)
 	nsock_printf_nul(sd,
 		"I answer questions regarding the merlin *module*, not the daemon\n"
 		"nodeinfo      Print info about all nodes I know about\n"
+		"nodeinfo <name>  Print info about one node\n"
 		"cbstats       Print callback statistics for each node\n"
+		"latency       Print latency percentiles (usec) for each node and reset them\n"
+		"metrics       Print node statistics in OpenMetrics format\n"
 		"notify-stats  Print notification statistics\n"
 		"expired       Print information regarding expired events\n"
+		"csync         Print the state of config pushes to each node\n"
 	);
 	return 0;
 }
@@ -93,6 +146,18 @@ int merlin_qh(int sd, char *buf, unsigned int len)
 		}
 		return 0;
 	}
+	if (0 == prefixcmp(buf, "nodeinfo ")) {
+		merlin_node *node;
+
+		if (0 == strcmp(buf + 9, ipc.name)) {
+			dump_nodeinfo(&ipc, sd, 0);
+			return 0;
+		}
+		if (!(node = node_by_name(buf + 9)))
+			return 404;
+		dump_nodeinfo(node, sd, node->id + 1);
+		return 0;
+	}
 	if (0 == strcmp(buf, "help"))
 		return help(sd);
 
@@ -104,6 +169,18 @@ int merlin_qh(int sd, char *buf, unsigned int len)
 		for(i = 0; i < num_nodes; i++) {
 			dump_cbstats(node_table[i], sd);
 		}
+		dump_dupe_stats(sd);
+		return 0;
+	}
+	if (0 == strcmp(buf, "latency")) {
+		dump_latency(&ipc, sd);
+		for(i = 0; i < num_nodes; i++) {
+			dump_latency(node_table[i], sd);
+		}
+		return 0;
+	}
+	if (0 == strcmp(buf, "metrics")) {
+		metrics_write(sd);
 		return 0;
 	}
 	if (0 == strcmp(buf, "expired")) {
@@ -114,6 +191,10 @@ int merlin_qh(int sd, char *buf, unsigned int len)
 		dump_notify_stats(sd);
 		return 0;
 	}
+	if (0 == strcmp(buf, "csync")) {
+		csync_dump_status(sd);
+		return 0;
+	}
 
 	/*
 	 * This is used for test case integration, shouldn't be documented and used
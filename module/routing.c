@@ -0,0 +1,147 @@
+#include "routing.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <glib.h>
+
+static node_selection **host_sel; /* indexed by host id */
+static unsigned int num_hosts;
+static struct routing_dest *dests; /* indexed by selection id */
+static int num_dests;
+
+struct routing_add_params {
+	node_selection *sel;
+	int *num_ents;
+};
+
+static gboolean routing_add_host(__attribute__((unused)) gpointer _name, gpointer _hst, gpointer user_data)
+{
+	struct routing_add_params *params = (struct routing_add_params *)user_data;
+	host *hst = (host *)_hst;
+	node_selection *cur;
+
+	if (hst->id >= num_hosts)
+		return FALSE;
+
+	/*
+	 * this should never happen, but if it does
+	 * we just ignore it and move on
+	 */
+	cur = host_sel[hst->id];
+	if (cur == params->sel)
+		return FALSE;
+
+	if (cur) {
+		lwarn("'%s' is checked by selection '%s', so can't add to selection '%s'",
+			  hst->name, cur->name, params->sel->name);
+		return FALSE;
+	}
+	params->num_ents[params->sel->id]++;
+	host_sel[hst->id] = params->sel;
+	return FALSE;
+}
+
+int routing_init(void)
+{
+	hostgroup *hg;
+	int i, nsel;
+	int *num_ents;
+
+	routing_deinit();
+
+	nsel = get_num_selections();
+
+	if (!num_pollers || !nsel)
+		return 0;
+
+	dests = calloc(nsel, sizeof(*dests));
+	if (!dests) {
+		lerr("Failed to allocate memory for the poller routing table");
+		return -1;
+	}
+	num_dests = nsel;
+
+	for (i = 0; i < nsel; i++) {
+		linked_item *li;
+		unsigned int n = 0;
+
+		for (li = nodes_by_sel_id(i); li; li = li->next_item)
+			n++;
+		dests[i].nodes = calloc(n, sizeof(merlin_node *));
+		if (!dests[i].nodes)
+			continue;
+		for (li = nodes_by_sel_id(i); li; li = li->next_item)
+			dests[i].nodes[dests[i].num_nodes++] = (merlin_node *)li->item;
+	}
+
+	/*
+	 * only bother with hosts if we've got hostgroups. Otherwise
+	 * we'll just be wasting perfectly good memory for no good reason
+	 */
+	if (!hostgroup_list || !num_objects.hosts)
+		return 0;
+
+	host_sel = calloc(num_objects.hosts, sizeof(*host_sel));
+	num_ents = calloc(nsel, sizeof(int));
+	if (!host_sel || !num_ents) {
+		lerr("Failed to allocate memory for the host routing table");
+		free(num_ents);
+		free(host_sel);
+		host_sel = NULL;
+		return -1;
+	}
+	num_hosts = num_objects.hosts;
+
+	/*
+	 * we must loop each hostgroup once, or we'll log a lot of
+	 * spurious warnings that aren't exactly accurate
+	 */
+	for (hg = hostgroup_list; hg; hg = hg->next) {
+		struct routing_add_params params;
+		params.sel = node_selection_by_name(hg->group_name);
+		params.num_ents = num_ents;
+
+		if (!params.sel)
+			continue;
+
+		g_tree_foreach(hg->members, routing_add_host, &params);
+	}
+
+	for (i = 0; i < nsel; i++) {
+		if (!num_ents[i])
+			lwarn("'%s' is a selection without hosts. Are you sure you want this?",
+				  get_sel_name(i));
+	}
+
+	free(num_ents);
+	return 0;
+}
+
+void routing_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < num_dests; i++)
+		free(dests[i].nodes);
+	free(dests);
+	dests = NULL;
+	num_dests = 0;
+	free(host_sel);
+	host_sel = NULL;
+	num_hosts = 0;
+}
+
+node_selection *routing_host_selection(const host *hst)
+{
+	if (!hst || hst->id >= num_hosts)
+		return NULL;
+
+	return host_sel[hst->id];
+}
+
+const struct routing_dest *routing_dest(int sel)
+{
+	if (sel < 0 || sel >= num_dests)
+		return NULL;
+
+	return &dests[sel];
+}
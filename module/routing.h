@@ -0,0 +1,22 @@
+#ifndef INCLUDE_routing_h__
+#define INCLUDE_routing_h__
+#include <naemon/naemon.h>
+#include "node.h"
+
+/*
+ * Which pollers get events about which hosts. It's worked out once
+ * the object config is loaded, from the hostgroups of each poller
+ * selection, so routing an event is an array lookup by host id and
+ * a loop over a flat array of nodes.
+ */
+struct routing_dest {
+	unsigned int num_nodes;
+	merlin_node **nodes;
+};
+
+extern int routing_init(void);
+extern void routing_deinit(void);
+extern node_selection *routing_host_selection(const host *hst);
+extern const struct routing_dest *routing_dest(int sel);
+
+#endif
@@ -12,6 +12,7 @@
 #include "configuration.h"
 #include "shared.h"
 #include "script-helpers.h"
+#include "csync.h"
 
 
 static void log_child_output(const char *prefix, char *buf)
@@ -33,7 +34,7 @@ static void log_child_output(const char *prefix, char *buf)
 	} while (eol);
 }
 
-static void log_child_result(wproc_result *wpres, const char *fmt, ...)
+void log_child_result(wproc_result *wpres, const char *fmt, ...)
 {
 	int status;
 	char *name;
@@ -70,6 +71,7 @@ static void log_child_result(wproc_result *wpres, const char *fmt, ...)
 		log_child_output("stdout", wpres->outstd);
 		log_child_output("stderr", wpres->outerr);
 	}
+	free(name);
 }
 
 static void handle_csync_finished(wproc_result *wpres, void *arg, int flags)
@@ -85,6 +87,154 @@ static void handle_csync_finished(wproc_result *wpres, void *arg, int flags)
 		what = "fetch";
 	log_child_result(wpres, "CSYNC: oconf %s to %s %s", what,
 					 node_type(child->node), child->node->name);
+	if (child == &child->node->csync.push) {
+		csync_push_done(child->node, wpres && WIFEXITED(wpres->wait_status) &&
+		                !WEXITSTATUS(wpres->wait_status), 0);
+	}
+}
+
+/*
+ * Pushes run in parallel, but no more than "workers" (set in the
+ * object_config block) at once, so a config change on a master
+ * with lots of pollers doesn't start them all at the same time.
+ * The rest wait here, in the order they asked.
+ */
+static merlin_node **push_queue;
+static unsigned int push_queue_len, push_queue_alloc;
+static unsigned int pushes_running;
+
+static unsigned int csync_workers(void)
+{
+	return global_csync.workers > 0 ? global_csync.workers : CSYNC_DEFAULT_WORKERS;
+}
+
+const char *csync_state_name(int state)
+{
+	switch (state) {
+	case CSYNC_STATE_IDLE: return "idle";
+	case CSYNC_STATE_QUEUED: return "queued";
+	case CSYNC_STATE_RUNNING: return "running";
+	case CSYNC_STATE_DONE: return "done";
+	case CSYNC_STATE_FAILED: return "failed";
+	}
+	return "unknown";
+}
+
+static int csync_queue_add(merlin_node *node)
+{
+	if (push_queue_len == push_queue_alloc) {
+		unsigned int alloc = push_queue_alloc ? push_queue_alloc * 2 : 16;
+		merlin_node **queue = realloc(push_queue, alloc * sizeof(*queue));
+		if (!queue)
+			return -1;
+		push_queue = queue;
+		push_queue_alloc = alloc;
+	}
+	push_queue[push_queue_len++] = node;
+	node->csync_state = CSYNC_STATE_QUEUED;
+	return 0;
+}
+
+static int csync_run(merlin_node *node, merlin_child *child, const char *what, int tdelta)
+{
+	int is_push = child == &node->csync.push;
+
+	node->csync_num_attempts++;
+	linfo("CSYNC: %s %s: %s triggered; tdelta: %d; command: [%s]",
+	      node_type(node), node->name, what, tdelta, child->cmd);
+	node->csync_last_attempt = time(NULL);
+	child->node = node;
+
+	if (is_push) {
+		node->csync_state = CSYNC_STATE_RUNNING;
+		gettimeofday(&node->csync_start, NULL);
+		pushes_running++;
+	}
+
+	if (csync_is_native(child->cmd)) {
+		child->is_running = 1;
+		if (csync_native_push(node) < 0) {
+			csync_push_done(node, 0, 0);
+			return 0;
+		}
+		return 1;
+	}
+
+	/*
+	 * Using ":" as a command is a standard trick to make sure it succeeds.
+	 * It's also reasonably standard to avoid running such commands at all
+	 * from programs, and here it's used to make the running of test-csync
+	 * simpler than it otherwise would be.
+	 */
+	if (strcmp(child->cmd, ":")) {
+		child->is_running = 1;
+		wproc_run_callback(child->cmd, 600, handle_csync_finished, child, NULL);
+	} else if (is_push) {
+		csync_push_done(node, 1, 0);
+	}
+	return 0;
+}
+
+/* starts queued pushes until we run out of them or of workers */
+static void csync_queue_run(void)
+{
+	while (push_queue_len && pushes_running < csync_workers()) {
+		merlin_node *node = push_queue[0];
+
+		memmove(push_queue, push_queue + 1, --push_queue_len * sizeof(*push_queue));
+		node->csync_state = CSYNC_STATE_IDLE;
+
+		/* a native push needs the connection it was queued on */
+		if (csync_is_native(node->csync.push.cmd)) {
+			if (node->sock < 0) {
+				ldebug("CSYNC: %s %s: Disconnected while queued. Not pushing",
+				       node_type(node), node->name);
+				continue;
+			}
+			if (!csync_run(node, &node->csync.push, "push", 0))
+				node_disconnect(node, "Native config sync failed to start");
+			continue;
+		}
+		csync_run(node, &node->csync.push, "push", 0);
+	}
+}
+
+/* called when a push started by csync_run() is over */
+void csync_push_done(merlin_node *node, int ok, unsigned long long bytes)
+{
+	struct timeval now;
+
+	node->csync.push.is_running = 0;
+	if (node->csync_state != CSYNC_STATE_RUNNING)
+		return;
+
+	gettimeofday(&now, NULL);
+	node->csync_msec = (now.tv_sec - node->csync_start.tv_sec) * 1000 +
+		(now.tv_usec - node->csync_start.tv_usec) / 1000;
+	node->csync_bytes = bytes;
+	node->csync_state = ok ? CSYNC_STATE_DONE : CSYNC_STATE_FAILED;
+	pushes_running--;
+	csync_queue_run();
+}
+
+void csync_dump_status(int sd)
+{
+	unsigned int i;
+
+	nsock_printf(sd, "name=csync;workers=%u;running=%u;queued=%u\n",
+	             csync_workers(), pushes_running, push_queue_len);
+	for (i = 0; i < num_nodes; i++) {
+		merlin_node *node = node_table[i];
+
+		if (!node->csync.push.cmd)
+			continue;
+		nsock_printf(sd, "name=%s;type=%s;state=%s;method=%s;attempts=%u;"
+		             "last_attempt=%lu;last_duration_msec=%u;last_bytes=%llu\n",
+		             node->name, node_type(node), csync_state_name(node->csync_state),
+		             csync_is_native(node->csync.push.cmd) ? "native" : "command",
+		             node->csync_num_attempts, node->csync_last_attempt,
+		             node->csync_msec, node->csync_bytes);
+	}
 }
 
 /*
@@ -103,8 +253,10 @@ static void handle_csync_finished(wproc_result *wpres, void *arg, int flags)
  * @param tdelta The timestamp delta on the configuration.
  *   < 0 indicates we should prefer pushing.
  *   > 0 indicates we should prefer fetching.
+ * @return 1 if a native sync runs over the connection, so it must
+ *   be kept open, and 0 otherwise.
  */
-void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelta)
+int csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelta)
 {
 	time_t now;
 	int real_tdelta;
@@ -121,7 +273,7 @@ void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelt
 	if (!cs->push.cmd && !cs->fetch.cmd) {
 		ldebug("CSYNC: %s %s: No config sync configured.", node_type(node), node->name);
 		node_disconnect(node, "Disconnecting from %s, as config can't be synced", node->name);
-		return;
+		return 0;
 	}
 
 	/*
@@ -133,7 +285,7 @@ void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelt
 	{
 		linfo("CSYNC: %s %s: This is a poller, but not all peers are connected. Not pushing",
 		      node_type(node), node->name);
-		return;
+		return 0;
 	}
 
 	if (!(node->flags & MERLIN_NODE_CONNECT) && !node->csync.configured) {
@@ -141,7 +293,7 @@ void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelt
 			ldebug("CSYNC: %s %s configured with 'connect = no'.",
 				   node_type(node), node->name);
 		}
-		return;
+		return 0;
 	}
 
 	if (node->type == MODE_MASTER) {
@@ -185,36 +337,42 @@ void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int tdelt
 
 	if (!child) {
 		ldebug("CSYNC: %s %s: No action required", node_type(node), node->name);
-		return;
+		return 0;
+	}
+
+	/* a native fetch just means we wait for the other end to push */
+	if (csync_is_native(child->cmd) && child == &cs->fetch) {
+		linfo("CSYNC: %s %s: Waiting for native push", node_type(node), node->name);
+		return 1;
 	}
 
 	if (child->is_running) {
 		ldebug("CSYNC: %s %s: %s already running as: %s",
 		       node_type(node), node->name, what, child->cmd);
-		return;
+		return csync_is_native(child->cmd);
+	}
+
+	if (node->csync_state == CSYNC_STATE_QUEUED) {
+		ldebug("CSYNC: %s %s: %s already queued", node_type(node), node->name, what);
+		return csync_is_native(child->cmd);
 	}
 
 	now = time(NULL);
 	if (node->csync_last_attempt >= now - 30) {
 		ldebug("CSYNC: Config sync attempted %lu seconds ago. Waiting at least %lu seconds",
 		       now - node->csync_last_attempt, 30 - (now - node->csync_last_attempt));
-		return;
+		return 0;
 	}
 
-	node->csync_num_attempts++;
-	linfo("CSYNC: %s %s: %s triggered; tdelta: %d; command: [%s]",
-	      node_type(node), node->name, what, tdelta, child->cmd);
-	node->csync_last_attempt = now;
-	child->node = node;
-
-	/*
-	 * Using ":" as a command is a standard trick to make sure it succeeds.
-	 * It's also reasonably standard to avoid running such commands at all
-	 * from programs, and here it's used to make the running of test-csync
-	 * simpler than it otherwise would be.
-	 */
-	if (strcmp(child->cmd, ":")) {
-		child->is_running = 1;
-		wproc_run_callback(child->cmd, 600, handle_csync_finished, child, NULL);
+	if (child == &cs->push && pushes_running >= csync_workers()) {
+		if (csync_queue_add(node) < 0) {
+			lerr("CSYNC: %s %s: Failed to queue push", node_type(node), node->name);
+			return 0;
+		}
+		linfo("CSYNC: %s %s: %u pushes already running. Queued as number %u",
+		      node_type(node), node->name, pushes_running, push_queue_len);
+		return csync_is_native(child->cmd);
 	}
+
+	return csync_run(node, child, what, tdelta);
 }
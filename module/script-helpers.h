@@ -1,6 +1,22 @@
 #ifndef INCLUDE_module_script_helpers_h__
 #define INCLUDE_module_script_helpers_h__
 #include "node.h"
+#include <naemon/naemon.h>
+
+/* for node->csync_state */
+enum {
+	CSYNC_STATE_IDLE,
+	CSYNC_STATE_QUEUED,    /* waiting for a push worker */
+	CSYNC_STATE_RUNNING,
+	CSYNC_STATE_DONE,      /* the last push succeeded */
+	CSYNC_STATE_FAILED,    /* the last push failed */
+};
+#define CSYNC_DEFAULT_WORKERS 8
+
 int import_objects(char *cfg, char *cache);
-void csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int delta);
+int csync_node_active(merlin_node *node, const merlin_nodeinfo *info, int delta);
+void log_child_result(wproc_result *wpres, const char *fmt, ...);
+void csync_push_done(merlin_node *node, int ok, unsigned long long bytes);
+const char *csync_state_name(int state);
+void csync_dump_status(int sd);
 #endif
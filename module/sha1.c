@@ -115,7 +115,7 @@
 #define T_40_59(t, A, B, C, D, E) SHA_ROUND(t, SHA_MIX, ((B&C)+(D&(B^C))) , 0x8f1bbcdc, A, B, C, D, E )
 #define T_60_79(t, A, B, C, D, E) SHA_ROUND(t, SHA_MIX, (B^C^D) ,  0xca62c1d6, A, B, C, D, E )
 
-static void blk_SHA1_Block(blk_SHA_CTX *ctx, const unsigned int *data)
+static void blk_SHA1_Block_generic(blk_SHA_CTX *ctx, const unsigned int *data)
 {
 	unsigned int A,B,C,D,E;
 	unsigned int array[16];
@@ -223,6 +223,235 @@ static void blk_SHA1_Block(blk_SHA_CTX *ctx, const unsigned int *data)
 	ctx->H[4] += E;
 }
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+
+/*
+ * Intel SHA extensions (SHA-NI) do four rounds per instruction and
+ * handle the message schedule in hardware as well, which makes them
+ * several times faster than the C version above. Each step below
+ * runs four rounds on one group of four message words, while the
+ * later groups are computed from the earlier ones.
+ */
+__attribute__((target("sha,sse4.1")))
+static void blk_SHA1_Block_shani(blk_SHA_CTX *ctx, const unsigned int *data)
+{
+	__m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+	__m128i MSG0, MSG1, MSG2, MSG3;
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)ctx->H), 0x1b);
+	E0 = _mm_set_epi32(ctx->H[4], 0, 0, 0);
+	ABCD_SAVE = ABCD;
+	E0_SAVE = E0;
+
+	/* Rounds 0-3 */
+	MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), MASK);
+	E0 = _mm_add_epi32(E0, MSG0);
+	E1 = ABCD;
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+	/* Rounds 4-7 */
+	MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 4)), MASK);
+	E1 = _mm_sha1nexte_epu32(E1, MSG1);
+	E0 = ABCD;
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+	MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+	/* Rounds 8-11 */
+	MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 8)), MASK);
+	E0 = _mm_sha1nexte_epu32(E0, MSG2);
+	E1 = ABCD;
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+	MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+	MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+	/* Rounds 12-15 */
+	MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 12)), MASK);
+	E1 = _mm_sha1nexte_epu32(E1, MSG3);
+	E0 = ABCD;
+	MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+	MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+	MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+	/* Rounds 16-19 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG0);
+	E1 = ABCD;
+	MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+	MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+	MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+	/* Rounds 20-23 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG1);
+	E0 = ABCD;
+	MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+	MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+	MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+	/* Rounds 24-27 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG2);
+	E1 = ABCD;
+	MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+	MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+	MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+	/* Rounds 28-31 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG3);
+	E0 = ABCD;
+	MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+	MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+	MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+	/* Rounds 32-35 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG0);
+	E1 = ABCD;
+	MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+	MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+	MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+	/* Rounds 36-39 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG1);
+	E0 = ABCD;
+	MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+	MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+	MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+	/* Rounds 40-43 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG2);
+	E1 = ABCD;
+	MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+	MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+	MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+	/* Rounds 44-47 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG3);
+	E0 = ABCD;
+	MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+	MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+	MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+	/* Rounds 48-51 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG0);
+	E1 = ABCD;
+	MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+	MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+	MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+	/* Rounds 52-55 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG1);
+	E0 = ABCD;
+	MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+	MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+	MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+	/* Rounds 56-59 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG2);
+	E1 = ABCD;
+	MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+	MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+	MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+	/* Rounds 60-63 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG3);
+	E0 = ABCD;
+	MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+	MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+	MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+	/* Rounds 64-67 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG0);
+	E1 = ABCD;
+	MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+	MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+	MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+	/* Rounds 68-71 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG1);
+	E0 = ABCD;
+	MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+	MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+	/* Rounds 72-75 */
+	E0 = _mm_sha1nexte_epu32(E0, MSG2);
+	E1 = ABCD;
+	MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+	/* Rounds 76-79 */
+	E1 = _mm_sha1nexte_epu32(E1, MSG3);
+	E0 = ABCD;
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+	E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+	ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+	_mm_storeu_si128((__m128i *)ctx->H, _mm_shuffle_epi32(ABCD, 0x1b));
+	ctx->H[4] = _mm_extract_epi32(E0, 3);
+}
+
+static int have_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* SSSE3 and SSE4.1 are needed for the shuffles and extracts */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return !!(ebx & (1 << 29));
+}
+#endif
+
+static void blk_SHA1_Block_init(blk_SHA_CTX *ctx, const unsigned int *data);
+static void (*blk_SHA1_Block)(blk_SHA_CTX *, const unsigned int *) = blk_SHA1_Block_init;
+
+/*
+ * Picks the fastest block function the cpu supports the first time
+ * we hash something. Accelerated versions must produce the same
+ * result as the C version on a test block, or we don't use them.
+ */
+static void blk_SHA1_Block_init(blk_SHA_CTX *ctx, const unsigned int *data)
+{
+	blk_SHA1_Block = blk_SHA1_Block_generic;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (have_shani()) {
+		unsigned int block[16];
+		blk_SHA_CTX a, b;
+		int i;
+
+		for (i = 0; i < 16; i++)
+			block[i] = 0x9e3779b9 * (i + 1);
+		blk_SHA1_Init(&a);
+		blk_SHA1_Init(&b);
+		blk_SHA1_Block_generic(&a, block);
+		blk_SHA1_Block_shani(&b, block);
+		if (!memcmp(a.H, b.H, sizeof(a.H)))
+			blk_SHA1_Block = blk_SHA1_Block_shani;
+	}
+#endif
+
+	blk_SHA1_Block(ctx, data);
+}
+
 void blk_SHA1_Init(blk_SHA_CTX *ctx)
 {
 	ctx->size = 0;
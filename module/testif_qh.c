@@ -40,6 +40,7 @@ int merlin_testif_qh(int sd, char *buf) {
 		unsigned int i;
 		unsigned int len;
 		unsigned char newhash[20];
+		merlin_node *node;
 		time_t last_cfg_change = strtoull(parts[5], NULL, 10);
 
 
@@ -55,9 +56,8 @@ int merlin_testif_qh(int sd, char *buf) {
 		nsock_printf(sd, "New hash: %s\n", newhash);
 
 		merlin_testif_udpate_hash(&ipc, parts[3], parts[1], newhash, last_cfg_change);
-		for(i = 0; i < num_nodes; i++) {
-			merlin_testif_udpate_hash(node_table[i], parts[3], parts[1], newhash, last_cfg_change);
-		}
+		if ((node = node_by_name(parts[3])))
+			merlin_testif_udpate_hash(node, parts[3], parts[1], newhash, last_cfg_change);
 		retcode = 200;
 	}
 	g_strfreev(parts);
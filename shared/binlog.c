@@ -12,9 +12,16 @@
 #include <stdio.h> /* for debugging only */
 #include "binlog.h"
 
+struct binlog_shared {
+	unsigned int refs;
+	unsigned int size;
+	void *data;
+};
+
 struct binlog_entry {
 	unsigned int size;
 	void *data;
+	struct binlog_shared *shared;
 };
 typedef struct binlog_entry binlog_entry;
 #define entry_size(entry) (entry->size + sizeof(struct binlog_entry))
@@ -32,6 +39,15 @@ struct binlog {
 };
 
 /*** private helpers ***/
+static void entry_release(binlog_entry *entry)
+{
+	if (entry->shared)
+		binlog_shared_release(entry->shared);
+	else
+		free(entry->data);
+	free(entry);
+}
+
 static int safe_write(binlog *bl, void *buf, int len)
 {
 	int result;
@@ -138,9 +154,7 @@ void binlog_wipe(binlog *bl, int flags)
 			if (!entry)
 				continue;
 
-			if (entry->data)
-				free(entry->data);
-			free(entry);
+			entry_release(entry);
 		}
 		free(bl->cache);
 	}
@@ -201,6 +215,8 @@ static int binlog_file_read(binlog *bl, void **buf, unsigned int *len)
 
 static int binlog_mem_read(binlog *bl, void **buf, unsigned int *len)
 {
+	binlog_entry *entry;
+
 	if (!bl->cache || bl->read_index >= bl->write_index) {
 		bl->read_index = bl->write_index = 0;
 		return BINLOG_EMPTY;
@@ -212,12 +228,26 @@ static int binlog_mem_read(binlog *bl, void **buf, unsigned int *len)
 		return BINLOG_EINVALID;
 	}
 
-	*buf = bl->cache[bl->read_index]->data;
-	*len = bl->cache[bl->read_index]->size;
+	entry = bl->cache[bl->read_index];
+	*len = entry->size;
+	if (!entry->shared) {
+		*buf = entry->data;
+	} else if (entry->shared->refs == 1) {
+		/* last reference, so the reader can have the data */
+		*buf = entry->shared->data;
+		free(entry->shared);
+	} else {
+		/* others still need it, so the reader gets a copy */
+		*buf = malloc(*len);
+		if (!*buf)
+			return BINLOG_EDROPPED;
+		memcpy(*buf, entry->data, *len);
+		binlog_shared_release(entry->shared);
+	}
 	bl->mem_avail -= *len;
 
 	/* free the entry and mark it as empty */
-	free(bl->cache[bl->read_index]);
+	free(entry);
 	bl->cache[bl->read_index] = NULL;
 	bl->read_index++;
 
@@ -299,6 +329,7 @@ static int binlog_mem_unread(binlog *bl, void *buf, unsigned int len)
 	bl->mem_avail += len;
 	entry->size = len;
 	entry->data = buf;
+	entry->shared = NULL;
 	if (!bl->read_index) {
 		/*
 		 * first entry to be pushed back to memory after
@@ -403,6 +434,7 @@ static int binlog_mem_add(binlog *bl, void *buf, unsigned int len)
 	}
 
 	entry->size = len;
+	entry->shared = NULL;
 	memcpy(entry->data, buf, len);
 	bl->cache[bl->write_index++] = entry;
 	bl->mem_size += entry_size(entry);
@@ -456,6 +488,81 @@ int binlog_add(binlog *bl, void *buf, unsigned int len)
 	return binlog_file_add(bl, buf, len);
 }
 
+binlog_shared *binlog_shared_create(const void *buf, unsigned int len)
+{
+	binlog_shared *sh;
+
+	if (!buf || !len)
+		return NULL;
+
+	sh = malloc(sizeof(*sh));
+	if (!sh)
+		return NULL;
+
+	sh->data = malloc(len);
+	if (!sh->data) {
+		free(sh);
+		return NULL;
+	}
+	memcpy(sh->data, buf, len);
+	sh->size = len;
+	sh->refs = 1;
+
+	return sh;
+}
+
+void binlog_shared_release(binlog_shared *sh)
+{
+	if (!sh)
+		return;
+
+	if (--sh->refs)
+		return;
+
+	free(sh->data);
+	free(sh);
+}
+
+static int binlog_mem_add_shared(binlog *bl, binlog_shared *sh)
+{
+	binlog_entry *entry;
+
+	if (bl->write_index >= bl->alloc && binlog_grow(bl) < 0)
+		return BINLOG_EDROPPED;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return BINLOG_EDROPPED;
+
+	sh->refs++;
+	entry->size = sh->size;
+	entry->data = sh->data;
+	entry->shared = sh;
+	bl->cache[bl->write_index++] = entry;
+	bl->mem_size += entry_size(entry);
+	bl->mem_avail += sh->size;
+
+	return 0;
+}
+
+int binlog_add_shared(binlog *bl, binlog_shared *sh)
+{
+	if (!bl || !sh) {
+		return BINLOG_EADDRESS;
+	}
+
+	if (!binlog_is_valid(bl)) {
+		return BINLOG_EINVALID;
+	}
+
+	/* same ordering rules as for binlog_add() */
+	if (bl->fd == -1 && bl->mem_size + sh->size < bl->max_mem_size) {
+		return binlog_mem_add_shared(bl, sh);
+	}
+
+	return binlog_file_add(bl, sh->data, sh->size);
+}
+
 int binlog_close(binlog *bl)
 {
 	int ret = 0;
@@ -480,8 +587,7 @@ int binlog_flush(binlog *bl)
 		while (bl->read_index < bl->write_index) {
 			binlog_entry *entry = bl->cache[bl->read_index++];
 			binlog_file_add(bl, entry->data, entry->size);
-			free(entry->data);
-			free(entry);
+			entry_release(entry);
 		}
 		free(bl->cache);
 		bl->cache = NULL;
@@ -12,6 +12,12 @@
 /** A binary log. */
 typedef struct binlog binlog;
 
+/**
+ * A reference-counted, immutable chunk of data that can be added
+ * to any number of binary logs while only being stored once.
+ */
+typedef struct binlog_shared binlog_shared;
+
 #define BINLOG_APPEND 1
 #define BINLOG_UNLINK 2
 
@@ -111,6 +117,34 @@ extern int binlog_unread(binlog *bl, void *buf, unsigned int len);
  */
 extern int binlog_add(binlog *bl, void *buf, unsigned int len);
 
+/**
+ * Create a shared entry holding a copy of buf. The caller holds
+ * the initial reference and must drop it with binlog_shared_release()
+ * when done adding it to binlogs.
+ * @param buf The data to share
+ * @param len The size of the data
+ * @return A shared entry on success, NULL on errors.
+ */
+extern binlog_shared *binlog_shared_create(const void *buf, unsigned int len);
+
+/**
+ * Drop one reference to a shared entry, releasing it when the
+ * last one goes away.
+ * @param sh The shared entry
+ */
+extern void binlog_shared_release(binlog_shared *sh);
+
+/**
+ * Add a shared entry to the binary log. The in-memory cache only
+ * takes a reference to the data instead of duplicating it. Reading
+ * it back works exactly as for entries added with binlog_add(), and
+ * the returned data is owned by the caller.
+ * @param bl The binary log object.
+ * @param sh The shared entry to add
+ * @return 0 on success. < 0 on failure.
+ */
+extern int binlog_add_shared(binlog *bl, binlog_shared *sh);
+
 /**
  * Close a file associated to a binary log. In normal circum-
  * stances, files are kept open until binary log is flushed
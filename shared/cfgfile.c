@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -70,23 +71,22 @@ static char *cfg_read_file(const char *path, unsigned *len)
 	return buf;
 }
 
-static struct cfg_comp *start_compound(const char *name, struct cfg_comp *cur, unsigned line)
+static struct cfg_comp *start_compound(const char *name, size_t len, struct cfg_comp *cur, unsigned line)
 {
 	struct cfg_comp *comp = calloc(1, sizeof(struct cfg_comp));
 
 	if (comp) {
-		int namelen = strlen(name);
 		comp->start = line;
-		comp->name = strdup(name);
-		while (ISSPACE(comp->name[namelen - 1])) {
-			comp->name[--namelen] = 0;
-		}
+		comp->name = strndup(name, len);
 		comp->parent = cur;
 	}
 
 	if (cur) {
 		cur->nested++;
-		cur->nest = realloc(cur->nest, sizeof(struct cfg_comp *) * cur->nested);
+		if (cur->nested > cur->nest_len) {
+			cur->nest_len = cur->nested;
+			cur->nest = realloc(cur->nest, sizeof(struct cfg_comp *) * cur->nest_len);
+		}
 		cur->nest[cur->nested - 1] = comp;
 	}
 
@@ -113,40 +113,81 @@ static void add_var(struct cfg_comp *comp, struct cfg_var *v)
 		comp->vlist_len += 5;
 		comp->vlist = realloc(comp->vlist, sizeof(struct cfg_var *) * comp->vlist_len);
 	}
-	if (v->value) {
-		int vlen = strlen(v->value) - 1;
-		while (ISSPACE(v->value[vlen]))
-			v->value[vlen--] = 0;
-	}
 
 	comp->vlist[comp->vars] = malloc(sizeof(struct cfg_var));
 	memcpy(comp->vlist[comp->vars++], v, sizeof(struct cfg_var));
 }
 
-#ifndef __GLIBC__
-static inline char *strchrnul(const char *s, int c)
+/*
+ * Number of variables and nested compounds in each compound of a
+ * file, in the order the compounds start, so parse_file() can give
+ * every compound arrays of the right size up front.
+ */
+struct cfg_size {
+	unsigned vars, nested, parent;
+};
+
+static struct cfg_size *cfg_count_sizes(struct cfg_iter *it)
 {
-	int i = 0, last = 0;
+	struct cfg_size *size;
+	unsigned compounds, vars, cur = 0, n = 0;
+	int type;
+
+	cfg_iter_count(it, &compounds, &vars);
+	size = calloc(compounds + 1, sizeof(*size));
+	if (!size)
+		return NULL;
 
-	for (i = 0;; i++) {
-		if (s[i] == 0 || s[i] == c)
-			break;
+	while ((type = cfg_iter_next(it)) != CFG_EOF) {
+		if (type == CFG_VAR) {
+			size[cur].vars++;
+		} else if (type == CFG_START) {
+			size[cur].nested++;
+			size[++n].parent = cur;
+			cur = n;
+		} else if (cur) {
+			cur = size[cur].parent;
+		}
 	}
-	return &s[i];
+	cfg_iter_rewind(it);
+
+	return size;
 }
-#endif
 
+static void cfg_presize(struct cfg_comp *comp, struct cfg_size *size)
+{
+	if (!comp)
+		return;
+
+	if (size->vars) {
+		comp->vlist_len = size->vars;
+		comp->vlist = malloc(sizeof(struct cfg_var *) * comp->vlist_len);
+	}
+	if (size->nested) {
+		comp->nest_len = size->nested;
+		comp->nest = malloc(sizeof(struct cfg_comp *) * comp->nest_len);
+	}
+}
+
+/*
+ * The file is read into comp->buf and handed to the cfg_iter API.
+ * Keys and values are nul-terminated in place, so the tree
+ * shares its strings with the buffer instead of copying them.
+ */
 static struct cfg_comp *parse_file(const char *path, struct cfg_comp *parent, unsigned line)
 {
-	unsigned compound_depth = 0, buflen, i, lnum = 0;
+	unsigned buflen, n = 0;
 	char *buf;
-	struct cfg_var v;
+	struct cfg_iter it;
+	struct cfg_size *size;
 	struct cfg_comp *comp;
+	int type;
 
-	if (!(comp = start_compound(path, parent, 0)))
+	if (!(comp = start_compound(path, strlen(path), parent, 0)))
 		return NULL;
 
 	if (!(buf = cfg_read_file(path, &buflen))) {
+		free(comp->name);
 		free(comp);
 		return NULL;
 	}
@@ -154,96 +195,39 @@ static struct cfg_comp *parse_file(const char *path, struct cfg_comp *parent, un
 	comp->buf = buf; /* save a pointer to free() later */
 	comp->start = line;
 
-	memset(&v, 0, sizeof(v));
-	for (i = 0; i < buflen; i++) {
-		char *next, *lstart, *lend;
-		lnum++;
-
-		/* skip whitespace */
-		while (ISSPACE(buf[i]))
-			i++;
+	cfg_iter_init(&it, buf, buflen);
+	size = cfg_count_sizes(&it);
+	if (size)
+		cfg_presize(comp, &size[0]);
 
-		/* skip empty lines */
-		if (buf[i] == '\n') {
-			v.key = v.value = NULL;
-			continue;
-		}
-
-		/* skip comments */
-		if (buf[i] == '#') {
-			i++;
-			while(buf[i] != '\n')
-				i++;
-
-			continue;
-		}
+	while ((type = cfg_iter_next(&it)) != CFG_EOF) {
+		struct cfg_var v;
 
-		/* check for compound closure */
-		if (buf[i] == '}') {
-			v.key = v.value = NULL;
-			i++;
-			comp = close_compound(comp, lnum);
+		if (type == CFG_END) {
+			comp = close_compound(comp, it.line);
 			continue;
 		}
 
-		/* we have a real line, so set the starting point */
-		lstart = &buf[i];
-
-		/* locate next newline */
-		next = lend = strchrnul(&buf[i], '\n');
-		while ((ISSPACE(*lend) || *lend == '\n') && lend > lstart)
-			*lend-- = 0;
-
-		/* check for start of compound */
-		if (*lend == '{') {
-			*lend-- = 0;
-
-			/* nul-terminate and strip space from end of line */
-			while(ISSPACE(*lend) && lend > lstart)
-				*lend-- = 0;
-
-			v.key = v.value = NULL;
-			compound_depth++;
-			comp = start_compound(lstart, comp, lnum);
-			i = next - buf;
+		if (type == CFG_START) {
+			comp = start_compound(it.key.str, it.key.len, comp, it.line);
+			if (size)
+				cfg_presize(comp, &size[++n]);
 			continue;
-		} else if (*lend == ';' && lend[-1] != '\\') {
-			*lend-- = 0;
-			while (ISSPACE(*lend) && lend > lstart)
-				*lend-- = 0;
 		}
 
-		if (!v.key) {
-			char *p = lstart + 1;
-			char *split = NULL;
-
-			v.line = lnum;
-			v.key = lstart;
-
-			while (p < lend && !ISSPACE(*p) && *p != '=')
-				p++;
-
-			split = p;
-
-			if (ISSPACE(*p) || *p == '=') {
-				v.key_len = p - &buf[i];
-				while(p <= lend && (ISSPACE(*p) || *p == '='))
-					*p++ = '\0';
-
-				if (*p && p <= lend && p > split)
-					v.value = p;
-			}
+		memset(&v, 0, sizeof(v));
+		v.line = it.line;
+		v.key = buf + (it.key.str - buf);
+		v.key_len = it.key.len;
+		v.key[v.key_len] = 0;
+		if (it.value.str) {
+			v.value = buf + (it.value.str - buf);
+			v.value_len = it.value.len;
+			v.value[v.value_len] = 0;
 		}
-
-		if (v.key && *v.key) {
-			if (v.value)
-				v.value_len = 1 + lend - v.value;
-			add_var(comp, &v);
-			memset(&v, 0, sizeof(v));
-		}
-
-		i = next - buf;
+		add_var(comp, &v);
 	}
+	free(size);
 
 	return comp;
 }
@@ -345,3 +329,153 @@ struct cfg_comp *cfg_parse_file(const char *path)
 
 	return comp;
 }
+
+/** iterator API **/
+void cfg_iter_init(struct cfg_iter *it, const char *buf, size_t len)
+{
+	memset(it, 0, sizeof(*it));
+	it->buf = it->pos = buf;
+	it->end = buf + len;
+	it->next_line = 1;
+}
+
+int cfg_iter_open(struct cfg_iter *it, const char *path)
+{
+	struct stat st;
+	void *map = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Failed to stat '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Failed to mmap() '%s': %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	cfg_iter_init(it, map, st.st_size);
+	it->map_len = st.st_size;
+	return 0;
+}
+
+void cfg_iter_close(struct cfg_iter *it)
+{
+	if (it->map_len)
+		munmap((void *)it->buf, it->map_len);
+	memset(it, 0, sizeof(*it));
+}
+
+void cfg_iter_rewind(struct cfg_iter *it)
+{
+	it->pos = it->buf;
+	it->next_line = 1;
+	it->line = it->depth = 0;
+}
+
+int cfg_iter_next(struct cfg_iter *it)
+{
+	while (it->pos < it->end) {
+		const char *p, *q, *lend, *eol;
+
+		p = it->pos;
+		eol = memchr(p, '\n', it->end - p);
+		if (!eol)
+			eol = it->end;
+		it->pos = eol < it->end ? eol + 1 : eol;
+		it->line = it->next_line++;
+
+		while (p < eol && ISSPACE(*p))
+			p++;
+
+		/* empty lines and comments */
+		if (p == eol || *p == '#')
+			continue;
+
+		it->value.str = NULL;
+		it->value.len = 0;
+
+		if (*p == '}') {
+			if (it->depth)
+				it->depth--;
+			it->key.str = NULL;
+			it->key.len = 0;
+			return CFG_END;
+		}
+
+		lend = eol - 1;
+		while (lend > p && ISSPACE(*lend))
+			lend--;
+
+		if (*lend == '{') {
+			do {
+				lend--;
+			} while (lend >= p && ISSPACE(*lend));
+			it->key.str = p;
+			it->key.len = 1 + lend - p;
+			it->depth++;
+			return CFG_START;
+		}
+
+		if (*lend == ';' && (lend == p || lend[-1] != '\\')) {
+			do {
+				lend--;
+			} while (lend > p && ISSPACE(*lend));
+			if (lend < p)
+				continue;
+		}
+
+		it->key.str = p;
+		for (q = p + 1; q < lend && !ISSPACE(*q) && *q != '='; q++)
+			;
+		if (q > lend || (!ISSPACE(*q) && *q != '=')) {
+			it->key.len = 1 + lend - p;
+			return CFG_VAR;
+		}
+
+		it->key.len = q - p;
+		while (q <= lend && (ISSPACE(*q) || *q == '='))
+			q++;
+		if (q <= lend) {
+			it->value.str = q;
+			it->value.len = 1 + lend - q;
+		}
+		return CFG_VAR;
+	}
+
+	return CFG_EOF;
+}
+
+/*
+ * Counts the compounds and variables in the file, so callers can
+ * size their arrays before reading it for real. Leaves the iterator
+ * at the start of the file.
+ */
+void cfg_iter_count(struct cfg_iter *it, unsigned *compounds, unsigned *vars)
+{
+	int type;
+
+	*compounds = *vars = 0;
+	cfg_iter_rewind(it);
+	while ((type = cfg_iter_next(it)) != CFG_EOF) {
+		if (type == CFG_START)
+			(*compounds)++;
+		else if (type == CFG_VAR)
+			(*vars)++;
+	}
+	cfg_iter_rewind(it);
+}
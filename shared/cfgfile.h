@@ -2,6 +2,7 @@
 #define INCLUDE_cfgfile_h__
 
 #include <stdlib.h>
+#include <string.h>
 
 /* types */
 struct cfg_var {
@@ -19,12 +20,51 @@ struct cfg_comp {
 	unsigned int vlist_len;   /* size of vlist */
 	unsigned start;           /* starting line */
 	unsigned nested;          /* number of compounds nested below this */
+	unsigned nest_len;        /* size of nest */
 	struct cfg_var **vlist;   /* array of variables */
 	struct cfg_comp *parent;  /* nested from */
 	struct cfg_comp **nest;   /* compounds nested inside this one */
 };
 
+/*
+ * Reading a config file without building a tree of cfg_comp's.
+ * The file is mmap()'ed and cfg_iter_next() returns one item at a
+ * time, with "key" and "value" pointing into the mapping, so nothing
+ * is copied or allocated. Spans are not nul-terminated.
+ * cfg_parse_file() builds its tree from the same iterator.
+ */
+struct cfg_span {
+	const char *str;
+	size_t len;
+};
+
+/* true if "span" is exactly "str" */
+static inline int cfg_span_is(const struct cfg_span *span, const char *str)
+{
+	return span->str && !strncmp(span->str, str, span->len) && !str[span->len];
+}
+
+#define CFG_EOF   0
+#define CFG_VAR   1 /* "key" and "value". value.str is NULL if there is none */
+#define CFG_START 2 /* compound named "key" starts */
+#define CFG_END   3 /* the innermost compound ends */
+
+struct cfg_iter {
+	const char *buf, *end, *pos;
+	size_t map_len;     /* 0 unless buf is mapped by cfg_iter_open() */
+	unsigned next_line;
+	unsigned line;      /* of the item returned last */
+	unsigned depth;     /* of nested compounds */
+	struct cfg_span key, value;
+};
+
 /* prototypes */
+extern int cfg_iter_open(struct cfg_iter *it, const char *path);
+extern void cfg_iter_init(struct cfg_iter *it, const char *buf, size_t len);
+extern int cfg_iter_next(struct cfg_iter *it);
+extern void cfg_iter_rewind(struct cfg_iter *it);
+extern void cfg_iter_count(struct cfg_iter *it, unsigned *compounds, unsigned *vars);
+extern void cfg_iter_close(struct cfg_iter *it);
 extern struct cfg_comp *cfg_parse_file(const char *path);
 extern void cfg_destroy_compound(struct cfg_comp *comp);
 extern void cfg_warn(struct cfg_comp *comp, struct cfg_var *v, const char *fmt, ...)
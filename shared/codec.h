@@ -8,13 +8,46 @@
 
 int merlin_encode(void *data, int cb_type, char *buf, int buflen);
 int merlin_decode(void *ds, off_t len, int cb_type);
-static inline int merlin_encode_event(merlin_event *pkt, void *data)
+
+/* the callback counters for pkt's type, if we have any */
+static inline struct callback_count *codec_cb_count(merlin_node *node, merlin_event *pkt)
 {
-	return merlin_encode(data, pkt->hdr.type, pkt->body, sizeof(pkt->body));
+	if (!node || pkt->hdr.type >= ARRAY_SIZE(node->stats.cb_count))
+		return NULL;
+	return &node->stats.cb_count[pkt->hdr.type];
+}
+
+/* node is the one whose statistics get the encoding time */
+static inline int merlin_encode_event(merlin_node *node, merlin_event *pkt, void *data)
+{
+	struct callback_count *cb = codec_cb_count(node, pkt);
+	unsigned long long start = 0;
+	int sample, ret;
+
+	sample = cb && !(cb->encoded++ % CB_CPU_SAMPLE_RATE);
+	if (sample)
+		start = cb_cpu_clock();
+	ret = merlin_encode(data, pkt->hdr.type, pkt->body, sizeof(pkt->body));
+	if (sample) {
+		cb->encode_ns += cb_cpu_clock() - start;
+		cb->encode_samples++;
+	}
+	return ret;
 }
 static inline int merlin_decode_event(merlin_node *node, merlin_event *pkt)
 {
-	int ret = merlin_decode(pkt->body, pkt->hdr.len, pkt->hdr.type);
+	struct callback_count *cb = codec_cb_count(node, pkt);
+	unsigned long long start = 0;
+	int sample, ret;
+
+	sample = cb && !(cb->decoded++ % CB_CPU_SAMPLE_RATE);
+	if (sample)
+		start = cb_cpu_clock();
+	ret = merlin_decode(pkt->body, pkt->hdr.len, pkt->hdr.type);
+	if (sample) {
+		cb->decode_ns += cb_cpu_clock() - start;
+		cb->decode_samples++;
+	}
 
 	if (ret) {
 		lerr("CODEC: Failed to decode packet from '%s'. type: %u (%s); code: %u; len: %u",
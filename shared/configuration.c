@@ -1,6 +1,7 @@
 #include "logging.h"
 #include "ipc.h"
 #include "shared.h"
+#include "trace.h"
 
 #ifdef MERLIN_MODULE_BUILD
 #include <module/oconfsplit.h>
@@ -73,6 +74,14 @@ int grok_confsync_compound(struct cfg_comp *comp, merlin_confsync *csync)
 			csync->fetch.cmd = strdup(v->value);
 			continue;
 		}
+		if (!strcmp(v->key, "reload")) {
+			csync->reload = strdup(v->value);
+			continue;
+		}
+		if (!strcmp(v->key, "workers")) {
+			csync->workers = atoi(v->value);
+			continue;
+		}
 		/*
 		 * we ignore additional variables here, since the
 		 * config sync script may want to add additional
@@ -138,6 +147,13 @@ int grok_common_var(struct cfg_comp *config, struct cfg_var *v)
 		return 1;
 	}
 
+	if (!prefixcmp(v->key, "trace_")) {
+		if (!trace_grok_var(v->key, v->value))
+			cfg_error(config, v, "Failed to grok trace option");
+
+		return 1;
+	}
+
 	if (!prefixcmp(v->key, "binlog_")) {
 		if (!grok_binlog_var(v->key, v->value))
 			cfg_error(config, v, "Failed to grok binlog option");
@@ -0,0 +1,73 @@
+#include "histogram.h"
+#include <string.h>
+
+static unsigned int bucket_index(unsigned long long v)
+{
+	unsigned int bits;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+
+	bits = 63 - __builtin_clzll(v);
+	if (bits >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	/* the top HIST_SUB_BITS bits below the leading one pick the sub-bucket */
+	return ((bits - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((v >> (bits - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* the highest value that ends up in bucket idx */
+unsigned long long histogram_bucket_limit(unsigned int idx)
+{
+	unsigned int bits, sub;
+
+	if (idx < (1 << HIST_SUB_BITS))
+		return idx;
+
+	bits = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = idx & ((1 << HIST_SUB_BITS) - 1);
+	return ((((1ULL << HIST_SUB_BITS) + sub + 1) << (bits - HIST_SUB_BITS))) - 1;
+}
+
+void histogram_add(merlin_histogram *h, unsigned long long usec)
+{
+	h->bucket[bucket_index(usec)]++;
+	h->count++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+/*
+ * Returns the value below which pct percent of the recorded values
+ * fall, rounded up to the end of its bucket, but never more than
+ * the biggest value we've seen.
+ */
+unsigned long long histogram_percentile(const merlin_histogram *h, unsigned int pct)
+{
+	unsigned long long want, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	want = (h->count * pct + 99) / 100;
+	if (!want)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+
+	/* the last bucket has no upper limit */
+	if (i >= HIST_BUCKETS - 1 || histogram_bucket_limit(i) > h->max)
+		return h->max;
+	return histogram_bucket_limit(i);
+}
+
+void histogram_reset(merlin_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,37 @@
+#ifndef INCLUDE_histogram_h__
+#define INCLUDE_histogram_h__
+#include <time.h>
+
+/*
+ * Log-bucketed histograms of microsecond values, in the style of
+ * HdrHistogram. Values below 2^HIST_SUB_BITS get a bucket each.
+ * Every power of two above that is split into 2^HIST_SUB_BITS
+ * buckets, so a reported value is never more than 12.5% off from
+ * the real one. Values up to 2^40 usec (about 12 days) are kept
+ * apart, and anything bigger lands in the last bucket.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct merlin_histogram {
+	unsigned long long count, sum, max;
+	unsigned int bucket[HIST_BUCKETS];
+};
+typedef struct merlin_histogram merlin_histogram;
+
+extern void histogram_add(merlin_histogram *h, unsigned long long usec);
+extern unsigned long long histogram_percentile(const merlin_histogram *h, unsigned int pct);
+extern void histogram_reset(merlin_histogram *h);
+extern unsigned long long histogram_bucket_limit(unsigned int idx);
+
+/* a monotonic clock, for measuring how long things take */
+static inline unsigned long long histogram_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
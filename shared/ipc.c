@@ -1,32 +1,68 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <libgen.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
 
 #include "shared.h"
 #include "logging.h"
 #include "ipc.h"
 #include "io.h"
 #include "node.h"
+#include "shmring.h"
+#include "trace.h"
 
 static int listen_sock = -1; /* for bind() and such */
 static char *ipc_sock_path;
 merlin_node ipc; /* the ipc node */
 
+/*
+ * Shared memory ring for events from the module. merlind creates it
+ * and offers it once per connection. The module attaches to it and
+ * keeps it in ipc.ring. Here, on the daemon side, is the reading end.
+ */
+static uint32_t ring_size;
+static int ring_offered;
+static shmring *ring;
+static uint32_t ring_len; /* of the event handed out last */
+static int passed_fd[2] = { -1, -1 }; /* memfd and eventfd from merlind */
+
+static struct merlin_ipc_filter filter;
+static int have_filter;
+
 /*
  * this lives here since both daemon and module needs it, but
  * none of the apps should have it
  */
+/* the value the kernel actually uses, or -1 */
+static int sockopt_value(int sd, int level, int opt)
+{
+	int val;
+	socklen_t len = sizeof(val);
+
+	if (sd < 0 || getsockopt(sd, level, opt, &val, &len) < 0)
+		return -1;
+	return val;
+}
+
 int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 {
 	merlin_nodeinfo *i;
 	merlin_node_stats *s = &n->stats;
 	struct merlin_assigned_objects aso;
 	merlin_peer_group *pg;
+	int user_timeout = -1, busy_poll = -1;
 
 	i = &n->info;
 	pg = n->pgroup;
 	aso.hosts = n->assigned.current.hosts + n->assigned.extra.hosts;
 	aso.services = n->assigned.current.services + n->assigned.extra.services;
+#ifdef TCP_USER_TIMEOUT
+	user_timeout = sockopt_value(n->sock, IPPROTO_TCP, TCP_USER_TIMEOUT);
+#endif
+#ifdef SO_BUSY_POLL
+	busy_poll = sockopt_value(n->sock, SOL_SOCKET, SO_BUSY_POLL);
+#endif
 
 	nsock_printf(sd, "instance_id=%d;name=%s;source_name=%s;socket=%d;type=%s;"
 				 "state=%s;peer_id=%u;flags=%d;"
@@ -57,7 +93,10 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 "csync_num_attempts=%d;csync_max_attempts=%d;"
 				 "csync_last_attempt=%lu;"
 				 "csync_push_cmd=%s;csync_push_is_running=%d;"
-				 "csync_fetch_cmd=%s;csync_fetch_is_running=%d"
+				 "csync_fetch_cmd=%s;csync_fetch_is_running=%d;"
+				 "sndbuf=%d;rcvbuf=%d;tcp_nodelay=%d;tcp_cork=%d;"
+				 "keepalive=%d;keepalive_idle=%d;keepalive_interval=%d;"
+				 "keepalive_count=%d;tcp_user_timeout=%d;busy_poll=%d"
 				 "\n",
 				 instance_id,
 				 n->name, n->source_name, n->sock, node_type(n),
@@ -90,7 +129,16 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 n->csync_num_attempts, n->csync_max_attempts,
 				 n->csync_last_attempt,
 				 n->csync.push.cmd ? n->csync.push.cmd : "", n->csync.push.is_running,
-				 n->csync.fetch.cmd ? n->csync.fetch.cmd : "", n->csync.fetch.is_running
+				 n->csync.fetch.cmd ? n->csync.fetch.cmd : "", n->csync.fetch.is_running,
+				 sockopt_value(n->sock, SOL_SOCKET, SO_SNDBUF),
+				 sockopt_value(n->sock, SOL_SOCKET, SO_RCVBUF),
+				 sockopt_value(n->sock, IPPROTO_TCP, TCP_NODELAY),
+				 n->sockopts.cork,
+				 sockopt_value(n->sock, SOL_SOCKET, SO_KEEPALIVE),
+				 sockopt_value(n->sock, IPPROTO_TCP, TCP_KEEPIDLE),
+				 sockopt_value(n->sock, IPPROTO_TCP, TCP_KEEPINTVL),
+				 sockopt_value(n->sock, IPPROTO_TCP, TCP_KEEPCNT),
+				 user_timeout, busy_poll
 				);
 	return 0;
 }
@@ -146,6 +194,7 @@ int ipc_accept(void)
 	}
 
 	node_set_state(&ipc, STATE_NEGOTIATING, "Accepted");
+	ring_offered = 0;
 
 	return ipc.sock;
 }
@@ -190,6 +239,21 @@ int ipc_grok_var(char *var, char *val)
 	if (!strcmp(var, "ipc_socket"))
 		return !ipc_set_sock_path(val);
 
+	if (!strcmp(var, "ipc_shm_size")) {
+		char *end;
+		unsigned long long size = strtoull(val, &end, 10);
+
+		switch (*end) {
+		case 'g': case 'G': size <<= 10; /* fallthrough */
+		case 'm': case 'M': size <<= 10; /* fallthrough */
+		case 'k': case 'K': size <<= 10; end++;
+		}
+		if (*end || size > (1ULL << 30))
+			return 0;
+		ring_size = size;
+		return 1;
+	}
+
 	if (!strcmp(var, "ipc_binlog")) {
 		lwarn("%s is deprecated. The name will always be computed.", var);
 		lwarn("   Set binlog_dir to control where the file will be created");
@@ -369,3 +433,239 @@ int ipc_send_event(merlin_event *pkt)
 
 	return 0;
 }
+
+/*
+ * node_recv() for the module's end of the ipc socket, which also
+ * picks up file descriptors passed along with CTRL_SHMRING.
+ */
+int ipc_recv(void)
+{
+	char buf[16384];
+	char cbuf[CMSG_SPACE(sizeof(passed_fd))];
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int len;
+
+	if (ipc.sock < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(ipc.sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (len <= 0) {
+		node_disconnect(&ipc, "recvmsg() returned %d: %s", len, len ? strerror(errno) : "EOF");
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (passed_fd[0] >= 0)
+			close(passed_fd[0]);
+		if (passed_fd[1] >= 0)
+			close(passed_fd[1]);
+		passed_fd[0] = passed_fd[1] = -1;
+		if (cmsg->cmsg_len == CMSG_LEN(sizeof(passed_fd)))
+			memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(passed_fd));
+	}
+
+	nm_bufferqueue_push(ipc.bq, buf, len);
+	ipc.last_action = ipc.last_recv = time(NULL);
+	ipc.stats.bytes.read += len;
+	return len;
+}
+
+/* module: start writing events to the ring merlind offered */
+int ipc_ring_attach(void)
+{
+	shmring *r;
+
+	if (passed_fd[0] < 0 || passed_fd[1] < 0) {
+		lwarn("ipc: Got %s without a ring to attach to", ctrl_name(CTRL_SHMRING));
+		return -1;
+	}
+
+	r = shmring_attach(passed_fd[0], passed_fd[1]);
+	close(passed_fd[0]);
+	if (!r)
+		close(passed_fd[1]);
+	passed_fd[0] = passed_fd[1] = -1;
+	if (!r)
+		return -1;
+
+	shmring_destroy(ipc.ring);
+	ipc.ring = r;
+	linfo("ipc: Sending events to merlind through %s of shared memory",
+	      human_bytes(r->size));
+	return 0;
+}
+
+/*
+ * daemon: create a ring for this connection and pass it to the
+ * module. A module that doesn't know about rings never sees the
+ * descriptors and just keeps using the socket.
+ */
+int ipc_ring_offer(void)
+{
+	merlin_header hdr;
+	char cbuf[CMSG_SPACE(sizeof(passed_fd))];
+	struct iovec iov = { &hdr, HDR_SIZE };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fds[2], memfd;
+
+	if (!ring_size || ring_offered || ipc.sock < 0)
+		return 0;
+	ring_offered = 1;
+
+	/* whatever the last module left behind has been read by now */
+	ipc_ring_close();
+	ring = shmring_create(ring_size, &memfd);
+	if (!ring) {
+		lwarn("ipc: Failed to set up shared memory. Events will go through the socket");
+		return -1;
+	}
+
+	memset(&hdr, 0, HDR_SIZE);
+	hdr.sig.id = MERLIN_SIGNATURE;
+	hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	gettimeofday(&hdr.sent, NULL);
+	hdr.type = CTRL_PACKET;
+	hdr.code = CTRL_SHMRING;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = memfd;
+	fds[1] = ring->efd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(ipc.sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != HDR_SIZE) {
+		lerr("ipc: Failed to pass shared memory to the module: %s", strerror(errno));
+		close(memfd);
+		ipc_ring_close();
+		return -1;
+	}
+	close(memfd);
+	ipc.stats.bytes.sent += HDR_SIZE;
+	ldebug("ipc: Offered %s of shared memory to the module", human_bytes(ring->size));
+	return 0;
+}
+
+int ipc_ring_desc(void)
+{
+	return ring ? ring->efd : -1;
+}
+
+/* returns 1 if there are events in the ring, so select() mustn't block */
+int ipc_ring_prepare_wait(void)
+{
+	return ring && shmring_prepare_wait(ring);
+}
+
+void ipc_ring_woken(void)
+{
+	if (ring)
+		shmring_woken(ring);
+}
+
+/*
+ * Returns the next event in the ring, without copying it. It must
+ * be handed back with ipc_ring_release() before asking for another.
+ */
+merlin_event *ipc_ring_get_event(void)
+{
+	merlin_event *pkt;
+
+	while (ring && (pkt = shmring_peek(ring, &ring_len))) {
+		if (ring_len >= HDR_SIZE && pkt->hdr.sig.id == MERLIN_SIGNATURE &&
+		    packet_size(pkt) == (int)ring_len)
+		{
+			ipc.stats.events.read++;
+			ipc.stats.bytes.read += ring_len;
+			ipc.last_action = ipc.last_recv = time(NULL);
+			node_count_cb(&ipc, pkt, 0);
+			trace_event(TRACE_NODE_GET, &ipc, pkt);
+			return pkt;
+		}
+		lerr("ipc: Invalid packet of %u bytes in shared memory. Skipping it", ring_len);
+		shmring_consume(ring, ring_len);
+	}
+
+	return NULL;
+}
+
+void ipc_ring_release(void)
+{
+	shmring_consume(ring, ring_len);
+}
+
+void ipc_ring_close(void)
+{
+	shmring_destroy(ring);
+	ring = NULL;
+}
+
+/* forget what the last daemon asked for, as the next one may be older */
+void ipc_filter_reset(void)
+{
+	have_filter = 0;
+}
+
+int ipc_filter_set(const merlin_event *pkt)
+{
+	if (pkt->hdr.len != sizeof(filter)) {
+		lwarn("ipc: Ignoring event filter of %u bytes. Expected %u",
+		      pkt->hdr.len, (uint)sizeof(filter));
+		return -1;
+	}
+
+	memcpy(&filter, pkt->body, sizeof(filter));
+	have_filter = 1;
+	linfo("ipc: merlind wants events of types 0x%llx", (unsigned long long)filter.types);
+	return 0;
+}
+
+/*
+ * Returns 1 if merlind wants the event. "data" is the unencoded
+ * struct or the encoded body, which start out the same way.
+ */
+int ipc_wants(int type, const void *data)
+{
+	uint32_t mask;
+
+	if (!daemon_wants(type))
+		return 0;
+	if (!have_filter || type < 0 || type >= IPC_FILTER_TYPES)
+		return 1;
+	if (!(filter.types & (1ULL << type)))
+		return 0;
+
+	mask = filter.nebattr[type];
+	if (!mask || !data)
+		return 1;
+
+	switch (type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		return !!(((const merlin_host_status *)data)->nebattr & mask);
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		return !!(((const merlin_service_status *)data)->nebattr & mask);
+	}
+
+	return 1;
+}
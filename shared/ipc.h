@@ -21,6 +21,33 @@ extern int ipc_is_connected(int msec);
 extern int ipc_reinit(void);
 extern int ipc_accept(void);
 extern void ipc_log_event_count(void);
+extern int ipc_recv(void);
+
+/* shared memory transport for events from the module */
+extern int ipc_ring_attach(void);
+extern int ipc_ring_offer(void);
+extern int ipc_ring_desc(void);
+extern int ipc_ring_prepare_wait(void);
+extern void ipc_ring_woken(void);
+extern merlin_event *ipc_ring_get_event(void);
+extern void ipc_ring_release(void);
+extern void ipc_ring_close(void);
+
+/*
+ * What merlind wants from the module, sent as CTRL_FILTER when the
+ * module connects. Until it arrives, the module sends everything
+ * daemon_wants() lets through. nebattr masks only apply to host and
+ * service check and status events, which are then only sent if they
+ * have one of the given attributes set. A zero mask lets all through.
+ */
+#define IPC_FILTER_TYPES 64
+struct merlin_ipc_filter {
+	uint64_t types; /* bit n set means callback type n is wanted */
+	uint32_t nebattr[IPC_FILTER_TYPES];
+};
+extern void ipc_filter_reset(void);
+extern int ipc_filter_set(const merlin_event *pkt);
+extern int ipc_wants(int type, const void *data);
 
 #define ipc_send_ctrl(code, sel) ipc_ctrl(code, sel, NULL, 0)
 #endif /* INCLUDE_ipc_h__ */
@@ -2,11 +2,40 @@
 #include "shared.h"
 
 #include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
 
 static FILE *merlin_log_fp;
 static char *merlin_log_file;
 static int log_to_syslog = 0;
-static int log_levels = (1 << LOG_ERR) | (1 << LOG_WARNING) | (1 << LOG_INFO);
+int merlin_log_levels = (1 << LOG_ERR) | (1 << LOG_WARNING) | (1 << LOG_INFO);
+
+/*
+ * Log messages are formatted by the caller into a ring buffer and
+ * written to disk by a separate thread, so the caller never has to
+ * wait for disk I/O. Any number of threads may add messages, and
+ * a slot's sequence number says whether it is free for producers
+ * (seq == position) or ready for the writer (seq == position + 1).
+ * If the ring fills up, debug and info messages are dropped and
+ * counted rather than making the caller wait, while warnings and
+ * errors are written directly.
+ */
+#define LOG_RING_SLOTS 1024 /* must be a power of 2 */
+#define LOG_LINE_MAX 4096
+#define LOG_FORK_WAIT_MSEC 100 /* how long fork() waits for the ring to drain */
+struct log_slot {
+	unsigned long seq;
+	time_t when;
+	int severity;
+	char msg[LOG_LINE_MAX];
+};
+static struct log_slot *log_ring;
+static unsigned long log_head, log_tail, log_dropped;
+static sem_t log_sem, log_drained;
+static pthread_t log_writer;
+static int log_async, log_stopping, log_atfork_done, log_fork_waiting;
 
 int log_grok_var(char *var, char *val)
 {
@@ -40,11 +69,11 @@ int log_grok_var(char *var, char *val)
 
 				if (!prefixcmp(p, opt)) {
 					if (!mod) /* not '+' or '-', so add all levels below it */
-						log_levels = opt_codes[i].val * 2 - 1;
+						merlin_log_levels = opt_codes[i].val * 2 - 1;
 					else if (mod == '-') /* remove one level */
-						log_levels = log_levels & ~opt_codes[i].val;
+						merlin_log_levels = merlin_log_levels & ~opt_codes[i].val;
 					else
-						log_levels |= opt_codes[i].val;
+						merlin_log_levels |= opt_codes[i].val;
 				}
 			}
 		}
@@ -67,8 +96,269 @@ int log_grok_var(char *var, char *val)
 	return 0;
 }
 
+static int log_fd(void)
+{
+	return merlin_log_fp ? fileno(merlin_log_fp) : -1;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t wlen = write(fd, buf, len);
+		if (wlen < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += wlen;
+		len -= wlen;
+	}
+}
+
+/*
+ * Sends one message to syslog (if enabled) and adds it to buf
+ * for the log file. Returns the number of bytes added to buf.
+ */
+static size_t format_line(char *buf, size_t size, int severity, time_t when, const char *msg)
+{
+	int len;
+
+	if (log_to_syslog) {
+		/*
+		 * the module runs inside Naemon, which owns the
+		 * syslog identity, so we mark our messages instead
+		 */
+		if (is_module)
+			syslog(LOG_DAEMON | severity, "merlin_mod: %s", msg);
+		else
+			syslog(severity, "%s", msg);
+	}
+
+	if (!merlin_log_fp)
+		return 0;
+
+	len = snprintf(buf, size, "[%lu] %d: %s", when, severity, msg);
+	if (len < 0)
+		return 0;
+	if ((size_t)len >= size - 1)
+		len = size - 2;
+	/* callers sometimes add their own newline */
+	if (len && buf[len - 1] == '\n')
+		len--;
+	buf[len++] = '\n';
+	return len;
+}
+
+static void log_flush(void)
+{
+	if (!merlin_log_fp)
+		return;
+	/*
+	 * systems where logging matters (a lot) can specify
+	 * MERLIN_FLUSH_LOGFILES as CPPFLAGS when building
+	 */
+#ifdef MERLIN_FLUSH_LOGFILES
+	fsync(log_fd());
+#endif
+}
+
+/*
+ * Writes everything that's in the ring right now, batching the
+ * writes. Only the writer thread calls this.
+ */
+static void log_drain(void)
+{
+	char buf[65536];
+	size_t len = 0;
+	unsigned long dropped;
+
+	for (;;) {
+		struct log_slot *slot = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+		unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != log_tail + 1) {
+			/* empty, or a producer hasn't finished its message yet */
+			if (__atomic_load_n(&log_head, __ATOMIC_ACQUIRE) == log_tail)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		if (len + LOG_LINE_MAX + 64 > sizeof(buf)) {
+			write_all(log_fd(), buf, len);
+			len = 0;
+		}
+		len += format_line(buf + len, sizeof(buf) - len, slot->severity, slot->when, slot->msg);
+		__atomic_store_n(&slot->seq, log_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		char msg[64];
+		sprintf(msg, "Log buffer full. %lu messages dropped", dropped);
+		len += format_line(buf + len, sizeof(buf) - len, LOG_WARNING, time(NULL), msg);
+	}
+
+	if (len) {
+		write_all(log_fd(), buf, len);
+		log_flush();
+	}
+}
+
+static void *log_writer_thread(__attribute__((unused)) void *arg)
+{
+	for (;;) {
+		if (sem_wait(&log_sem) < 0 && errno == EINTR)
+			continue;
+		log_drain();
+		if (__atomic_load_n(&log_fork_waiting, __ATOMIC_ACQUIRE))
+			sem_post(&log_drained);
+		if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+			break;
+	}
+	log_drain();
+	return NULL;
+}
+
+static int log_push(int severity, const char *fmt, va_list ap)
+{
+	struct log_slot *slot;
+	unsigned long pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		long diff;
+
+		slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+		diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->when = time(NULL);
+	slot->severity = severity;
+	if (vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap) < 0)
+		slot->msg[0] = 0;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	return 0;
+}
+
+static void log_stop_writer(void)
+{
+	if (!log_async)
+		return;
+
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	pthread_join(log_writer, NULL);
+	log_async = 0;
+	sem_destroy(&log_sem);
+	sem_destroy(&log_drained);
+	free(log_ring);
+	log_ring = NULL;
+}
+
+/*
+ * The writer thread doesn't survive fork(), so the child logs
+ * synchronously until it calls log_init() again. We give the writer
+ * a moment to empty the ring first, so the child's messages end up
+ * after the ones logged before it was forked. If the disk is too
+ * slow for that, we fork anyway and the writer catches up later.
+ */
+static void log_atfork_prepare(void)
+{
+	struct timespec deadline;
+
+	if (!log_async)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += LOG_FORK_WAIT_MSEC * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	__atomic_store_n(&log_fork_waiting, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&log_head, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE))
+	{
+		sem_post(&log_sem);
+		if (sem_timedwait(&log_drained, &deadline) < 0 && errno == ETIMEDOUT)
+			break;
+	}
+	__atomic_store_n(&log_fork_waiting, 0, __ATOMIC_RELEASE);
+
+	/* forget wakeups we didn't wait for */
+	while (!sem_trywait(&log_drained))
+		;
+}
+
+static void log_atfork_child(void)
+{
+	log_async = 0;
+	log_ring = NULL;
+}
+
+static void log_start_writer(void)
+{
+	sigset_t all, old;
+	unsigned long i;
+	int ret;
+
+	if (log_async || (!merlin_log_fp && !log_to_syslog))
+		return;
+
+	if (!log_atfork_done) {
+		pthread_atfork(log_atfork_prepare, NULL, log_atfork_child);
+		/* the module has nebmodule_deinit() for this */
+		if (!is_module)
+			atexit(log_stop_writer);
+		log_atfork_done = 1;
+	}
+
+	log_ring = calloc(LOG_RING_SLOTS, sizeof(*log_ring));
+	if (!log_ring)
+		return;
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+		log_ring[i].seq = i;
+	log_head = log_tail = 0;
+	log_stopping = 0;
+	if (sem_init(&log_sem, 0, 0) < 0) {
+		free(log_ring);
+		log_ring = NULL;
+		return;
+	}
+	sem_init(&log_drained, 0, 0);
+
+	/* signals are for the main thread, so the writer blocks them all */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&log_writer, NULL, log_writer_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		sem_destroy(&log_sem);
+		sem_destroy(&log_drained);
+		free(log_ring);
+		log_ring = NULL;
+		return;
+	}
+	log_async = 1;
+}
+
 void log_deinit(void)
 {
+	log_stop_writer();
+
 	if (log_to_syslog && !is_module)
 		closelog();
 
@@ -87,25 +377,24 @@ int log_init(void)
 	if (log_to_syslog && !is_module)
 		openlog("merlind", 0, LOG_DAEMON);
 
-	if (!merlin_log_file)
-		return 0;
-
-	if (!strcmp(merlin_log_file, "stdout")) {
-		merlin_log_fp = stdout;
+	if (!merlin_log_file) {
+		log_start_writer();
 		return 0;
 	}
 
-	if (!strcmp(merlin_log_file, "stderr"))
-		merlin_log_fp = stderr;
-
-	if (merlin_log_fp)
-		return 0;
-
-	merlin_log_fp = fopen(merlin_log_file, "a");
+	if (!merlin_log_fp) {
+		if (!strcmp(merlin_log_file, "stdout"))
+			merlin_log_fp = stdout;
+		else if (!strcmp(merlin_log_file, "stderr"))
+			merlin_log_fp = stderr;
+		else
+			merlin_log_fp = fopen(merlin_log_file, "a");
+	}
 
 	if (!merlin_log_fp)
 		return -1;
 
+	log_start_writer();
 	return 0;
 }
 
@@ -113,25 +402,24 @@ void log_msg(int severity, const char *fmt, ...)
 {
 	va_list ap;
 	int len;
-	char msg[4096];
+	char msg[LOG_LINE_MAX], line[LOG_LINE_MAX + 64];
 
 	/* return early if we shouldn't log stuff of this severity */
-	if (!((1 << severity) & log_levels)) {
+	if (!log_enabled(severity)) {
 		return;
 	}
 
 	/* if we can't log anywhere, return early */
-	if (!merlin_log_fp && !log_to_syslog && !isatty(fileno(stdout)))
+	if (!merlin_log_fp && !log_to_syslog)
 		return;
 
-	if (log_to_syslog) {
-		if (is_module)
-			openlog("merlin_mod", 0, LOG_DAEMON);
+	if (log_async) {
 		va_start(ap, fmt);
-		vsyslog(severity, fmt, ap);
+		len = log_push(severity, fmt, ap);
 		va_end(ap);
-		if (is_module)
-			closelog();
+		if (!len || severity > LOG_WARNING)
+			return;
+		__atomic_fetch_sub(&log_dropped, 1, __ATOMIC_RELAXED);
 	}
 
 	va_start(ap, fmt);
@@ -142,19 +430,9 @@ void log_msg(int severity, const char *fmt, ...)
 	if (len < 0)
 		return;
 
-	if (msg[len] == '\n')
-		msg[len] = 0;
-
-	/* only print to log if it's something else than 'stdout' */
-	if (merlin_log_fp) {
-		fprintf(merlin_log_fp, "[%lu] %d: %s\n", time(NULL), severity, msg);
-		/*
-		 * systems where logging matters (a lot) can specify
-		 * MERLIN_FLUSH_LOGFILES as CPPFLAGS when building
-		 */
-		fflush(merlin_log_fp);
-#ifdef MERLIN_FLUSH_LOGFILES
-		fsync(fileno(merlin_log_fp));
-#endif
+	len = format_line(line, sizeof(line), severity, time(NULL), msg);
+	if (len) {
+		write_all(log_fd(), line, len);
+		log_flush();
 	}
 }
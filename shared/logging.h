@@ -5,25 +5,35 @@
 #include <stdio.h>
 #include <syslog.h>
 
+/*
+ * The level check is done here, so the arguments to disabled log
+ * calls (which are sometimes expensive to produce) are never
+ * evaluated.
+ */
+#define log_enabled(severity) (merlin_log_levels & (1 << (severity)))
+#define log_at(severity, fmt, args...) \
+	(log_enabled(severity) ? log_msg(severity, fmt, ##args) : (void)0)
+
 #ifdef DEBUG_LOGGING
 # define ldebug(fmt, args...) \
-	log_msg(LOG_DEBUG, "%s:%s():%d: " fmt, __FILE__, __func__, __LINE__, ##args)
+	log_at(LOG_DEBUG, "%s:%s():%d: " fmt, __FILE__, __func__, __LINE__, ##args)
 # define linfo(fmt, args...) \
-	log_msg(LOG_INFO, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
+	log_at(LOG_INFO, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
 # define lmsg(fmt, args...) \
-	log_msg(LOG_NOTICE, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
+	log_at(LOG_NOTICE, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
 # define lwarn(fmt, args...) \
-	log_msg(LOG_WARNING, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
+	log_at(LOG_WARNING, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
 # define lerr(fmt, args...) \
-	log_msg(LOG_ERR, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
+	log_at(LOG_ERR, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
 #else
-# define ldebug(fmt, args...) log_msg(LOG_DEBUG, fmt, ##args)
-# define linfo(fmt, args...) log_msg(LOG_INFO, fmt, ##args)
-# define lmsg(fmt, args...) log_msg(LOG_NOTICE, fmt, ##args)
-# define lwarn(fmt, args...) log_msg(LOG_WARNING, fmt, ##args)
-# define lerr(fmt, args...) log_msg(LOG_ERR, fmt, ##args)
+# define ldebug(fmt, args...) log_at(LOG_DEBUG, fmt, ##args)
+# define linfo(fmt, args...) log_at(LOG_INFO, fmt, ##args)
+# define lmsg(fmt, args...) log_at(LOG_NOTICE, fmt, ##args)
+# define lwarn(fmt, args...) log_at(LOG_WARNING, fmt, ##args)
+# define lerr(fmt, args...) log_at(LOG_ERR, fmt, ##args)
 #endif
 
+extern int merlin_log_levels;
 extern int log_init(void);
 extern void log_deinit(void);
 extern int log_grok_var(char *var, char *val);
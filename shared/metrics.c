@@ -0,0 +1,604 @@
+/*
+ * OpenMetrics exposition for the module and the daemon
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "shared.h"
+#include "logging.h"
+#include "ipc.h"
+#include "io.h"
+#include "node.h"
+#include "metrics.h"
+
+struct node_metric {
+	const char *name, *help;
+	int type;
+	unsigned long long (*value)(const merlin_node *n);
+};
+
+struct global_metric {
+	const char *name, *help;
+	int type;
+	unsigned long long (*value)(void);
+	const merlin_histogram *hist;
+};
+
+#define NODE_VALUE(fn, expr) \
+	static unsigned long long fn(const merlin_node *n) { return (expr); }
+
+NODE_VALUE(node_connected, n->state == STATE_CONNECTED)
+NODE_VALUE(node_events_sent, n->stats.events.sent)
+NODE_VALUE(node_events_read, n->stats.events.read)
+NODE_VALUE(node_events_dropped, n->stats.events.dropped)
+NODE_VALUE(node_events_logged, n->stats.events.logged)
+NODE_VALUE(node_bytes_sent, n->stats.bytes.sent)
+NODE_VALUE(node_bytes_read, n->stats.bytes.read)
+NODE_VALUE(node_bytes_dropped, n->stats.bytes.dropped)
+NODE_VALUE(node_bytes_logged, n->stats.bytes.logged)
+NODE_VALUE(node_binlog_entries, binlog_num_entries(n->binlog))
+NODE_VALUE(node_binlog_bytes, binlog_size(n->binlog))
+NODE_VALUE(node_iocache_bytes, n->bq ? nm_bufferqueue_get_available(n->bq) : 0)
+NODE_VALUE(node_last_recv, n->last_recv)
+NODE_VALUE(node_host_checks, n->host_checks)
+NODE_VALUE(node_service_checks, n->service_checks)
+NODE_VALUE(node_assigned_hosts, n->assigned.current.hosts + n->assigned.extra.hosts)
+NODE_VALUE(node_assigned_services, n->assigned.current.services + n->assigned.extra.services)
+NODE_VALUE(node_expired_hosts, n->assigned.expired.hosts)
+NODE_VALUE(node_expired_services, n->assigned.expired.services)
+
+static const struct node_metric node_metrics[] = {
+	{ "merlin_node_connected", "Whether the node is connected", METRIC_GAUGE, node_connected },
+	{ "merlin_node_events_sent", "Events sent to the node", METRIC_COUNTER, node_events_sent },
+	{ "merlin_node_events_read", "Events read from the node", METRIC_COUNTER, node_events_read },
+	{ "merlin_node_events_dropped", "Events that could not be sent or stored for the node", METRIC_COUNTER, node_events_dropped },
+	{ "merlin_node_bytes_sent", "Bytes sent to the node", METRIC_COUNTER, node_bytes_sent },
+	{ "merlin_node_bytes_read", "Bytes read from the node", METRIC_COUNTER, node_bytes_read },
+	{ "merlin_node_bytes_dropped", "Bytes that could not be sent or stored for the node", METRIC_COUNTER, node_bytes_dropped },
+	{ "merlin_node_backlog_events", "Events waiting in the node's backlog", METRIC_GAUGE, node_events_logged },
+	{ "merlin_node_backlog_bytes", "Bytes waiting in the node's backlog", METRIC_GAUGE, node_bytes_logged },
+	{ "merlin_node_binlog_entries", "Entries in the node's binlog", METRIC_GAUGE, node_binlog_entries },
+	{ "merlin_node_binlog_bytes", "Size of the node's binlog, in memory and on disk", METRIC_GAUGE, node_binlog_bytes },
+	{ "merlin_node_iocache_bytes", "Bytes read from the node but not yet handled", METRIC_GAUGE, node_iocache_bytes },
+	{ "merlin_node_last_recv_timestamp_seconds", "When we last received data from the node", METRIC_GAUGE, node_last_recv },
+	{ "merlin_node_host_checks", "Host checks the node has run", METRIC_COUNTER, node_host_checks },
+	{ "merlin_node_service_checks", "Service checks the node has run", METRIC_COUNTER, node_service_checks },
+	{ "merlin_node_assigned_hosts", "Hosts the node is responsible for checking", METRIC_GAUGE, node_assigned_hosts },
+	{ "merlin_node_assigned_services", "Services the node is responsible for checking", METRIC_GAUGE, node_assigned_services },
+	{ "merlin_node_expired_hosts", "Host checks the node failed to run in time", METRIC_GAUGE, node_expired_hosts },
+	{ "merlin_node_expired_services", "Service checks the node failed to run in time", METRIC_GAUGE, node_expired_services },
+};
+
+#define PGROUP_VALUE(fn, expr) \
+	static unsigned long long fn(const merlin_peer_group *pg) { return (expr); }
+
+PGROUP_VALUE(pgroup_active_nodes, pg->active_nodes)
+PGROUP_VALUE(pgroup_total_nodes, pg->total_nodes)
+PGROUP_VALUE(pgroup_hosts, pg->assigned.hosts)
+PGROUP_VALUE(pgroup_services, pg->assigned.services)
+
+static const struct {
+	const char *name, *help;
+	unsigned long long (*value)(const merlin_peer_group *pg);
+} pgroup_metrics[] = {
+	{ "merlin_pgroup_active_nodes", "Connected nodes in the peer group", pgroup_active_nodes },
+	{ "merlin_pgroup_total_nodes", "Configured nodes in the peer group", pgroup_total_nodes },
+	{ "merlin_pgroup_hosts", "Hosts checked by the peer group", pgroup_hosts },
+	{ "merlin_pgroup_services", "Services checked by the peer group", pgroup_services },
+};
+
+static struct global_metric global_metrics[METRICS_MAX_GLOBAL];
+static unsigned int num_global_metrics;
+
+static const char *type_name[] = { "counter", "gauge", "summary" };
+
+/* a response kept in full until a scraper has read all of it */
+struct metrics_resp {
+	char *buf;
+	unsigned int len, alloc, sent;
+};
+
+/*
+ * Output is gathered here and written whenever it's close to full,
+ * so scraping doesn't do a write() per line. When out_resp is set,
+ * it's appended to that instead.
+ */
+static char out_buf[32768];
+static unsigned int out_len;
+static int out_fd, out_failed;
+static struct metrics_resp *out_resp;
+
+static void out_flush(void)
+{
+	struct metrics_resp *r = out_resp;
+
+	if (!out_len || out_failed) {
+		out_len = 0;
+		return;
+	}
+
+	if (!r) {
+		if (io_send_all(out_fd, out_buf, out_len) != (int)out_len)
+			out_failed = 1;
+		out_len = 0;
+		return;
+	}
+
+	if (r->len + out_len > r->alloc) {
+		unsigned int alloc = r->alloc ? r->alloc * 2 : sizeof(out_buf);
+		char *buf;
+
+		while (alloc < r->len + out_len)
+			alloc *= 2;
+		buf = realloc(r->buf, alloc);
+
+		if (!buf) {
+			out_failed = 1;
+			out_len = 0;
+			return;
+		}
+		r->buf = buf;
+		r->alloc = alloc;
+	}
+	memcpy(r->buf + r->len, out_buf, out_len);
+	r->len += out_len;
+	out_len = 0;
+}
+
+static void out_printf(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void out_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (sizeof(out_buf) - out_len < 1024)
+		out_flush();
+
+	va_start(ap, fmt);
+	len = vsnprintf(out_buf + out_len, sizeof(out_buf) - out_len, fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		out_len += min(len, sizeof(out_buf) - out_len - 1);
+}
+
+/* label values must have backslashes, quotes and newlines escaped */
+static const char *label_escape(const char *str, char *buf, unsigned int len)
+{
+	unsigned int i = 0;
+
+	for (; str && *str && i < len - 2; str++) {
+		if (*str == '\\' || *str == '"' || *str == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = *str == '\n' ? 'n' : *str;
+		} else {
+			buf[i++] = *str;
+		}
+	}
+	buf[i] = 0;
+	return buf;
+}
+
+static void out_family(const char *name, const char *help, int type)
+{
+	out_printf("# TYPE %s %s\n# HELP %s %s\n", name, type_name[type], name, help);
+}
+
+static void out_node_metric(const struct node_metric *m, merlin_node *n)
+{
+	char name[256];
+
+	out_printf("%s%s{node=\"%s\",type=\"%s\"} %llu\n",
+	           m->name, m->type == METRIC_COUNTER ? "_total" : "",
+	           label_escape(n->name, name, sizeof(name)), node_type(n),
+	           m->value(n));
+}
+
+static void out_summary(const char *name, const merlin_histogram *h)
+{
+	static const unsigned int quantiles[] = { 50, 90, 99 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(quantiles); i++) {
+		out_printf("%s{quantile=\"%g\"} %.6f\n", name, quantiles[i] / 100.0,
+		           histogram_percentile(h, quantiles[i]) / 1000000.0);
+	}
+	out_printf("%s_sum %.6f\n%s_count %llu\n", name, h->sum / 1000000.0, name, h->count);
+}
+
+/* peer groups are shared between nodes, so only print each of them once */
+static int pgroup_seen(merlin_peer_group *pg, unsigned int upto)
+{
+	unsigned int i;
+
+	if (ipc.pgroup == pg)
+		return 1;
+	for (i = 0; i < upto; i++) {
+		if (node_table[i]->pgroup == pg)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write all metrics in OpenMetrics text format. Returns 0 on success
+ * and -1 if the other end went away or we ran out of memory.
+ */
+static int metrics_format(void)
+{
+	unsigned int i, x;
+
+	out_len = out_failed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(node_metrics); i++) {
+		const struct node_metric *m = &node_metrics[i];
+
+		out_family(m->name, m->help, m->type);
+		out_node_metric(m, &ipc);
+		for (x = 0; x < num_nodes; x++)
+			out_node_metric(m, node_table[x]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pgroup_metrics); i++) {
+		out_family(pgroup_metrics[i].name, pgroup_metrics[i].help, METRIC_GAUGE);
+		if (ipc.pgroup) {
+			out_printf("%s{pgroup=\"%d\"} %llu\n", pgroup_metrics[i].name,
+			           ipc.pgroup->id, pgroup_metrics[i].value(ipc.pgroup));
+		}
+		for (x = 0; x < num_nodes; x++) {
+			merlin_peer_group *pg = node_table[x]->pgroup;
+			if (!pg || pgroup_seen(pg, x))
+				continue;
+			out_printf("%s{pgroup=\"%d\"} %llu\n", pgroup_metrics[i].name,
+			           pg->id, pgroup_metrics[i].value(pg));
+		}
+	}
+
+	for (i = 0; i < num_global_metrics; i++) {
+		struct global_metric *m = &global_metrics[i];
+
+		out_family(m->name, m->help, m->type);
+		if (m->type == METRIC_SUMMARY)
+			out_summary(m->name, m->hist);
+		else
+			out_printf("%s%s %llu\n", m->name, m->type == METRIC_COUNTER ? "_total" : "", m->value());
+	}
+
+	out_printf("# EOF\n");
+	out_flush();
+
+	return out_failed ? -1 : 0;
+}
+
+int metrics_write(int fd)
+{
+	out_fd = fd;
+	out_resp = NULL;
+	return metrics_format();
+}
+
+/* adds the metrics to r, for when we can't wait for the reader */
+static int metrics_buffer(struct metrics_resp *r)
+{
+	int ret;
+
+	out_resp = r;
+	ret = metrics_format();
+	out_resp = NULL;
+	return ret;
+}
+
+static struct global_metric *metrics_add(const char *name, const char *help, int type)
+{
+	struct global_metric *m;
+
+	if (num_global_metrics >= ARRAY_SIZE(global_metrics)) {
+		lerr("Too many metrics. Not adding '%s'", name);
+		return NULL;
+	}
+
+	m = &global_metrics[num_global_metrics++];
+	m->name = name;
+	m->help = help;
+	m->type = type;
+	return m;
+}
+
+/* name and help must stay valid for as long as we're running */
+int metrics_register(const char *name, const char *help, int type,
+                     unsigned long long (*value)(void))
+{
+	struct global_metric *m = metrics_add(name, help, type);
+
+	if (!m)
+		return -1;
+	m->value = value;
+	return 0;
+}
+
+int metrics_register_summary(const char *name, const char *help,
+                             const merlin_histogram *h)
+{
+	struct global_metric *m = metrics_add(name, help, METRIC_SUMMARY);
+
+	if (!m)
+		return -1;
+	m->hist = h;
+	return 0;
+}
+
+static int metrics_sock = -1;
+static char *metrics_sock_path;
+
+/*
+ * Scrapers we're reading a request from or writing a response to.
+ * They're polled along with the daemon's other sockets, and dropped
+ * if nothing moves for METRICS_CLIENT_TIMEOUT seconds.
+ */
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_CLIENT_TIMEOUT 5
+static struct metrics_client {
+	int sd;
+	time_t last_active;
+	int answered;     /* we're writing resp */
+	int len;
+	char req[1024];
+	struct metrics_resp resp;
+} metrics_clients[METRICS_MAX_CLIENTS];
+static unsigned int num_metrics_clients;
+
+static void metrics_client_close(unsigned int i)
+{
+	close(metrics_clients[i].sd);
+	free(metrics_clients[i].resp.buf);
+	metrics_clients[i] = metrics_clients[--num_metrics_clients];
+}
+
+/*
+ * Start listening for scrapers. spec is either the absolute path
+ * of a unix socket, or [address:]port for TCP. TCP listeners bind
+ * to localhost unless told otherwise.
+ */
+int metrics_listen(const char *spec)
+{
+	struct sockaddr_un saun;
+	struct sockaddr_in sain;
+	struct sockaddr *sa;
+	socklen_t slen;
+	int one = 1;
+
+	metrics_close();
+
+	if (*spec == '/') {
+		if (strlen(spec) >= sizeof(saun.sun_path)) {
+			lerr("metrics: socket path '%s' is too long", spec);
+			return -1;
+		}
+		memset(&saun, 0, sizeof(saun));
+		saun.sun_family = AF_UNIX;
+		strcpy(saun.sun_path, spec);
+		sa = (struct sockaddr *)&saun;
+		slen = sizeof(saun);
+		if (unlink(spec) && errno != ENOENT) {
+			lerr("metrics: Failed to unlink(%s): %s", spec, strerror(errno));
+			return -1;
+		}
+		metrics_sock_path = strdup(spec);
+	} else {
+		const char *port = strrchr(spec, ':');
+		char addr[64] = "127.0.0.1";
+
+		if (port) {
+			if ((unsigned)(port - spec) >= sizeof(addr)) {
+				lerr("metrics: Bad listen address '%s'", spec);
+				return -1;
+			}
+			memcpy(addr, spec, port - spec);
+			addr[port - spec] = 0;
+			port++;
+		} else {
+			port = spec;
+		}
+		memset(&sain, 0, sizeof(sain));
+		sain.sin_family = AF_INET;
+		sain.sin_port = htons(atoi(port));
+		if (!sain.sin_port || !inet_aton(addr, &sain.sin_addr)) {
+			lerr("metrics: Bad listen address '%s'", spec);
+			return -1;
+		}
+		sa = (struct sockaddr *)&sain;
+		slen = sizeof(sain);
+	}
+
+	metrics_sock = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (metrics_sock < 0) {
+		lerr("metrics: Failed to create socket: %s", strerror(errno));
+		return -1;
+	}
+	merlin_set_socket_options(metrics_sock, 0);
+	if (sa->sa_family == AF_INET)
+		setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(metrics_sock, sa, slen) < 0 || listen(metrics_sock, 8) < 0) {
+		lerr("metrics: Failed to listen on '%s': %s", spec, strerror(errno));
+		metrics_close();
+		return -1;
+	}
+
+	linfo("metrics: Listening for scrapers on '%s'", spec);
+	return 0;
+}
+
+void metrics_close(void)
+{
+	while (num_metrics_clients)
+		metrics_client_close(0);
+	if (metrics_sock >= 0)
+		close(metrics_sock);
+	metrics_sock = -1;
+	if (metrics_sock_path) {
+		unlink(metrics_sock_path);
+		safe_free(metrics_sock_path);
+	}
+}
+
+int metrics_sock_desc(void)
+{
+	return metrics_sock;
+}
+
+/*
+ * Answer a scraper. Anything that looks like an HTTP request gets
+ * an HTTP response, so Prometheus can talk to us directly. Others
+ * just get the metrics. The whole response is buffered, and
+ * metrics_poll_clients() writes it as the scraper reads it.
+ */
+static int metrics_serve(struct metrics_client *c)
+{
+	static const char http_header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Connection: close\r\n\r\n";
+
+	c->answered = 1;
+	if (c->len >= 4 && !memcmp(c->req, "GET ", 4)) {
+		out_resp = &c->resp;
+		out_len = out_failed = 0;
+		out_printf("%s", http_header);
+		out_flush();
+		out_resp = NULL;
+	}
+	if (metrics_buffer(&c->resp) < 0) {
+		lerr("metrics: Failed to allocate memory for a response");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Accept a scraper. It's answered by metrics_poll_clients() once
+ * its request has arrived, so we never wait for it here.
+ */
+void metrics_accept(void)
+{
+	struct metrics_client *c;
+	int sd;
+
+	sd = accept(metrics_sock, NULL, NULL);
+	if (sd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			lerr("metrics: accept() failed: %s", strerror(errno));
+		return;
+	}
+	merlin_set_socket_options(sd, 0);
+
+	/* make room by dropping the one that's waited the longest */
+	if (num_metrics_clients == METRICS_MAX_CLIENTS) {
+		unsigned int i, oldest = 0;
+
+		for (i = 1; i < num_metrics_clients; i++) {
+			if (metrics_clients[i].last_active < metrics_clients[oldest].last_active)
+				oldest = i;
+		}
+		ldebug("metrics: Too many scrapers. Dropping the oldest one");
+		metrics_client_close(oldest);
+	}
+
+	c = &metrics_clients[num_metrics_clients++];
+	memset(c, 0, sizeof(*c));
+	c->sd = sd;
+	c->last_active = time(NULL);
+}
+
+/*
+ * Adds scrapers we're reading from to rd and those we're writing
+ * to to wr, and returns the highest fd
+ */
+int metrics_set_fds(fd_set *rd, fd_set *wr)
+{
+	unsigned int i;
+	int max_fd = -1;
+
+	for (i = 0; i < num_metrics_clients; i++) {
+		struct metrics_client *c = &metrics_clients[i];
+
+		FD_SET(c->sd, c->answered ? wr : rd);
+		if (c->sd > max_fd)
+			max_fd = c->sd;
+	}
+	return max_fd;
+}
+
+/* returns 1 once the request is complete, or the scraper is gone */
+static int metrics_client_read(struct metrics_client *c)
+{
+	int result = recv(c->sd, c->req + c->len, sizeof(c->req) - 1 - c->len, MSG_DONTWAIT);
+
+	if (result > 0) {
+		c->len += result;
+		c->req[c->len] = 0;
+		return c->len == (int)sizeof(c->req) - 1 ||
+			strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n");
+	}
+
+	/* the request ends when they shut down their end */
+	return !result || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/* returns 1 once the response is written, or the scraper is gone */
+static int metrics_client_write(struct metrics_client *c)
+{
+	struct metrics_resp *r = &c->resp;
+	int result = send(c->sd, r->buf + r->sent, r->len - r->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (result > 0) {
+		r->sent += result;
+		return r->sent == r->len;
+	}
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+
+	ldebug("metrics: Scraper went away before we were done");
+	return 1;
+}
+
+/*
+ * Reads whatever the scrapers in rd have sent and writes as much
+ * of their responses as those in wr will take, without waiting for
+ * any of them. Scrapers that stall for too long are dropped.
+ */
+void metrics_poll_clients(fd_set *rd, fd_set *wr)
+{
+	time_t now = time(NULL);
+	unsigned int i = 0;
+
+	while (i < num_metrics_clients) {
+		struct metrics_client *c = &metrics_clients[i];
+		int done = 0;
+
+		if (!c->answered && FD_ISSET(c->sd, rd)) {
+			c->last_active = now;
+			if (metrics_client_read(c))
+				done = metrics_serve(c) < 0;
+		} else if (c->answered && FD_ISSET(c->sd, wr)) {
+			c->last_active = now;
+			done = metrics_client_write(c);
+		}
+
+		if (!done && now - c->last_active < METRICS_CLIENT_TIMEOUT) {
+			i++;
+			continue;
+		}
+		if (!done)
+			ldebug("metrics: Dropping scraper after %d seconds without progress", METRICS_CLIENT_TIMEOUT);
+		metrics_client_close(i);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef INCLUDE_metrics_h__
+#define INCLUDE_metrics_h__
+
+#include <sys/select.h>
+#include "histogram.h"
+
+/*
+ * OpenMetrics (Prometheus) exposition of node, binlog and peer
+ * group statistics. Both the module and the daemon can add their
+ * own global metrics to the registry on startup. Queries through
+ * the module are formatted into a static buffer and written as it
+ * fills up. The daemon's scrapers get their whole response buffered,
+ * so its main loop can feed it to them without waiting.
+ */
+#define METRICS_MAX_GLOBAL 32
+
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_SUMMARY, /* from a histogram of usec values, reported in seconds */
+};
+
+extern int metrics_register(const char *name, const char *help, int type,
+                            unsigned long long (*value)(void));
+extern int metrics_register_summary(const char *name, const char *help,
+                                    const merlin_histogram *h);
+extern int metrics_write(int fd);
+
+/* the daemon's optional listener for scrapers */
+extern int metrics_listen(const char *spec);
+extern void metrics_close(void);
+extern int metrics_sock_desc(void);
+extern void metrics_accept(void);
+extern int metrics_set_fds(fd_set *rd, fd_set *wr);
+extern void metrics_poll_clients(fd_set *rd, fd_set *wr);
+
+#endif
@@ -3,17 +3,29 @@
 #include "logging.h"
 #include "ipc.h"
 #include "io.h"
+#include "trace.h"
+#include "shmring.h"
 #include "compat.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <string.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
 
 merlin_node **noc_table, **poller_table, **peer_table;
 
-static int num_selections;
+/*
+ * With hundreds of pollers there are hundreds of selections, so
+ * both selections and nodes are found by name through hash tables.
+ * The selection table grows by doubling and is indexed by id.
+ */
+static int num_selections, alloc_selections;
 static node_selection *selection_table;
+static GHashTable *sel_by_name; /* name -> id + 1 */
+static GHashTable *node_names;
 
 static void node_log_info(const merlin_node *node, const merlin_nodeinfo *info)
 {
@@ -33,6 +45,224 @@ static void node_log_info(const merlin_node *node, const merlin_nodeinfo *info)
 	ldebug(" confed peers: %u", info->configured_peers);
 }
 
+/*
+ * Only the newest state of an object matters to the receiving Naemon,
+ * but merlind on the other end wants every alert for its reports.
+ * Returns the key identifying the object a compactable packet is
+ * about, or 0 if the packet must be kept.
+ */
+static uint64_t compact_key(merlin_event *pkt)
+{
+	int nebattr;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		break;
+	default:
+		return 0;
+	}
+
+	/* nebattr is the first member of both status structs */
+	if (!pkt->hdr.object_id || pkt->hdr.len < sizeof(nebattr))
+		return 0;
+	memcpy(&nebattr, pkt->body, sizeof(nebattr));
+	if (nebattr & (NEBATTR_CHECK_ALERT | NEBATTR_CHECK_FIRST))
+		return 0;
+
+	return ((uint64_t)pkt->hdr.type << 32) | pkt->hdr.object_id;
+}
+
+/*
+ * Compacting a backlog. Rewriting it on reconnect would stall the
+ * event loop for as long as it takes to read and write up to 110MB,
+ * so instead we note the position of the newest entry for each
+ * object as entries are stashed, and skip the older ones as the
+ * backlog is replayed. Positions count from when the backlog was
+ * last empty.
+ */
+struct compact_slot {
+	uint64_t key;
+	uint32_t last; /* position of the newest entry for key */
+};
+
+struct node_compact {
+	struct compact_slot *tbl;
+	uint32_t mask, used;
+	uint32_t added, read; /* entries stashed and replayed */
+	int broken;           /* an entry couldn't be indexed, so skip nothing */
+	unsigned long long skipped, skipped_bytes;
+};
+
+#define COMPACT_MIN_SLOTS 1024
+#define COMPACT_SKIP_MAX 10000 /* superseded entries skipped per send_binlog() */
+
+static struct compact_slot *compact_slot(struct compact_slot *tbl, uint32_t mask, uint64_t key)
+{
+	uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+	while (tbl[i].key && tbl[i].key != key)
+		i = (i + 1) & mask;
+	return &tbl[i];
+}
+
+/* forgets everything, since the backlog is empty */
+static void compact_reset(merlin_node *node)
+{
+	struct node_compact *c = node->compact;
+
+	if (!c)
+		return;
+
+	if (c->skipped) {
+		linfo("BACKLOG: Skipped %llu superseded entries (%s) for %s",
+		      c->skipped, human_bytes(c->skipped_bytes), node->name);
+	}
+	/* don't hang on to a huge table after a long outage */
+	free(c->tbl);
+	memset(c, 0, sizeof(*c));
+}
+
+static int compact_grow(struct node_compact *c)
+{
+	struct compact_slot *tbl;
+	uint32_t i, mask = c->tbl ? (c->mask << 1) | 1 : COMPACT_MIN_SLOTS - 1;
+
+	tbl = calloc(mask + 1, sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (i = 0; c->tbl && i <= c->mask; i++) {
+		if (c->tbl[i].key)
+			*compact_slot(tbl, mask, c->tbl[i].key) = c->tbl[i];
+	}
+	free(c->tbl);
+	c->tbl = tbl;
+	c->mask = mask;
+	return 0;
+}
+
+/* called for every entry added to the node's backlog */
+static void compact_note(merlin_node *node, merlin_event *pkt)
+{
+	struct node_compact *c = node->compact;
+	struct compact_slot *slot;
+	uint64_t key;
+
+	if (!(node->flags & MERLIN_NODE_COMPACT_BACKLOG))
+		return;
+	if (!c && !(c = node->compact = calloc(1, sizeof(*c))))
+		return;
+
+	key = compact_key(pkt);
+	if (key && !c->broken) {
+		if ((!c->tbl || c->used * 2 >= c->mask) && compact_grow(c) < 0) {
+			c->broken = 1;
+		} else {
+			slot = compact_slot(c->tbl, c->mask, key);
+			if (!slot->key) {
+				slot->key = key;
+				c->used++;
+			}
+			slot->last = c->added;
+		}
+	}
+	c->added++;
+}
+
+/*
+ * Called for every entry read from the backlog. Returns 1 if a newer
+ * entry for the same object comes later, so this one can be skipped.
+ */
+static int compact_superseded(merlin_node *node, merlin_event *pkt)
+{
+	struct node_compact *c = node->compact;
+	struct compact_slot *slot;
+	uint32_t pos;
+	uint64_t key;
+
+	if (!c)
+		return 0;
+
+	pos = c->read++;
+	if (!c->tbl || c->broken || !(key = compact_key(pkt)))
+		return 0;
+
+	slot = compact_slot(c->tbl, c->mask, key);
+	return slot->key == key && slot->last != pos;
+}
+
+/*
+ * When each entry in a node's backlog was stashed, oldest first.
+ * hdr.sent is when the originator sent the event, which would make
+ * NODE_LAT_BINLOG include the time it took to reach us.
+ */
+struct node_stamps {
+	unsigned long long *when; /* histogram_clock() at stash time */
+	uint32_t mask, head, tail;
+	int broken;               /* a stamp couldn't be kept, so measure nothing */
+};
+
+#define STAMPS_MIN_SLOTS 1024
+
+/* forgets everything, since the backlog is empty */
+static void stamps_reset(merlin_node *node)
+{
+	struct node_stamps *s = node->stamps;
+
+	if (!s)
+		return;
+
+	free(s->when);
+	memset(s, 0, sizeof(*s));
+}
+
+/* called for every entry added to the node's backlog */
+static void stamps_push(merlin_node *node)
+{
+	struct node_stamps *s = node->stamps;
+
+	if (!s && !(s = node->stamps = calloc(1, sizeof(*s))))
+		return;
+	if (s->broken)
+		return;
+
+	if (!s->when || s->head - s->tail > s->mask) {
+		uint32_t i, n = s->head - s->tail, mask = s->when ? (s->mask << 1) | 1 : STAMPS_MIN_SLOTS - 1;
+		unsigned long long *when;
+
+		when = malloc((mask + 1) * sizeof(*when));
+		if (!when) {
+			s->broken = 1;
+			return;
+		}
+		for (i = 0; i < n; i++)
+			when[i] = s->when[(s->tail + i) & s->mask];
+		free(s->when);
+		s->when = when;
+		s->mask = mask;
+		s->tail = 0;
+		s->head = n;
+	}
+	s->when[s->head++ & s->mask] = histogram_clock();
+}
+
+/*
+ * Called for every entry read from the backlog. Returns when it was
+ * stashed, or 0 if we don't know
+ */
+static unsigned long long stamps_pop(merlin_node *node)
+{
+	struct node_stamps *s = node->stamps;
+
+	if (!s || s->broken || s->head == s->tail)
+		return 0;
+
+	return s->when[s->tail++ & s->mask];
+}
+
 void node_set_state(merlin_node *node, int state, const char *reason)
 {
 	int prev_state, add;
@@ -121,9 +351,6 @@ void node_set_state(merlin_node *node, int state, const char *reason)
 		node_send_ctrl_active(node, CTRL_GENERIC, &ipc.info);
 	}
 
-	if (node->state != STATE_CONNECTED && prev_state != STATE_CONNECTED)
-		return;
-
 	if (node->action)
 		node->action(node, prev_state);
 
@@ -134,9 +361,10 @@ void node_set_state(merlin_node *node, int state, const char *reason)
 		/* mark this so we can disconnect nodes that never send data */
 		node->last_recv = time(NULL);
 
-		merlin_set_socket_options(node->sock, 224 * 1024);
+		/* network nodes got their buffer sizes before connecting */
+		merlin_set_socket_options(node->sock, node == &ipc ? 224 * 1024 : 0);
 		getsockopt(node->sock, SOL_SOCKET, SO_SNDBUF, &snd, &size);
-		getsockopt(node->sock, SOL_SOCKET, SO_SNDBUF, &rcv, &size);
+		getsockopt(node->sock, SOL_SOCKET, SO_RCVBUF, &rcv, &size);
 		ldebug("send / receive buffers are %s / %s for node %s",
 			   human_bytes(snd), human_bytes(rcv), node->name);
 	}
@@ -144,14 +372,9 @@ void node_set_state(merlin_node *node, int state, const char *reason)
 
 node_selection *node_selection_by_name(const char *name)
 {
-	int i;
-
-	for (i = 0; i < num_selections; i++) {
-		if (!strcmp(name, selection_table[i].name))
-			return &selection_table[i];
-	}
+	int id = get_sel_id(name);
 
-	return NULL;
+	return id < 0 ? NULL : &selection_table[id];
 }
 
 merlin_node *node_by_id(uint id)
@@ -162,6 +385,14 @@ merlin_node *node_by_id(uint id)
 	return NULL;
 }
 
+merlin_node *node_by_name(const char *name)
+{
+	if (!node_names || !name)
+		return NULL;
+
+	return g_hash_table_lookup(node_names, name);
+}
+
 /*
  * Returns the (list of) merlin node(s) associated
  * with a particular selection id, or null if the
@@ -169,7 +400,7 @@ merlin_node *node_by_id(uint id)
  */
 linked_item *nodes_by_sel_id(int sel)
 {
-	if (sel < 0 || sel > get_num_selections())
+	if (sel < 0 || sel >= num_selections)
 		return NULL;
 
 	return selection_table[sel].nodes;
@@ -185,17 +416,10 @@ char *get_sel_name(int idx)
 
 int get_sel_id(const char *name)
 {
-	int i;
-
-	if (!num_selections || !name)
+	if (!sel_by_name || !name)
 		return -1;
 
-	for (i = 0; i < num_selections; i++) {
-		if (!strcmp(name, selection_table[i].name))
-			return selection_table[i].id;
-	}
-
-	return -1;
+	return GPOINTER_TO_INT(g_hash_table_lookup(sel_by_name, name)) - 1;
 }
 
 int get_num_selections(void)
@@ -220,7 +444,7 @@ static linked_item *add_linked_item(linked_item *list, void *item)
 static int add_one_selection(char *name, merlin_node *node)
 {
 	int i;
-	node_selection *sel = NULL;
+	node_selection *sel;
 
 	/*
 	 * strip trailing spaces. leading ones are stripped in
@@ -229,23 +453,24 @@ static int add_one_selection(char *name, merlin_node *node)
 	i = strlen(name);
 	while (name[i - 1] == '\t' || name[i - 1] == ' ')
 		name[--i] = 0;
-	printf("Adding selection '%s' for node '%s'\n", name, node->name);
+	ldebug("Adding selection '%s' for node '%s'", name, node->name);
 
-	/* if this selection is already added, just add the node to it */
-	for (i = 0; i < num_selections; i++) {
-		if (!strcmp(name, selection_table[i].name)) {
-			sel = &selection_table[i];
-			break;
-		}
-	}
+	if (!sel_by_name)
+		sel_by_name = g_hash_table_new(g_str_hash, g_str_equal);
 
+	/* if this selection is already added, just add the node to it */
+	sel = node_selection_by_name(name);
 	if (!sel) {
-		selection_table = realloc(selection_table, sizeof(selection_table[0]) * (num_selections + 1));
+		if (num_selections == alloc_selections) {
+			alloc_selections = alloc_selections ? alloc_selections * 2 : 16;
+			selection_table = realloc(selection_table, sizeof(selection_table[0]) * alloc_selections);
+		}
 		sel = &selection_table[num_selections];
 		sel->id = num_selections;
 		sel->name = strdup(name);
 		sel->nodes = NULL;
 		num_selections++;
+		g_hash_table_insert(sel_by_name, sel->name, GINT_TO_POINTER(sel->id + 1));
 	}
 	sel->nodes = add_linked_item(sel->nodes, node);
 
@@ -372,10 +597,18 @@ static void create_node_tree(merlin_node *table, unsigned n)
 	peer_table = &node_table[num_masters];
 	poller_table = &node_table[num_masters + num_peers];
 
+	if (node_names)
+		g_hash_table_destroy(node_names);
+	node_names = g_hash_table_new(g_str_hash, g_str_equal);
+
 	xnoc = xpeer = xpoll = 0;
 	for (i = 0; i < n; i++) {
 		merlin_node *node = &table[i];
 
+		if (g_hash_table_lookup(node_names, node->name))
+			lwarn("Warning: More than one node is named '%s'", node->name);
+		g_hash_table_insert(node_names, node->name, node);
+
 		switch (node->type) {
 		case MODE_NOC:
 			node->id = xnoc;
@@ -406,6 +639,7 @@ static struct {
 	MRLN_ADD_NODE_FLAG(CONNECT),
 	MRLN_ADD_NODE_FLAG(NOTIFIES),
 	MRLN_ADD_NODE_FLAG(FIXED_SRCPORT),
+	MRLN_ADD_NODE_FLAG(COMPACT_BACKLOG),
 };
 
 static int grok_node_flag(int *flags, const char *key, const char *value)
@@ -435,6 +669,62 @@ static int grok_node_flag(int *flags, const char *key, const char *value)
 	return 0;
 }
 
+/*
+ * Parses one of the socket options in struct merlin_sockopts.
+ * Returns 1 if "v" isn't one of them
+ */
+static int grok_node_sockopt(struct cfg_comp *c, struct cfg_var *v, struct merlin_sockopts *so)
+{
+	char *end;
+	long val;
+
+	if (!strcmp(v->key, "send_buffer") || !strcmp(v->key, "recv_buffer")) {
+		unsigned long long size = strtoull(v->value, &end, 10);
+
+		switch (*end) {
+		case 'm': case 'M': size <<= 10; /* fallthrough */
+		case 'k': case 'K': size <<= 10; end++;
+		}
+		if (*end || !size || size > (1ULL << 30))
+			cfg_error(c, v, "Illegal value for %s: %s\n", v->key, v->value);
+		if (*v->key == 's')
+			so->sndbuf = (int)size;
+		else
+			so->rcvbuf = (int)size;
+	}
+	else if (!strcmp(v->key, "tcp_nodelay"))
+		so->nodelay = strtobool(v->value);
+	else if (!strcmp(v->key, "tcp_cork"))
+		so->cork = strtobool(v->value);
+	else if (!strcmp(v->key, "keepalive_idle") || !strcmp(v->key, "keepalive_interval") ||
+	         !strcmp(v->key, "tcp_user_timeout"))
+	{
+		if (grok_seconds(v->value, &val) < 0 || val <= 0 || val > 86400)
+			cfg_error(c, v, "Illegal value for %s: %s\n", v->key, v->value);
+		if (!strcmp(v->key, "keepalive_idle"))
+			so->keepidle = val;
+		else if (!strcmp(v->key, "keepalive_interval"))
+			so->keepintvl = val;
+		else
+			so->user_timeout = val * 1000;
+	}
+	else if (!strcmp(v->key, "keepalive_count") || !strcmp(v->key, "busy_poll")) {
+		int is_count = *v->key == 'k';
+
+		val = strtol(v->value, &end, 10);
+		if (*end || val < !!is_count || val > 1000000)
+			cfg_error(c, v, "Illegal value for %s: %s\n", v->key, v->value);
+		if (is_count)
+			so->keepcnt = val;
+		else
+			so->busy_poll = val;
+	}
+	else
+		return 1;
+
+	return 0;
+}
+
 static void grok_node(struct cfg_comp *c, merlin_node *node)
 {
 	unsigned int i;
@@ -459,6 +749,8 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 
 	/* some sane defaults */
 	node->data_timeout = pulse_interval * 2;
+	memset(&node->sockopts, -1, sizeof(node->sockopts));
+	node->sockopts.sndbuf = node->sockopts.rcvbuf = 224 * 1024;
 
 	for (i = 0; i < c->vars; i++) {
 		struct cfg_var *v = c->vlist[i];
@@ -485,9 +777,27 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 			if (*endptr != 0)
 				cfg_error(c, v, "Illegal value for data_timeout: %s\n", v->value);
 		}
+		else if (!strcmp(v->key, "coalesce_size") || !strcmp(v->key, "coalesce_msec")) {
+			char *endptr;
+			unsigned long val = strtoul(v->value, &endptr, 10);
+
+			if (*endptr != 0)
+				cfg_error(c, v, "Illegal value for %s: %s\n", v->key, v->value);
+			if (node->type != MODE_NOC) {
+				cfg_warn(c, v, "%s is only used for master nodes. Ignoring\n", v->key);
+				continue;
+			}
+			if (!strcmp(v->key, "coalesce_size"))
+				node->coalesce_size = val < sizeof(node->coalesce_pkt->body) ? val : sizeof(node->coalesce_pkt->body);
+			else
+				node->coalesce_msec = val;
+		}
 		else if (!strcmp(v->key, "max_sync_attempts")) {
 			/* restricting max sync attempts is a terrible idea, don't do anything */
 		}
+		else if (!grok_node_sockopt(c, v, &node->sockopts)) {
+			continue;
+		}
 		else if (grok_node_flag(&node->flags, v->key, v->value) < 0) {
 			cfg_error(c, v, "Unknown variable\n");
 		}
@@ -514,6 +824,9 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 		cfg_error(comp, NULL, "Unknown compound statement in node object");
 	}
 
+	if (node->coalesce_size && !node->coalesce_msec)
+		node->coalesce_msec = 100;
+
 	node->last_action = -1;
 	if (node->type == MODE_POLLER && sel_id == -1) {
 		cfg_error(c, NULL, "Missing 'hostgroup' variable in poller definition\n");
@@ -551,6 +864,7 @@ void node_grok_config(struct cfg_comp *config)
 		node = &table[node_i++];
 		memset(node, 0, sizeof(*node));
 		node->conn_sock = node->sock = -1;
+		node->coalesce_timer = -1;
 		node->name = next_word((char *)c->name);
 
 		if (!prefixcmp(c->name, "poller") || !prefixcmp(c->name, "slave")) {
@@ -651,6 +965,55 @@ const char *node_type(const merlin_node *node)
 	return "Unknown node-type";
 }
 
+const char *node_latency_name(int which)
+{
+	static const char *names[NODE_LAT_NUM] = {
+		"send", "binlog", "propagation", "handler",
+	};
+
+	if (which < 0 || which >= NODE_LAT_NUM)
+		return "unknown";
+	return names[which];
+}
+
+/*
+ * Adds the time since "when" (a wall-clock time from some node) to
+ * the given latency histogram. Packets that were never stamped and
+ * stamps from the future, due to clock skew, are ignored.
+ */
+void node_latency_since(merlin_node *node, int which, const struct timeval *when)
+{
+	struct timeval now;
+	long long usec;
+
+	if (!when->tv_sec)
+		return;
+
+	gettimeofday(&now, NULL);
+	usec = (now.tv_sec - when->tv_sec) * 1000000LL + (now.tv_usec - when->tv_usec);
+	if (usec < 0)
+		return;
+	histogram_add(&node->stats.latency[which], usec);
+}
+
+/* count a packet sent to or received from the node, per callback type */
+void node_count_cb(merlin_node *node, merlin_event *pkt, int out)
+{
+	struct callback_count *cb;
+
+	if (pkt->hdr.type >= ARRAY_SIZE(node->stats.cb_count))
+		return;
+
+	cb = &node->stats.cb_count[pkt->hdr.type];
+	if (out) {
+		cb->out++;
+		cb->bytes_out += packet_size(pkt);
+	} else {
+		cb->in++;
+		cb->bytes_in += packet_size(pkt);
+	}
+}
+
 /* close down the connection to a node and mark it as down */
 void node_disconnect(merlin_node *node, const char *fmt, ...)
 {
@@ -663,6 +1026,19 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	iobroker_close(nagios_iobs, node->sock);
 	node->sock = -1;
 
+	/* with the socket gone, this stashes pending events in the backlog */
+	node_coalesce_flush(node);
+	if (node->batch) {
+		free(node->batch);
+		node->batch = NULL;
+	}
+
+	/* the reader is gone too, so don't leave events in its ring */
+	if (node->ring) {
+		shmring_destroy(node->ring);
+		node->ring = NULL;
+	}
+
 	if (fmt) {
 		va_start(ap, fmt);
 		if (vasprintf(&reason, fmt, ap) < 0) {
@@ -674,6 +1050,7 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	if (reason)
 		free(reason);
 	node->last_recv = 0;
+	node->same_oconf = 0;
 
 	/* csync checks only run on reconnect if node->info isn't "identical", so reset it */
 	if (node != &ipc)
@@ -683,7 +1060,31 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	node->bq = nm_bufferqueue_create();
 }
 
-static int node_binlog_add(merlin_node *node, merlin_event *pkt)
+/*
+ * The number of events in pkt. A BATCH_PACKET counts as the events
+ * it holds, so the event counters mean the same with and without
+ * coalescing
+ */
+static unsigned int packet_events(merlin_event *pkt)
+{
+	merlin_header *hdr;
+	uint32_t offset = 0;
+	unsigned int events = 0;
+
+	if (pkt->hdr.type != BATCH_PACKET)
+		return 1;
+
+	while (pkt->hdr.len - offset >= HDR_SIZE) {
+		hdr = (merlin_header *)(pkt->body + offset);
+		if (hdr->len > pkt->hdr.len - offset - HDR_SIZE)
+			break;
+		offset += HDR_SIZE + hdr->len;
+		events++;
+	}
+	return events;
+}
+
+static int node_binlog_add(merlin_node *node, merlin_event *pkt, merlin_fanout *fo)
 {
 	int result;
 
@@ -698,6 +1099,13 @@ static int node_binlog_add(merlin_node *node, merlin_event *pkt)
 			return 0;
 	}
 
+	trace_event(TRACE_BINLOG_ADD, node, pkt);
+
+	if (node->binlog && !binlog_num_entries(node->binlog)) {
+		compact_reset(node);
+		stamps_reset(node);
+	}
+
 	if (!node->binlog) {
 		char *path = NULL;
 
@@ -732,16 +1140,27 @@ static int node_binlog_add(merlin_node *node, merlin_event *pkt)
 		free(path);
 	}
 
-	result = binlog_add(node->binlog, pkt, packet_size(pkt));
+	/*
+	 * packets going to many nodes are copied once, on first use,
+	 * and then shared between all the backlogs that need them
+	 */
+	if (fo && !fo->shared)
+		fo->shared = binlog_shared_create(pkt, packet_size(pkt));
+	if (fo && fo->shared)
+		result = binlog_add_shared(node->binlog, fo->shared);
+	else
+		result = binlog_add(node->binlog, pkt, packet_size(pkt));
 	if (result < 0) {
 		binlog_wipe(node->binlog, BINLOG_UNLINK);
 		/* XXX should mark node as unsynced here */
-		node->stats.events.dropped += node->stats.events.logged + 1;
+		node->stats.events.dropped += node->stats.events.logged + packet_events(pkt);
 		node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
 		node->stats.events.logged = 0;
 		node->stats.bytes.logged = 0;
 	} else {
-		node->stats.events.logged++;
+		compact_note(node, pkt);
+		stamps_push(node);
+		node->stats.events.logged += packet_events(pkt);
 		node->stats.bytes.logged += packet_size(pkt);
 	}
 
@@ -813,6 +1232,7 @@ int node_recv(merlin_node *node)
 int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 {
 	merlin_event *pkt = (merlin_event *)data;
+	unsigned long long start;
 	int sent, sd = 0;
 
 	if (!node || node->sock < 0)
@@ -829,9 +1249,26 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 		}
 	}
 
+	start = histogram_clock();
+
+	/*
+	 * Events to merlind go through shared memory once it has
+	 * offered us a ring. A full ring is treated like a socket
+	 * that would block, so the event ends up in the backlog.
+	 */
+	if (node->ring && len >= HDR_SIZE && pkt->hdr.type != CTRL_PACKET) {
+		if (shmring_write(node->ring, data, len) < 0)
+			return 0;
+		histogram_add(&node->stats.latency[NODE_LAT_SEND], histogram_clock() - start);
+		node->stats.bytes.sent += len;
+		node->last_action = node->last_sent = time(NULL);
+		return len;
+	}
+
 	sent = io_send_all(node->sock, data, len);
 	/* success. Should be the normal case */
 	if (sent == (int)len) {
+		histogram_add(&node->stats.latency[NODE_LAT_SEND], histogram_clock() - start);
 		node->stats.bytes.sent += sent;
 		node->last_action = node->last_sent = time(NULL);
 		return sent;
@@ -867,12 +1304,44 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
  * exhausted, we handle partial events and iocache resets and
  * return NULL
  */
+/*
+ * Returns a copy of the next packet in the batch we're unpacking,
+ * or NULL when there are no more of them.
+ */
+static merlin_event *node_batch_next(merlin_node *node)
+{
+	merlin_event *batch = node->batch, *pkt;
+	merlin_header *hdr;
+	uint32_t left = batch->hdr.len - node->batch_offset;
+
+	if (left >= HDR_SIZE) {
+		hdr = (merlin_header *)(batch->body + node->batch_offset);
+		if (hdr->sig.id == MERLIN_SIGNATURE && hdr->len <= left - HDR_SIZE) {
+			pkt = malloc(HDR_SIZE + hdr->len);
+			memcpy(pkt, hdr, HDR_SIZE + hdr->len);
+			node->batch_offset += HDR_SIZE + hdr->len;
+			node->stats.events.read++;
+			node_count_cb(node, pkt, 0);
+			trace_event(TRACE_NODE_GET, node, pkt);
+			return pkt;
+		}
+		lerr("Invalid packet in batch from '%s'. Skipping %u bytes", node->name, left);
+	}
+
+	free(batch);
+	node->batch = NULL;
+	return NULL;
+}
+
 merlin_event *node_get_event(merlin_node *node)
 {
 	merlin_header hdr;
 	merlin_event *pkt;
 	nm_bufferqueue *bq = node->bq;
 
+	if (node->batch && (pkt = node_batch_next(node)))
+		return pkt;
+
 	if (nm_bufferqueue_peek(bq, HDR_SIZE, (void *)&hdr))
 		return NULL;
 
@@ -890,7 +1359,9 @@ merlin_event *node_get_event(merlin_node *node)
 		node_disconnect(node, "Invalid signature");
 		return NULL;
 	}
-	node->stats.events.read++;
+	/* batches are counted as the events in them are handed out */
+	if (hdr.type != BATCH_PACKET)
+		node->stats.events.read++;
 
 	pkt = calloc(1, HDR_SIZE + hdr.len);
 	if (nm_bufferqueue_unshift(bq, HDR_SIZE + hdr.len, (void *)pkt)) {
@@ -905,15 +1376,111 @@ merlin_event *node_get_event(merlin_node *node)
 		node_log_info(node, (merlin_nodeinfo *)pkt->body);
 	}
 
+	/* hand out the packets in a batch one by one, as if sent separately */
+	if (pkt->hdr.type == BATCH_PACKET) {
+		node->batch = pkt;
+		node->batch_offset = 0;
+		return node_get_event(node);
+	}
+
+	node_count_cb(node, pkt, 0);
+	trace_event(TRACE_NODE_GET, node, pkt);
 	return pkt;
 }
 
+static int node_send_event_fo(merlin_node *node, merlin_event *pkt, int msec, merlin_fanout *fo);
+
+/*
+ * Batching events for a node. Events are appended to coalesce_pkt
+ * until it holds coalesce_size bytes or its first event has waited
+ * coalesce_msec milliseconds, and then go out as one BATCH_PACKET.
+ * The receiving end takes them apart in node_get_event().
+ */
+int node_coalesce_init(merlin_node *node)
+{
+	if (!node->coalesce_size)
+		return -1;
+
+	node->coalesce_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (node->coalesce_timer < 0) {
+		lerr("Failed to create batch timer for %s: %s. Not batching events",
+		     node->name, strerror(errno));
+		node->coalesce_size = 0;
+		return -1;
+	}
+
+	return node->coalesce_timer;
+}
+
+int node_coalesce_flush(merlin_node *node)
+{
+	merlin_event *batch = node->coalesce_pkt;
+	struct itimerspec its;
+
+	if (!node->coalesce_len)
+		return 0;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(node->coalesce_timer, 0, &its, NULL);
+
+	batch->hdr.type = BATCH_PACKET;
+	batch->hdr.len = node->coalesce_len;
+	batch->hdr.selection = DEST_BROADCAST;
+	gettimeofday(&batch->hdr.sent, NULL);
+
+	/* sending may disconnect the node, which flushes again */
+	node->coalesce_len = 0;
+	return node_send_event_fo(node, batch, 0, NULL);
+}
+
+/* returns 0 if pkt was added to the batch, and -1 if it must be sent as is */
+static int node_coalesce(merlin_node *node, merlin_event *pkt)
+{
+	unsigned int size = packet_size(pkt);
+
+	if (size > sizeof(node->coalesce_pkt->body)) {
+		node_coalesce_flush(node);
+		return -1;
+	}
+
+	if (!node->coalesce_pkt) {
+		node->coalesce_pkt = calloc(1, sizeof(merlin_event));
+		if (!node->coalesce_pkt)
+			return -1;
+	}
+
+	if (node->coalesce_len + size > sizeof(node->coalesce_pkt->body))
+		node_coalesce_flush(node);
+
+	/* the connection may have gone away while flushing */
+	if (node->state != STATE_CONNECTED)
+		return -1;
+
+	if (!node->coalesce_len) {
+		struct itimerspec its;
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = node->coalesce_msec / 1000;
+		its.it_value.tv_nsec = (node->coalesce_msec % 1000) * 1000000;
+		timerfd_settime(node->coalesce_timer, 0, &its, NULL);
+	}
+
+	memcpy(node->coalesce_pkt->body + node->coalesce_len, pkt, size);
+	node->coalesce_len += size;
+	node_count_cb(node, pkt, 1);
+
+	if (node->coalesce_len >= node->coalesce_size)
+		node_coalesce_flush(node);
+
+	return 0;
+}
+
 /*
  * Send the given event "pkt" to the node "node", or take appropriate
  * actions on the node itself in case sending fails.
  * Returns 0 on success, and < 0 otherwise.
  */
-int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
+static int node_send_event_fo(merlin_node *node, merlin_event *pkt, int msec, merlin_fanout *fo)
 {
 	int result;
 
@@ -927,16 +1494,25 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 		return -1;
 	}
 
+	trace_event(TRACE_NODE_SEND, node, pkt);
+
+	if (node->coalesce_timer >= 0 && node->state == STATE_CONNECTED &&
+	    pkt->hdr.type != BATCH_PACKET && pkt->hdr.type != CTRL_PACKET &&
+	    !node_coalesce(node, pkt))
+	{
+		return 0;
+	}
+
 	if (node->sock < 0 || node->state != STATE_CONNECTED) {
-		return node_binlog_add(node, pkt);
+		return node_binlog_add(node, pkt, fo);
 	}
 
 	/*
 	 * msec less than zero means the caller has already polled the
 	 * socket, which should also mean it's connected
 	 */
-	if (msec >= 0 && !io_write_ok(node->sock, msec)) {
-		return node_binlog_add(node, pkt);
+	if (msec >= 0 && !node->ring && !io_write_ok(node->sock, msec)) {
+		return node_binlog_add(node, pkt, fo);
 	}
 
 	/* if binlog has entries, we must send those first */
@@ -946,16 +1522,14 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 
 	/* binlog may still have entries. If so, add to it and return */
 	if (binlog_has_entries(node->binlog))
-		return node_binlog_add(node, pkt);
+		return node_binlog_add(node, pkt, fo);
 
 	result = node_send(node, pkt, packet_size(pkt), MSG_DONTWAIT);
 
 	/* successfully sent, so add it to the counter and return 0 */
 	if (result == packet_size(pkt)) {
-		node->stats.events.sent++;
-		if (pkt->hdr.type < ARRAY_SIZE(node->stats.cb_count)) {
-			node->stats.cb_count[pkt->hdr.type].out++;
-		}
+		node->stats.events.sent += packet_events(pkt);
+		node_count_cb(node, pkt, 1);
 		return 0;
 	}
 
@@ -963,21 +1537,38 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 	 * zero size writes and write errors get stashed in binlog.
 	 * From the callers point of view, this counts as a success.
 	 */
-	if (result <= 0 && !node_binlog_add(node, pkt))
+	if (result <= 0 && !node_binlog_add(node, pkt, fo))
 		return 0;
 
 	/* node_send will have marked the node as out of sync now */
 	return -1;
 }
 
-int node_send_binlog(merlin_node *node, merlin_event *pkt)
+int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
+{
+	return node_send_event_fo(node, pkt, msec, NULL);
+}
+
+int node_fanout_send(merlin_node *node, merlin_fanout *fo, int msec)
+{
+	return node_send_event_fo(node, fo->pkt, msec, fo);
+}
+
+void node_fanout_release(merlin_fanout *fo)
+{
+	binlog_shared_release(fo->shared);
+	fo->shared = NULL;
+}
+
+static int send_binlog(merlin_node *node, merlin_event *pkt)
 {
 	merlin_event *temp_pkt;
-	unsigned int len;
+	unsigned int len, skipped = 0;
+	unsigned long long stashed;
 
 	ldebug("Emptying backlog for %s (%u entries, %s)", node->name,
 		   binlog_num_entries(node->binlog), human_bytes(binlog_available(node->binlog)));
-	while (io_write_ok(node->sock, 10) && !binlog_read(node->binlog, (void **)&temp_pkt, &len)) {
+	while ((node->ring || io_write_ok(node->sock, 10)) && !binlog_read(node->binlog, (void **)&temp_pkt, &len)) {
 		int result;
 		if (!temp_pkt || packet_size(temp_pkt) != (int)len ||
 		    !len || !packet_size(temp_pkt) || packet_size(temp_pkt) > MAX_PKT_SIZE)
@@ -992,13 +1583,30 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 			binlog_wipe(node->binlog, BINLOG_UNLINK);
 			return -1;
 		}
+
+		stashed = stamps_pop(node);
+		if (compact_superseded(node, temp_pkt)) {
+			node->compact->skipped++;
+			node->compact->skipped_bytes += len;
+			node->stats.events.logged--;
+			node->stats.bytes.logged -= len;
+			free(temp_pkt);
+			/* leave the rest for the next call */
+			if (++skipped >= COMPACT_SKIP_MAX)
+				return 0;
+			continue;
+		}
+
 		errno = 0;
 		result = node_send(node, temp_pkt, packet_size(temp_pkt), MSG_DONTWAIT);
 
 		/* keep going while we successfully send something */
 		if (result == packet_size(temp_pkt)) {
-			node->stats.events.sent++;
-			node->stats.events.logged--;
+			if (stashed)
+				histogram_add(&node->stats.latency[NODE_LAT_BINLOG], histogram_clock() - stashed);
+			node_count_cb(node, temp_pkt, 1);
+			node->stats.events.sent += packet_events(temp_pkt);
+			node->stats.events.logged -= packet_events(temp_pkt);
 			node->stats.bytes.logged -= packet_size(temp_pkt);
 
 			/*
@@ -1021,8 +1629,12 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 		 */
 		if (result <= 0) {
 			if (!binlog_unread(node->binlog, temp_pkt, len)) {
+				if (node->compact)
+					node->compact->read--;
+				if (stashed)
+					node->stamps->tail--;
 				if (pkt)
-					return node_binlog_add(node, pkt);
+					return node_binlog_add(node, pkt, NULL);
 				return 0;
 			} else {
 				free(temp_pkt);
@@ -1037,16 +1649,39 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 		lerr("Wiping binlog for %s node %s", node_type(node), node->name);
 		binlog_wipe(node->binlog, BINLOG_UNLINK);
 		if (pkt) {
-			node->stats.events.dropped += node->stats.events.logged + 1;
+			node->stats.events.dropped += node->stats.events.logged + packet_events(pkt);
 			node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
 		}
 		node_log_event_count(node, 0);
 		return -1;
 	}
 
+	if (!binlog_num_entries(node->binlog)) {
+		compact_reset(node);
+		stamps_reset(node);
+	}
+
 	return 0;
 }
 
+/*
+ * With tcp_cork, the backlog goes out in full segments instead of
+ * one (or more) per event
+ */
+int node_send_binlog(merlin_node *node, merlin_event *pkt)
+{
+	int result, on = 1, off = 0;
+
+	if (node->sockopts.cork <= 0 || node->ring || node->sock < 0)
+		return send_binlog(node, pkt);
+
+	setsockopt(node->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	result = send_binlog(node, pkt);
+	setsockopt(node->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+	return result;
+}
+
 /*
  * Sends a control event with code "code" and selection "selection"
  * to node "node", packing pkt->body with "data" which must be of
@@ -1064,6 +1699,9 @@ int node_ctrl(merlin_node *node, int code, uint selection, void *data,
 		return -1;
 	}
 
+	/* events queued before this must get there first */
+	node_coalesce_flush(node);
+
 	memset(&pkt.hdr, 0, HDR_SIZE);
 
 	pkt.hdr.sig.id = MERLIN_SIGNATURE;
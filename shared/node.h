@@ -8,6 +8,7 @@
 #include "cfgfile.h"
 #include "binlog.h"
 #include "pgroup.h"
+#include "histogram.h"
 
 #if __BYTE_ORDER == __BIG_ENDIAN
 # define MERLIN_SIGNATURE (uint64_t)0x4d524c4e45565400LL /* "MRLNEVT\0" */
@@ -24,6 +25,7 @@
 #define MERLIN_NODE_CONNECT  (1 << 1)
 #define MERLIN_NODE_FIXED_SRCPORT (1 << 2)
 #define MERLIN_NODE_NOTIFIES (1 << 3)
+#define MERLIN_NODE_COMPACT_BACKLOG (1 << 4)
 
 #define MERLIN_NODE_DEFAULT_POLLER_FLAGS \
 		(MERLIN_NODE_TAKEOVER | MERLIN_NODE_CONNECT | MERLIN_NODE_NOTIFIES)
@@ -45,6 +47,8 @@
 #define CTRL_PACKET   0xffff  /* control packet. "code" described below */
 #define ACK_PACKET    0xfffe  /* ACK ("I understood") (not used) */
 #define NAK_PACKET    0xfffd  /* NAK ("I don't understand") (not used) */
+#define BATCH_PACKET  0xfffc  /* body holds several complete packets */
+#define CMD_BATCH_PACKET 0xfffb /* body holds several external commands */
 
 /* If "type" is CTRL_PACKET, then "code" is one of the following */
 #define CTRL_GENERIC  0 /* generic control packet */
@@ -55,6 +59,9 @@
 #define CTRL_STALL    5 /* (deprecated) signal that we can't accept events for a while */
 #define CTRL_RESUME   6 /* (deprecated) now we can accept events again */
 #define CTRL_STOP     7 /* exit() immediately (only accepted via ipc) */
+#define CTRL_SHMRING  8 /* (ipc only) shared memory ring, passed as fds */
+#define CTRL_FILTER   9 /* (ipc only) body is the events merlind wants */
+#define CTRL_CSYNC   10 /* native config sync. body is a struct csync_msg */
 /* the following magic entries can be used for the "code" entry */
 #define MAGIC_NONET 0xffff /* don't forward to the network */
 
@@ -89,9 +96,10 @@ struct merlin_header {
 	uint16_t selection;  /* used when noc Nagios communicates with mrd */
 	uint32_t len;        /* size of body */
 	struct timeval sent;  /* when this message was sent */
+	uint32_t object_id;  /* sender's object id + 1, or 0 if not set */
 
 	/* pad to 64 bytes for future extensions */
-	char padding[64 - sizeof(struct timeval) - (2 * 6) - 8];
+	char padding[64 - sizeof(struct timeval) - (2 * 6) - 8 - 4];
 } __attribute__((packed));
 typedef struct merlin_header merlin_header;
 
@@ -101,6 +109,18 @@ struct merlin_event {
 } __attribute__((packed));
 typedef struct merlin_event merlin_event;
 
+/*
+ * One external command in a CMD_BATCH_PACKET. Each command in the
+ * batch is for a host or service in the packet's selection, and
+ * entries follow each other back to back
+ */
+struct merlin_cmd_entry {
+	int64_t entry_time;
+	uint32_t command_type;
+	uint32_t len;   /* of args, including the nul byte and padding to 8 bytes */
+	char args[];
+};
+
 /* forward declaration */
 struct merlin_node;
 typedef struct merlin_node merlin_node;
@@ -157,6 +177,8 @@ struct merlin_confsync {
 	int configured;
 	merlin_child push;
 	merlin_child fetch;
+	char *reload; /* run after a native sync has changed our config */
+	int workers;  /* (global only) max number of pushes running at once */
 };
 typedef struct merlin_confsync merlin_confsync;
 
@@ -168,11 +190,45 @@ struct statistics_vars {
 };
 struct callback_count {
 	unsigned int in, out;
+	unsigned long long bytes_in, bytes_out;
+	/*
+	 * CPU time spent encoding and decoding. Only one in every
+	 * CB_CPU_SAMPLE_RATE events is timed, since reading the
+	 * thread's CPU clock is a system call
+	 */
+	unsigned int encoded, decoded;
+	unsigned int encode_samples, decode_samples;
+	unsigned long long encode_ns, decode_ns;
 };
+#define CB_CPU_SAMPLE_RATE 16
+
+static inline unsigned long long cb_cpu_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* estimated total, in nanoseconds, from the sampled events */
+static inline unsigned long long cb_cpu_estimate(unsigned long long ns, unsigned int samples, unsigned int total)
+{
+	return samples ? (unsigned long long)((double)ns * total / samples) : 0;
+}
+/* latency histograms we keep for each node, all in microseconds */
+enum {
+	NODE_LAT_SEND,        /* time spent sending a packet */
+	NODE_LAT_BINLOG,      /* time from being stashed until sent from the backlog */
+	NODE_LAT_PROPAGATION, /* time from hdr.sent until a check result arrived */
+	NODE_LAT_HANDLER,     /* time spent handling a packet from the node */
+	NODE_LAT_NUM
+};
+
 struct merlin_node_stats {
 	struct statistics_vars events, bytes;
 	time_t last_logged;     /* when we logged the event-count last */
 	struct callback_count cb_count[NEBCALLBACK_NUMITEMS + 1];
+	merlin_histogram latency[NODE_LAT_NUM];
 };
 typedef struct merlin_node_stats merlin_node_stats;
 
@@ -207,6 +263,22 @@ enum {
 
 #define NODE_WARN_CLOCK 1   /* clock skew warning */
 
+/*
+ * Transport options for a network node's socket, set in its config.
+ * -1 leaves the kernel's default alone. Setting any of the keepalive
+ * ones turns on SO_KEEPALIVE
+ */
+struct merlin_sockopts {
+	int sndbuf, rcvbuf;  /* SO_SNDBUF and SO_RCVBUF, in bytes */
+	int nodelay;         /* TCP_NODELAY */
+	int cork;            /* TCP_CORK while the backlog is sent */
+	int keepidle;        /* TCP_KEEPIDLE, in seconds */
+	int keepintvl;       /* TCP_KEEPINTVL, in seconds */
+	int keepcnt;         /* TCP_KEEPCNT */
+	int user_timeout;    /* TCP_USER_TIMEOUT, in milliseconds */
+	int busy_poll;       /* SO_BUSY_POLL, in microseconds */
+};
+
 struct merlin_node {
 	char *name;             /* name of this node */
 	char *source_name;      /* check source name for this node */
@@ -221,6 +293,7 @@ struct merlin_node {
 	int flags;              /* flags for this node */
 	struct sockaddr *sa;    /* should always point to sain */
 	struct sockaddr_in sain;
+	struct merlin_sockopts sockopts; /* applied when connecting or accepting */
 	unsigned int data_timeout; /* send gracetime before we disconnect */
 	unsigned int host_checks; /* actually executed host checks */
 	unsigned int service_checks; /* actually executed service checks */
@@ -230,6 +303,12 @@ struct merlin_node {
 	time_t last_conn_attempt_logged; /* when we last logged a connect attempt */
 	time_t last_conn_attempt; /* when we last tried initiating a connection */
 	time_t connect_time;    /* when we established a connection to this node */
+	struct timed_event *sched_evt; /* (module) next maintenance timer, see node_sched_run() */
+	time_t sched_at;        /* when sched_evt fires */
+	time_t next_pulse;      /* when to send the next CTRL_ACTIVE */
+	time_t next_connect;    /* when to try connecting next */
+	time_t conn_deadline;   /* (module) when connecting or handshaking times out */
+	unsigned int connect_backoff; /* seconds between failed connect attempts */
 	merlin_peer_group *pgroup; /* this node's peer-group (if a poller) */
 	struct {
 		struct merlin_assigned_objects passive; /* passive check modifiers */
@@ -241,13 +320,29 @@ struct merlin_node {
 	merlin_nodeinfo expected; /* what we expect from this node (incomplete) */
 	int last_action;        /* LA_CONNECT | LA_DISCONNECT | LA_HANDLED */
 	binlog *binlog;         /* binary backlog for this node */
+	struct node_compact *compact; /* superseded backlog entries, if compacting */
+	struct node_stamps *stamps; /* when each backlog entry was stashed */
 	merlin_node_stats stats; /* event/data statistics */
 	nm_bufferqueue *bq;     /* I/O cache for bulk reads */
 	merlin_confsync csync; /* config synchronization configuration */
 	unsigned int csync_num_attempts;
 	unsigned int csync_max_attempts;
 	time_t csync_last_attempt;
+	int csync_state;        /* CSYNC_STATE_*, see script-helpers.h */
+	struct timeval csync_start; /* when the last push started */
+	unsigned int csync_msec; /* how long the last finished push took */
+	unsigned long long csync_bytes; /* sent by the last native push */
+	int same_oconf;         /* object config (and ids) identical to ours */
 	int (*action)(struct merlin_node *, int); /* (daemon) action handler */
+	unsigned int coalesce_size; /* send events in batches of this size (0 = off) */
+	unsigned int coalesce_msec; /* ... or when the first one is this old */
+	unsigned int coalesce_len; /* bytes waiting in coalesce_pkt */
+	int coalesce_timer;     /* timerfd that fires when a batch is due */
+	merlin_event *coalesce_pkt; /* batch we're filling up */
+	merlin_event *batch;    /* received batch we're unpacking */
+	uint32_t batch_offset;  /* where the next packet in "batch" starts */
+	struct shmring *ring;   /* (module ipc) events go here instead of the socket */
+	struct csync_session *csync_session; /* (module) native config sync in progress */
 };
 
 #define node_table noc_table
@@ -263,6 +358,18 @@ extern merlin_nodeinfo *self;
 #define online_pollers self->active_pollers
 #define online_nodes (online_masters + online_pollers + online_peers)
 
+/*
+ * Lets one packet be sent to many nodes while only ever storing
+ * a single copy of it, no matter how many of them have to stash
+ * it in their backlogs. Initialize with the packet, pass it to
+ * node_fanout_send() for each node and release it when done.
+ */
+typedef struct merlin_fanout {
+	merlin_event *pkt;
+	binlog_shared *shared;
+} merlin_fanout;
+#define MERLIN_FANOUT_INIT(p) { .pkt = (p), .shared = NULL }
+
 extern node_selection *node_selection_by_name(const char *name);
 extern char *get_sel_name(int index);
 extern int get_sel_id(const char *name);
@@ -274,14 +381,22 @@ extern void node_log_event_count(merlin_node *node, int force);
 extern void node_disconnect(merlin_node *node, const char *fmt, ...);
 extern int node_send(merlin_node *node, void *data, unsigned int len, int flags);
 extern int node_send_event(merlin_node *node, merlin_event *pkt, int msec);
+extern int node_fanout_send(merlin_node *node, merlin_fanout *fo, int msec);
+extern void node_fanout_release(merlin_fanout *fo);
 extern int node_recv(merlin_node *node);
 extern merlin_event *node_get_event(merlin_node *node);
 extern int node_send_binlog(merlin_node *node, merlin_event *pkt);
+extern int node_coalesce_init(merlin_node *node);
+extern int node_coalesce_flush(merlin_node *node);
 extern const char *node_state(const merlin_node *node);
 extern const char *node_type(const merlin_node *node);
 extern void node_set_state(merlin_node *node, int state, const char *reason);
+extern const char *node_latency_name(int which);
+extern void node_latency_since(merlin_node *node, int which, const struct timeval *when);
 extern int node_ctrl(merlin_node *node, int code, uint selection, void *data, uint32_t len);
+extern void node_count_cb(merlin_node *node, merlin_event *pkt, int out);
 extern merlin_node *node_by_id(uint id);
+extern merlin_node *node_by_name(const char *name);
 int handle_ctrl_active(merlin_node *node, merlin_event *pkt);
 int dump_nodeinfo(merlin_node *n, int sd, int instance_id);
 extern int node_compat_cmp(const merlin_node *node, const merlin_event *pkt);
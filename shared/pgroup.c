@@ -13,6 +13,7 @@ static merlin_peer_group **service_id2pg;
 
 static merlin_peer_group **peer_group;
 static unsigned int num_peer_groups;
+static GHashTable *pgroup_by_hgs; /* sorted hostgroup string -> peer group */
 bitmap *poller_handled_hosts = NULL;
 bitmap *poller_handled_services = NULL;
 
@@ -197,17 +198,23 @@ static merlin_peer_group *pgroup_create(char *hostgroups)
  */
 static merlin_peer_group *pgroup_get_by_cshgs(char *hgs)
 {
-	unsigned int i;
+	merlin_peer_group *pg;
 
-	for (i = 0; i < num_peer_groups; i++) {
-		if (!peer_group[i]->hostgroups)
-			continue;
+	if (!hgs)
+		return pgroup_create(NULL);
+	if (!pgroup_by_hgs)
+		pgroup_by_hgs = g_hash_table_new(g_str_hash, g_str_equal);
 
-		if (!strcmp(peer_group[i]->hostgroups, hgs))
-			return peer_group[i];
+	pg = g_hash_table_lookup(pgroup_by_hgs, hgs);
+	if (pg) {
+		free(hgs);
+		return pg;
 	}
 
-	return pgroup_create(hgs);
+	pg = pgroup_create(hgs);
+	if (pg)
+		g_hash_table_insert(pgroup_by_hgs, pg->hostgroups, pg);
+	return pg;
 }
 
 static void pgroup_alloc_counters(merlin_peer_group *pg)
@@ -661,6 +668,10 @@ void pgroup_deinit(void)
 {
 	unsigned int i;
 
+	if (pgroup_by_hgs) {
+		g_hash_table_destroy(pgroup_by_hgs);
+		pgroup_by_hgs = NULL;
+	}
 	for (i = 0; i < num_peer_groups; i++)
 		pgroup_destroy(peer_group[i]);
 	free(peer_group);
@@ -12,7 +12,6 @@
 int debug = 0;  /* doesn't actually do anything right now */
 int is_module = 1; /* the daemon sets this to 0 immediately */
 int pulse_interval = 10; /* seconds between each CTRL_ACTIVE packet sent */
-int node_activity_check_interval = 1; /* seconds between each activity check */
 int use_database = 0;
 char *merlin_config_file = NULL;
 merlin_nodeinfo *self = NULL;
@@ -159,6 +158,37 @@ int grok_seconds(const char *p, long *result)
 }
 
 
+/*
+ * 64-bit FNV-1a of seed and len bytes of data, eaten a word at a
+ * time, with a final avalanche so similar input doesn't end up with
+ * similar hashes. Encoded packet bodies are padded to a multiple of
+ * 8 bytes, so the byte-at-a-time tail is rarely used.
+ */
+uint64_t hash64(uint64_t seed, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	h ^= seed;
+	h *= 0x100000001b3ULL;
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		h ^= w;
+		h *= 0x100000001b3ULL;
+	}
+	for (; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
 /*
  * converts an arbitrarily long string of data into its
  * hexadecimal representation
@@ -273,6 +303,9 @@ static const char *control_names[] = {
 	CTRL_ENTRY(STALL),
 	CTRL_ENTRY(RESUME),
 	CTRL_ENTRY(STOP),
+	CTRL_ENTRY(SHMRING),
+	CTRL_ENTRY(FILTER),
+	CTRL_ENTRY(CSYNC),
 };
 const char *ctrl_name(uint code)
 {
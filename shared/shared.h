@@ -50,7 +50,6 @@ static inline int min(int a, int b)
 extern const char *merlin_version;
 extern int is_module;
 extern int pulse_interval;
-extern int node_activity_check_interval;
 extern int debug;
 extern char *binlog_dir;
 extern char *merlin_config_file;
@@ -158,6 +157,7 @@ static inline int daemon_wants(int type)
 extern strvec *str_explode(char *str, int delim);
 extern int strtobool(const char *str);
 extern int grok_seconds(const char *p, long *result);
+extern uint64_t hash64(uint64_t seed, const void *data, size_t len);
 extern char *tohex(const unsigned char *data, int len);
 extern void bt_scan(const char *mark, int count);
 extern const char *human_bytes(unsigned long long n);
@@ -0,0 +1,273 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "shmring.h"
+#include "logging.h"
+
+/*
+ * Lives in the first page of the shared memory. head and tail are
+ * byte counters that never wrap, and sit on cache lines of their
+ * own so the two processes don't keep stealing them from each other.
+ */
+struct shmring_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;
+	char pad0[48];
+	uint64_t head;      /* bytes written. Only the producer changes this */
+	char pad1[56];
+	uint64_t tail;      /* bytes consumed. Only the consumer changes this */
+	uint32_t waiting;   /* consumer is about to sleep on the eventfd */
+	char pad2[52];
+};
+
+/* each record is a 32-bit length, padded so the data is 8-byte aligned */
+#define REC_HDR 8
+#define REC_SIZE(len) (((len) + REC_HDR + 7) & ~7U)
+
+static size_t page_size(void)
+{
+	static size_t pgsz;
+
+	if (!pgsz)
+		pgsz = sysconf(_SC_PAGESIZE);
+	return pgsz;
+}
+
+/* map the header page and the data area twice, back to back */
+static shmring *shmring_map(int memfd, uint32_t size)
+{
+	shmring *r;
+	char *base;
+	size_t pgsz = page_size();
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->map_len = pgsz + 2 * (size_t)size;
+	base = mmap(NULL, r->map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+
+	if (mmap(base, pgsz + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED ||
+	    mmap(base + pgsz + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, pgsz) == MAP_FAILED)
+	{
+		munmap(base, r->map_len);
+		free(r);
+		return NULL;
+	}
+
+	r->hdr = (struct shmring_header *)base;
+	r->data = base + pgsz;
+	r->size = size;
+	r->efd = -1;
+	return r;
+}
+
+/*
+ * Creates a new ring with room for at least "size" bytes. The
+ * descriptor for the shared memory is returned in *memfd, so it
+ * can be passed on to the producer. The caller closes it.
+ */
+shmring *shmring_create(uint32_t size, int *memfd)
+{
+#ifdef HAVE_MEMFD_CREATE
+	shmring *r;
+	int fd;
+
+	if (size < SHMRING_MIN_SIZE)
+		size = SHMRING_MIN_SIZE;
+	size = (size + page_size() - 1) & ~(page_size() - 1);
+
+	fd = memfd_create("merlin-ipc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		lerr("shmring: memfd_create() failed: %s", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, page_size() + size) < 0) {
+		lerr("shmring: Failed to size shared memory to %u bytes: %s", size, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	/* neither side may resize it once it's mapped */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	r = shmring_map(fd, size);
+	if (!r) {
+		lerr("shmring: Failed to map %u bytes of shared memory: %s", size, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->efd < 0) {
+		lerr("shmring: eventfd() failed: %s", strerror(errno));
+		shmring_destroy(r);
+		close(fd);
+		return NULL;
+	}
+
+	r->hdr->magic = SHMRING_MAGIC;
+	r->hdr->version = SHMRING_VERSION;
+	r->hdr->size = size;
+	*memfd = fd;
+	return r;
+#else
+	(void)size;
+	*memfd = -1;
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+/*
+ * Maps a ring created by shmring_create() in another process. The
+ * ring takes over efd, but memfd is left for the caller to close.
+ */
+shmring *shmring_attach(int memfd, int efd)
+{
+	struct shmring_header *hdr;
+	struct stat st;
+	shmring *r;
+	uint32_t size;
+
+	if (fstat(memfd, &st) < 0 || (size_t)st.st_size <= page_size()) {
+		lerr("shmring: Shared memory is missing or too small");
+		return NULL;
+	}
+
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, memfd, 0);
+	if (hdr == MAP_FAILED) {
+		lerr("shmring: Failed to map ring header: %s", strerror(errno));
+		return NULL;
+	}
+	size = hdr->size;
+	if (hdr->magic != SHMRING_MAGIC || hdr->version != SHMRING_VERSION ||
+	    (size_t)st.st_size != page_size() + size)
+	{
+		lerr("shmring: Shared memory is not a ring we know how to use");
+		munmap(hdr, sizeof(*hdr));
+		return NULL;
+	}
+	munmap(hdr, sizeof(*hdr));
+
+	r = shmring_map(memfd, size);
+	if (!r) {
+		lerr("shmring: Failed to map %u bytes of shared memory: %s", size, strerror(errno));
+		return NULL;
+	}
+	r->efd = efd;
+	return r;
+}
+
+void shmring_destroy(shmring *r)
+{
+	if (!r)
+		return;
+	if (r->efd >= 0)
+		close(r->efd);
+	munmap(r->hdr, r->map_len);
+	free(r);
+}
+
+/*
+ * Copies len bytes into the ring and wakes up the consumer if it's
+ * sleeping. Returns -1 if there's no room, in which case the caller
+ * must hold on to the data and try again later.
+ */
+int shmring_write(shmring *r, const void *data, uint32_t len)
+{
+	struct shmring_header *h = r->hdr;
+	uint64_t head = h->head, tail;
+	uint32_t need = REC_SIZE(len);
+	char *p;
+
+	tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+	if (len > r->size || need > r->size - (head - tail))
+		return -1;
+
+	p = r->data + head % r->size;
+	*(uint32_t *)p = len;
+	memcpy(p + REC_HDR, data, len);
+	__atomic_store_n(&h->head, head + need, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in shmring_prepare_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&h->waiting, 0, __ATOMIC_ACQ_REL))
+	{
+		uint64_t one = 1;
+		if (write(r->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			lerr("shmring: Failed to wake up reader: %s", strerror(errno));
+	}
+
+	return 0;
+}
+
+/*
+ * Returns a pointer to the oldest record in the ring, or NULL if
+ * there is none. The record stays in the ring, and may be modified
+ * in place, until it's released with shmring_consume().
+ */
+void *shmring_peek(shmring *r, uint32_t *len)
+{
+	struct shmring_header *h = r->hdr;
+	uint64_t tail = h->tail, head;
+	char *p;
+
+	head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return NULL;
+
+	p = r->data + tail % r->size;
+	*len = *(uint32_t *)p;
+	if (head - tail > r->size || *len > r->size || REC_SIZE(*len) > head - tail) {
+		lerr("shmring: Ring is corrupt (head=%llu, tail=%llu, len=%u). Discarding its contents",
+		     (unsigned long long)head, (unsigned long long)tail, *len);
+		__atomic_store_n(&h->tail, head, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	return p + REC_HDR;
+}
+
+void shmring_consume(shmring *r, uint32_t len)
+{
+	__atomic_store_n(&r->hdr->tail, r->hdr->tail + REC_SIZE(len), __ATOMIC_RELEASE);
+}
+
+/*
+ * Call before sleeping on r->efd. Returns 1 if there's data in the
+ * ring, in which case the consumer must not sleep. Otherwise the
+ * producer will write to the eventfd when it adds something.
+ */
+int shmring_prepare_wait(shmring *r)
+{
+	struct shmring_header *h = r->hdr;
+
+	__atomic_store_n(&h->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) != h->tail) {
+		__atomic_store_n(&h->waiting, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+/* the eventfd became readable, or we're done waiting for it */
+void shmring_woken(shmring *r)
+{
+	uint64_t count;
+
+	__atomic_store_n(&r->hdr->waiting, 0, __ATOMIC_RELAXED);
+	if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		lerr("shmring: Failed to read from eventfd: %s", strerror(errno));
+}
@@ -0,0 +1,41 @@
+#ifndef INCLUDE_shmring_h__
+#define INCLUDE_shmring_h__
+#include <stdint.h>
+
+/*
+ * Single-producer, single-consumer ring buffer in shared memory.
+ * merlind creates it and hands the memory and an eventfd to the
+ * module over the ipc socket. The module writes events into it
+ * and merlind reads them where they are, so no system calls are
+ * made in either direction while the consumer keeps up.
+ *
+ * The data area is mapped twice in a row, so a record that wraps
+ * around the end of the ring is still contiguous in memory.
+ */
+#define SHMRING_MAGIC 0x474e49524e4c524dULL /* "MRLNRING" */
+#define SHMRING_VERSION 1
+#define SHMRING_MIN_SIZE (1 << 20)
+
+struct shmring {
+	struct shmring_header *hdr;
+	char *data;
+	uint32_t size;   /* of the data area */
+	size_t map_len;  /* of the whole mapping, for munmap() */
+	int efd;         /* eventfd for waking up the consumer */
+};
+typedef struct shmring shmring;
+
+/* both */
+extern shmring *shmring_create(uint32_t size, int *memfd);
+extern shmring *shmring_attach(int memfd, int efd);
+extern void shmring_destroy(shmring *r);
+
+/* producer */
+extern int shmring_write(shmring *r, const void *data, uint32_t len);
+
+/* consumer */
+extern void *shmring_peek(shmring *r, uint32_t *len);
+extern void shmring_consume(shmring *r, uint32_t len);
+extern int shmring_prepare_wait(shmring *r);
+extern void shmring_woken(shmring *r);
+#endif
@@ -0,0 +1,150 @@
+#include "trace.h"
+#include "logging.h"
+#include "shared.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct trace_file_header *trace_map;
+static struct trace_record *trace_records;
+static size_t trace_map_size;
+static char *trace_file;
+static unsigned int trace_num_records = 65536;
+
+int trace_grok_var(const char *key, const char *value)
+{
+	if (!strcmp(key, "trace_file")) {
+		free(trace_file);
+		trace_file = strdup(value);
+		return 1;
+	}
+
+	if (!strcmp(key, "trace_records")) {
+		char *end;
+		unsigned long n = strtoul(value, &end, 10);
+
+		if (*end || n < 1024 || n > (16 << 20))
+			return 0;
+		trace_num_records = n;
+		return 1;
+	}
+
+	return 0;
+}
+
+const char *trace_stage_name(int stage)
+{
+	static const char *names[] = {
+		"unknown", "hook_send", "node_send", "binlog_add",
+		"node_get", "handle_event", "db_update",
+	};
+
+	if (stage < 0 || stage >= TRACE_NUM_STAGES)
+		return names[0];
+	return names[stage];
+}
+
+/*
+ * The encoded body of a packet is the same everywhere it goes, so
+ * a hash of it lets us match up records for one event from several
+ * processes and nodes. The header is left out since parts of it
+ * change on the way.
+ */
+uint64_t trace_key(const merlin_event *pkt)
+{
+	return hash64(pkt->hdr.type, pkt->body, pkt->hdr.len);
+}
+
+void trace_packet(int stage, const merlin_node *node, const merlin_event *pkt)
+{
+	struct trace_record *r;
+	struct timespec ts;
+	uint64_t slot;
+
+	if (!trace_map || !pkt)
+		return;
+
+	slot = __atomic_fetch_add(&trace_map->head, 1, __ATOMIC_RELAXED);
+	r = &trace_records[slot % trace_map->num_records];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->when = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->key = trace_key(pkt);
+	r->len = pkt->hdr.len;
+	r->node = node ? node->id : TRACE_NODE_NONE;
+	r->type = pkt->hdr.type;
+	r->stage = stage;
+	r->code = pkt->hdr.code;
+}
+
+/*
+ * Each process gets its own trace file, named after the trace_file
+ * setting and what kind of process it is. Reusing an existing file
+ * of the right size keeps the records from before a restart.
+ */
+int trace_init(void)
+{
+	char *path;
+	int fd;
+	struct stat st;
+	struct trace_file_header *map;
+
+	if (!trace_file || trace_map)
+		return 0;
+
+	nm_asprintf(&path, "%s.%s", trace_file, is_module ? "module" : "daemon");
+	trace_map_size = sizeof(*map) + (size_t)trace_num_records * sizeof(struct trace_record);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		lerr("Failed to open trace file '%s': %s", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || (st.st_size != (off_t)trace_map_size &&
+	    (ftruncate(fd, 0) < 0 || ftruncate(fd, trace_map_size) < 0)))
+	{
+		lerr("Failed to size trace file '%s': %s", path, strerror(errno));
+		close(fd);
+		free(path);
+		return -1;
+	}
+
+	map = mmap(NULL, trace_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		lerr("Failed to mmap() trace file '%s': %s", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+
+	if (map->magic != TRACE_MAGIC || map->record_size != sizeof(struct trace_record) ||
+	    map->num_records != trace_num_records)
+	{
+		memset(map, 0, sizeof(*map));
+		map->record_size = sizeof(struct trace_record);
+		map->num_records = trace_num_records;
+		map->magic = TRACE_MAGIC;
+	}
+	map->pid = getpid();
+	map->is_module = is_module;
+
+	trace_records = (struct trace_record *)(map + 1);
+	trace_map = map;
+	linfo("Tracing packet flow to '%s' (%u records)", path, trace_num_records);
+	free(path);
+	return 0;
+}
+
+void trace_deinit(void)
+{
+	if (!trace_map)
+		return;
+
+	munmap(trace_map, trace_map_size);
+	trace_map = NULL;
+	trace_records = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef INCLUDE_trace_h__
+#define INCLUDE_trace_h__
+#include <stdint.h>
+#include "node.h"
+
+/*
+ * Packet flow tracing. When enabled, each process writes a small
+ * fixed-size record every time a packet passes one of the stages
+ * below into a ring of records in a memory-mapped file. tools/mtrace
+ * reads those files and puts the records for each event back
+ * together again.
+ */
+enum trace_stage {
+	TRACE_HOOK_SEND = 1,    /* send_generic() in the module */
+	TRACE_NODE_SEND,        /* node_send_event() */
+	TRACE_BINLOG_ADD,       /* node_binlog_add() */
+	TRACE_NODE_GET,         /* node_get_event() */
+	TRACE_HANDLE_EVENT,     /* handle_event() in the module */
+	TRACE_DB_UPDATE,        /* mrm_db_update() in the daemon */
+	TRACE_NUM_STAGES,
+};
+
+#define TRACE_MAGIC 0x4d54524345000001ULL /* "MTRCE" + version */
+#define TRACE_NODE_NONE 0xffff
+
+struct trace_file_header {
+	uint64_t magic;
+	uint32_t record_size;
+	uint32_t num_records;
+	uint64_t head;          /* total number of records written */
+	uint32_t pid;
+	uint32_t is_module;
+	char pad[32];
+};
+
+struct trace_record {
+	uint64_t when;          /* CLOCK_REALTIME, in nanoseconds */
+	uint64_t key;           /* identifies the event across nodes */
+	uint32_t len;           /* packet body length */
+	uint16_t node;          /* node id, or TRACE_NODE_NONE */
+	uint16_t type;          /* packet type */
+	uint16_t stage;         /* enum trace_stage */
+	uint16_t code;
+	uint32_t pad;
+};
+
+extern struct trace_file_header *trace_map;
+extern int trace_init(void);
+extern void trace_deinit(void);
+extern int trace_grok_var(const char *key, const char *value);
+extern void trace_packet(int stage, const merlin_node *node, const merlin_event *pkt);
+extern uint64_t trace_key(const merlin_event *pkt);
+extern const char *trace_stage_name(int stage);
+
+/* tracing costs a single branch when it's turned off */
+#define trace_event(stage, node, pkt) \
+	(trace_map ? trace_packet(stage, node, pkt) : (void)0)
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Reads a generated merlin.conf with lots of node compounds, first
+ * with cfg_parse_file() and then with the cfg_iter API, and reports
+ * how many times per second each of them gets through it. The
+ * iterator gets to count the compounds first, the way a caller
+ * sizing its node table would.
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-cfgfile [num_nodes] [num_rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cfgfile.h"
+#include "bench-common.h"
+
+static char *write_config(unsigned int num)
+{
+	static char path[] = "/tmp/bench-cfgfile.XXXXXX";
+	unsigned int i;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror("Failed to create config file");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(fp, "log_level = info;\nuse_syslog = 1;\n\n");
+	fprintf(fp, "module {\n\tlog_file = /var/log/merlin/neb.log;\n}\n\n");
+	fprintf(fp, "daemon {\n\tport = 15551;\n\tdatabase {\n\t\tenabled = yes;\n\t}\n}\n\n");
+	for (i = 0; i < num; i++) {
+		fprintf(fp, "# poller number %u\n", i);
+		fprintf(fp, "poller poller-%u {\n", i);
+		fprintf(fp, "\taddress = 10.%u.%u.%u\n", i >> 16 & 0xff, i >> 8 & 0xff, i & 0xff);
+		fprintf(fp, "\tport = 15551\n");
+		fprintf(fp, "\thostgroups = hg-%u, hg-%u-extra\n", i / 2, i);
+		fprintf(fp, "\tconnect = no\n");
+		fprintf(fp, "\tnotifies = yes\n");
+		fprintf(fp, "\tobject_config {\n\t\tpush = mon oconf push poller-%u\n\t}\n", i);
+		fprintf(fp, "}\n\n");
+	}
+	fclose(fp);
+
+	return path;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, num, rounds;
+	unsigned long tree_vars = 0, iter_vars = 0, iter_nodes = 0;
+	struct timespec start;
+	double t_tree, t_iter;
+	char *path;
+
+	num = bench_arg(argc, argv, 1, 1000);
+	rounds = bench_arg(argc, argv, 2, 200);
+
+	path = write_config(num);
+
+	bench_start(&start);
+	for (i = 0; i < rounds; i++) {
+		struct cfg_comp *config = cfg_parse_file(path);
+		unsigned int n, x;
+
+		if (!config) {
+			fprintf(stderr, "Failed to parse generated config\n");
+			return EXIT_FAILURE;
+		}
+		tree_vars += config->vars;
+		for (n = 0; n < config->nested; n++) {
+			struct cfg_comp *c = config->nest[n];
+
+			tree_vars += c->vars;
+			for (x = 0; x < c->nested; x++)
+				tree_vars += c->nest[x]->vars;
+		}
+		cfg_destroy_compound(config);
+	}
+	t_tree = bench_elapsed(&start);
+
+	bench_start(&start);
+	for (i = 0; i < rounds; i++) {
+		struct cfg_iter it;
+		struct cfg_span *addresses;
+		unsigned int compounds, vars, nodes = 0;
+		int type;
+
+		if (cfg_iter_open(&it, path) < 0)
+			return EXIT_FAILURE;
+		cfg_iter_count(&it, &compounds, &vars);
+		addresses = calloc(compounds, sizeof(*addresses));
+		while ((type = cfg_iter_next(&it)) != CFG_EOF) {
+			if (type == CFG_START && it.depth == 1 && !strncmp(it.key.str, "poller", 6))
+				nodes++;
+			else if (type == CFG_VAR) {
+				iter_vars++;
+				if (nodes && cfg_span_is(&it.key, "address"))
+					addresses[nodes - 1] = it.value;
+			}
+		}
+		iter_nodes += nodes;
+		free(addresses);
+		cfg_iter_close(&it);
+	}
+	t_iter = bench_elapsed(&start);
+
+	unlink(path);
+
+	printf("%u nodes, %lu/%lu variables read, %lu nodes found\n",
+	       num, tree_vars, iter_vars, iter_nodes);
+	bench_rate("cfg_parse_file()", rounds, "files", t_tree);
+	bench_rate("cfg_iter", rounds, "files", t_iter);
+
+	return tree_vars == iter_vars && iter_nodes == (unsigned long)num * rounds ? EXIT_SUCCESS : EXIT_FAILURE;
+}
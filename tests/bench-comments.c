@@ -0,0 +1,109 @@
+/*
+ * Compares finding the local comments for a burst of comment
+ * deletions received from the network by walking the comment list,
+ * which is what handle_comment_data() used to do, with looking them
+ * up in the comment index.
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-comments [num_comments] [num_deletions]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "comment-index.h"
+#include "bench-common.h"
+
+static comment **cmnt_ary;
+
+/* the same checks module.c's matching_comment() does */
+static int matches(comment *cmnt, nebstruct_comment_data *ds)
+{
+	return cmnt->comment_type == ds->comment_type &&
+		cmnt->entry_type == ds->entry_type &&
+		cmnt->entry_time == ds->entry_time &&
+		!strcmp(cmnt->author, ds->author_name) &&
+		!strcmp(cmnt->comment_data, ds->comment_data) &&
+		!strcmp(cmnt->host_name, ds->host_name) &&
+		(cmnt->service_description == ds->service_description ||
+		 !strcmp(cmnt->service_description, ds->service_description));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, num_comments, num_deletions;
+	unsigned int found_list = 0, found_index = 0;
+	nebstruct_comment_data *ds;
+	struct timespec start;
+	double t_list, t_index;
+
+	num_comments = bench_arg(argc, argv, 1, 100000);
+	num_deletions = bench_arg(argc, argv, 2, 10000);
+	if (num_deletions > num_comments)
+		num_deletions = num_comments;
+
+	/* every comment is an acknowledgement from the same GUI user */
+	cmnt_ary = calloc(num_comments, sizeof(comment *));
+	for (i = 0; i < num_comments; i++) {
+		comment *cmnt = calloc(1, sizeof(*cmnt));
+		char buf[64];
+
+		cmnt->comment_id = i;
+		cmnt->comment_type = SERVICE_COMMENT;
+		cmnt->entry_type = ACKNOWLEDGEMENT_COMMENT;
+		cmnt->entry_time = 1500000000 + (i % 60);
+		sprintf(buf, "host-%u", i / 20);
+		cmnt->host_name = strdup(buf);
+		sprintf(buf, "service-%u", i % 20);
+		cmnt->service_description = strdup(buf);
+		cmnt->author = "admin";
+		cmnt->comment_data = "Known problem, working on it";
+		cmnt->next = comment_list;
+		comment_list = cmnt;
+		cmnt_ary[i] = cmnt;
+	}
+	comment_index_init(NULL);
+
+	/* delete them in a scattered order, like a bulk cleanup would */
+	ds = calloc(num_deletions, sizeof(*ds));
+	for (i = 0; i < num_deletions; i++) {
+		comment *cmnt = cmnt_ary[(i * 7919) % num_comments];
+
+		ds[i].type = NEBTYPE_COMMENT_DELETE;
+		ds[i].comment_type = cmnt->comment_type;
+		ds[i].entry_type = cmnt->entry_type;
+		ds[i].entry_time = cmnt->entry_time;
+		ds[i].host_name = cmnt->host_name;
+		ds[i].service_description = cmnt->service_description;
+		ds[i].author_name = cmnt->author;
+		ds[i].comment_data = cmnt->comment_data;
+		ds[i].comment_id = cmnt->comment_id;
+	}
+
+	bench_start(&start);
+	for (i = 0; i < num_deletions; i++) {
+		comment *cmnt;
+		for (cmnt = comment_list; cmnt; cmnt = cmnt->next)
+			found_list += matches(cmnt, &ds[i]);
+	}
+	t_list = bench_elapsed(&start);
+
+	bench_start(&start);
+	for (i = 0; i < num_deletions; i++) {
+		struct comment_ref *ref, *next;
+		for (ref = comment_index_lookup(&ds[i]); ref; ref = next) {
+			next = ref->next;
+			if (matches(cmnt_ary[ref->comment_id], &ds[i])) {
+				found_index++;
+				comment_index_remove(&ds[i]);
+			}
+		}
+	}
+	t_index = bench_elapsed(&start);
+
+	printf("%u comments, %u deletions, %u/%u found\n",
+	       num_comments, num_deletions, found_list, found_index);
+	bench_time("comment list", t_list);
+	bench_time("comment index", t_index);
+
+	comment_index_deinit();
+	return found_list == num_deletions && found_index == num_deletions ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <naemon/naemon.h>
+#include "bench-common.h"
+
+struct object_count num_objects = {0,};
+comment *comment_list = NULL;
+hostgroup *hostgroup_list = NULL;
+servicegroup *servicegroup_list = NULL;
+struct timeperiod **timeperiod_ary;
+struct host **host_ary;
+char *config_file_dir = NULL;
+char *config_file = NULL;
+char *temp_path = NULL;
+iobroker_set *nagios_iobs = NULL;
+int __nagios_object_structure_version = CURRENT_OBJECT_STRUCTURE_VERSION;
+unsigned long   event_broker_options = BROKER_NOTHING;
+volatile sig_atomic_t sigshutdown = FALSE;
+int interval_length = 60;
+time_t event_start = 0L;
+int service_check_timeout = 0;
+int host_check_timeout = 0;
+command *ocsp_command_ptr = NULL;
+command *ochp_command_ptr = NULL;
+command *global_host_event_handler_ptr = NULL;
+command *global_service_event_handler_ptr = NULL;
+char    *host_perfdata_command = NULL;
+char    *service_perfdata_command = NULL;
+char    *host_perfdata_file_processing_command = NULL;
+char    *service_perfdata_file_processing_command = NULL;
+
+unsigned int bench_arg(int argc, char **argv, int n, unsigned int def)
+{
+	if (argc > n)
+		return strtoul(argv[n], NULL, 0);
+	return def;
+}
+
+void bench_start(struct timespec *start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+double bench_elapsed(struct timespec *start)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec) + (stop.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+void bench_rate(const char *label, unsigned long count, const char *unit, double secs)
+{
+	printf("%s:%*s%.0f %s/sec\n", label, (int)(18 - strlen(label)), "", count / secs, unit);
+}
+
+void bench_time(const char *label, double secs)
+{
+	printf("%s:%*s%.3f seconds\n", label, (int)(18 - strlen(label)), "", secs);
+}
@@ -0,0 +1,24 @@
+#ifndef INCLUDE_bench_common_h__
+#define INCLUDE_bench_common_h__
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmarks. bench-common.c also has the
+ * globals naemon's object code expects its host program to define.
+ */
+
+/* argv[n] as a number, or def if the benchmark was run without it */
+extern unsigned int bench_arg(int argc, char **argv, int n, unsigned int def);
+
+/* reads CLOCK_MONOTONIC into start */
+extern void bench_start(struct timespec *start);
+
+/* seconds since bench_start() */
+extern double bench_elapsed(struct timespec *start);
+
+/* prints a timed run as "label: <count / secs> <unit>/sec" */
+extern void bench_rate(const char *label, unsigned long count, const char *unit, double secs);
+
+/* prints a timed run as "label: <secs> seconds" */
+extern void bench_time(const char *label, double secs);
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Compares looking up received services by name with looking them
+ * up by object id, the way handle_service_result() does for nodes
+ * that share our object config.
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-idlookup [num_hosts] [services_per_host]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <naemon/naemon.h>
+#include "bench-common.h"
+
+int main(int argc, char **argv)
+{
+	unsigned int i, h, num_hosts, per_host, num_services;
+	unsigned int found = 0, *ids;
+	char **host_names, **descs;
+	struct timespec start;
+	double t_name, t_id;
+
+	num_hosts = bench_arg(argc, argv, 1, 10000);
+	per_host = bench_arg(argc, argv, 2, 20);
+	num_services = num_hosts * per_host;
+
+	init_objects_host(num_hosts);
+	init_objects_service(num_services);
+	host_names = calloc(num_services, sizeof(char *));
+	descs = calloc(num_services, sizeof(char *));
+	ids = calloc(num_services, sizeof(unsigned int));
+	for (h = 0; h < num_hosts; h++) {
+		host *hst;
+		char name[64];
+
+		sprintf(name, "host-%u", h);
+		hst = create_host(name);
+		register_host(hst);
+		for (i = 0; i < per_host; i++) {
+			service *svc;
+			sprintf(name, "service-%u", i);
+			svc = create_service(hst, name);
+			register_service(svc);
+			host_names[svc->id] = svc->host_name;
+			descs[svc->id] = svc->description;
+		}
+	}
+
+	/* look them up in a scattered order, like the network would */
+	for (i = 0; i < num_services; i++)
+		ids[i] = (i * 7919) % num_services;
+
+	bench_start(&start);
+	for (i = 0; i < num_services; i++) {
+		unsigned int id = ids[i];
+		found += !!find_service(host_names[id], descs[id]);
+	}
+	t_name = bench_elapsed(&start);
+
+	bench_start(&start);
+	for (i = 0; i < num_services; i++) {
+		unsigned int id = ids[i];
+		service *s = service_ary[id];
+		found += s && !strcmp(s->description, descs[id]) && !strcmp(s->host_name, host_names[id]);
+	}
+	t_id = bench_elapsed(&start);
+
+	printf("%u services, %u found\n", num_services, found);
+	bench_rate("by name", num_services, "lookups", t_name);
+	bench_rate("by id", num_services, "lookups", t_id);
+
+	destroy_objects_service();
+	destroy_objects_host();
+	free(host_names);
+	free(descs);
+	free(ids);
+	return found == num_services * 2 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
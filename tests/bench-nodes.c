@@ -0,0 +1,113 @@
+/*
+ * Configures a master with lots of pollers through node_grok_config()
+ * and measures how long that takes, and how long it takes to find
+ * the pollers that should get an event about a hostgroup, by name,
+ * the way get_hostgroup_selection() does. The hash table lookup is
+ * compared with searching the selections one by one.
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-nodes [num_pollers] [num_events]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shared.h"
+#include "node.h"
+#include "cfgfile.h"
+#include "bench-common.h"
+
+/* two pollers per hostgroup, and a peer */
+static char *write_config(unsigned int npollers)
+{
+	static char path[] = "/tmp/bench-nodes.XXXXXX";
+	unsigned int i;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror("Failed to create config file");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(fp, "peer the-peer {\n\taddress = 127.0.0.1\n\tport = 15551\n}\n");
+	for (i = 0; i < npollers; i++) {
+		fprintf(fp, "poller poller-%u {\n\taddress = 127.0.0.1\n\tport = %u\n\thostgroups = hg-%u\n}\n",
+		        i, 16000 + i, i / 2);
+	}
+	fclose(fp);
+
+	return path;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, npollers, num_events, num_sel;
+	unsigned long found_hash = 0, found_scan = 0;
+	merlin_nodeinfo info;
+	struct cfg_comp *config;
+	struct timespec start;
+	double t_grok, t_hash, t_scan;
+	char *path, **names;
+
+	npollers = bench_arg(argc, argv, 1, 500);
+	num_events = bench_arg(argc, argv, 2, 10000000);
+	if (npollers < 2)
+		npollers = 2;
+
+	memset(&info, 0, sizeof(info));
+	self = &info;
+
+	path = write_config(npollers);
+	config = cfg_parse_file(path);
+	unlink(path);
+	if (!config) {
+		fprintf(stderr, "Failed to parse generated config\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_start(&start);
+	node_grok_config(config);
+	t_grok = bench_elapsed(&start);
+
+	num_sel = get_num_selections();
+	names = calloc(num_sel, sizeof(char *));
+	for (i = 0; i < num_sel; i++)
+		names[i] = strdup(get_sel_name(i));
+
+	bench_start(&start);
+	for (i = 0; i < num_events; i++) {
+		node_selection *sel = node_selection_by_name(names[(i * 7919) % num_sel]);
+		linked_item *li;
+
+		for (li = nodes_by_sel_id(sel->id); li; li = li->next_item)
+			found_hash++;
+	}
+	t_hash = bench_elapsed(&start);
+
+	bench_start(&start);
+	for (i = 0; i < num_events; i++) {
+		const char *name = names[(i * 7919) % num_sel];
+		linked_item *li;
+		unsigned int x;
+
+		for (x = 0; x < num_sel; x++) {
+			if (!strcmp(name, get_sel_name(x)))
+				break;
+		}
+		for (li = nodes_by_sel_id(x); li; li = li->next_item)
+			found_scan++;
+	}
+	t_scan = bench_elapsed(&start);
+
+	printf("%u nodes, %u selections, configured in %.3f ms\n",
+	       num_nodes, num_sel, t_grok * 1000);
+	printf("%u events, %lu/%lu nodes found\n", num_events, found_hash, found_scan);
+	bench_rate("linear search", num_events, "events", t_scan);
+	bench_rate("hash table", num_events, "events", t_hash);
+
+	for (i = 0; i < num_sel; i++)
+		free(names[i]);
+	free(names);
+	cfg_destroy_compound(config);
+	return found_hash == found_scan ? EXIT_SUCCESS : EXIT_FAILURE;
+}
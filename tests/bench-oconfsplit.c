@@ -0,0 +1,95 @@
+/*
+ * Times split_config() on a synthetic config with one hostgroup
+ * per poller, first serially and then with one worker process
+ * per CPU, as with oconfsplit_workers = 0.
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-oconfsplit [num_pollers] [hosts_per_poller] [services_per_host]
+ */
+#include "oconfsplit.c"
+#include <stdlib.h>
+#include "bench-common.h"
+
+merlin_node ipc = { .name = "ipc" };
+merlin_node **noc_table, **peer_table, **poller_table;
+
+static double time_split(long workers)
+{
+	struct timespec start;
+
+	split_workers = workers;
+	bench_start(&start);
+	split_config();
+	return bench_elapsed(&start);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int p, h, s, num_pollers, per_poller, per_host;
+	char tmpl[] = "/tmp/bench-oconfsplit.XXXXXX";
+	merlin_nodeinfo info;
+	double serial, parallel;
+
+	num_pollers = bench_arg(argc, argv, 1, 80);
+	per_poller = bench_arg(argc, argv, 2, 250);
+	per_host = bench_arg(argc, argv, 3, 5);
+
+	if (!mkdtemp(tmpl)) {
+		printf("Failed to create output directory: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	nm_asprintf(&poller_config_dir, "%s/", tmpl);
+
+	memset(&info, 0, sizeof(info));
+	info.configured_pollers = num_pollers;
+	self = &info;
+	ipc.info.last_cfg_change = time(NULL);
+
+	init_objects_host(num_pollers * per_poller);
+	init_objects_service(num_pollers * per_poller * per_host);
+	init_objects_hostgroup(num_pollers);
+	poller_table = noc_table = calloc(num_pollers, sizeof(merlin_node *));
+	for (p = 0; p < num_pollers; p++) {
+		merlin_node *node = calloc(1, sizeof(*node));
+		hostgroup *hg;
+		char name[64];
+
+		sprintf(name, "poller-%u", p);
+		node->name = strdup(name);
+		sprintf(name, "hg-%u", p);
+		node->hostgroups = strdup(name);
+		node->type = MODE_POLLER;
+		poller_table[p] = node;
+
+		hg = create_hostgroup(name, NULL, NULL, NULL, NULL);
+		register_hostgroup(hg);
+		for (h = 0; h < per_poller; h++) {
+			host *hst;
+
+			sprintf(name, "host-%u-%u", p, h);
+			hst = create_host(name);
+			register_host(hst);
+			add_host_to_hostgroup(hg, hst);
+			for (s = 0; s < per_host; s++) {
+				sprintf(name, "service-%u", s);
+				register_service(create_service(hst, name));
+			}
+		}
+	}
+
+	serial = time_split(1);
+	parallel = time_split(0);
+	printf("%u pollers, %u hosts, %u services, %ld workers\n", num_pollers,
+	       num_pollers * per_poller, num_pollers * per_poller * per_host,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	bench_time("serial", serial);
+	bench_time("parallel", parallel);
+
+	for (p = 0; p < num_pollers; p++) {
+		char *path;
+		nm_asprintf(&path, "%s%s.cfg", poller_config_dir, poller_table[p]->name);
+		unlink(path);
+		free(path);
+	}
+	rmdir(tmpl);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/*
+ * Compares finding the pollers that should get an event about a
+ * host the way send_generic() used to, by looking the host name up
+ * in a hash table and walking the selection's node list, with the
+ * routing table built by routing_init().
+ * This is not run by "make check". Run it by hand:
+ *   ./bench-routing [num_hosts] [num_pollers] [num_events]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "routing.h"
+#include "bench-common.h"
+
+/* two pollers per selection, one selection per hostgroup */
+static node_selection *sel_table;
+static int num_sel;
+
+int get_num_selections(void)
+{
+	return num_sel;
+}
+
+linked_item *nodes_by_sel_id(int sel)
+{
+	return sel >= 0 && sel < num_sel ? sel_table[sel].nodes : NULL;
+}
+
+node_selection *node_selection_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_sel; i++) {
+		if (!strcmp(sel_table[i].name, name))
+			return &sel_table[i];
+	}
+	return NULL;
+}
+
+char *get_sel_name(int i)
+{
+	return sel_table[i].name;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, h, num_hosts, npollers, num_events;
+	unsigned long sent_hash = 0, sent_table = 0;
+	GHashTable *by_name;
+	merlin_nodeinfo info;
+	struct timespec start;
+	double t_hash, t_table;
+
+	num_hosts = bench_arg(argc, argv, 1, 100000);
+	npollers = bench_arg(argc, argv, 2, 200);
+	num_events = bench_arg(argc, argv, 3, 10000000);
+	if (npollers < 2)
+		npollers = 2;
+
+	memset(&info, 0, sizeof(info));
+	info.configured_pollers = npollers;
+	self = &info;
+
+	num_sel = npollers / 2;
+	sel_table = calloc(num_sel, sizeof(*sel_table));
+	init_objects_host(num_hosts);
+	init_objects_hostgroup(num_sel);
+	for (i = 0; i < (unsigned int)num_sel; i++) {
+		linked_item *li;
+		char name[64];
+
+		sprintf(name, "hg-%u", i);
+		sel_table[i].id = i;
+		sel_table[i].name = strdup(name);
+		register_hostgroup(create_hostgroup(name, NULL, NULL, NULL, NULL));
+		for (h = 0; h < 2; h++) {
+			li = calloc(1, sizeof(*li));
+			li->item = calloc(1, sizeof(merlin_node));
+			li->next_item = sel_table[i].nodes;
+			sel_table[i].nodes = li;
+		}
+	}
+
+	by_name = g_hash_table_new(g_str_hash, g_str_equal);
+	for (h = 0; h < num_hosts; h++) {
+		host *hst;
+		char name[64];
+
+		sprintf(name, "host-%u", h);
+		hst = create_host(name);
+		register_host(hst);
+		add_host_to_hostgroup(find_hostgroup(sel_table[h % num_sel].name), hst);
+		g_hash_table_insert(by_name, hst->name, &sel_table[h % num_sel]);
+	}
+	routing_init();
+
+	bench_start(&start);
+	for (i = 0; i < num_events; i++) {
+		host *hst = host_ary[(i * 7919) % num_hosts];
+		node_selection *sel = g_hash_table_lookup(by_name, hst->name);
+		linked_item *li;
+
+		for (li = nodes_by_sel_id(sel->id); li; li = li->next_item)
+			sent_hash += !!li->item;
+	}
+	t_hash = bench_elapsed(&start);
+
+	bench_start(&start);
+	for (i = 0; i < num_events; i++) {
+		host *hst = host_ary[(i * 7919) % num_hosts];
+		const struct routing_dest *dest = routing_dest(routing_host_selection(hst)->id);
+		unsigned int n;
+
+		for (n = 0; n < dest->num_nodes; n++)
+			sent_table += !!dest->nodes[n];
+	}
+	t_table = bench_elapsed(&start);
+
+	printf("%u hosts, %u pollers, %u events, %lu/%lu sent\n",
+	       num_hosts, npollers, num_events, sent_hash, sent_table);
+	bench_rate("hash table", num_events, "events", t_hash);
+	bench_rate("routing table", num_events, "events", t_table);
+
+	routing_deinit();
+	g_hash_table_destroy(by_name);
+	destroy_objects_host();
+	return sent_hash == sent_table ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -716,6 +716,41 @@ static void test_binlog_leakage(void)
 	binlog_destroy(bl, BINLOG_UNLINK);
 }
 
+/*
+ * Shared entries must come back intact from every binlog they're
+ * added to, whether they're read from memory or from disk.
+ */
+static void test_binlog_shared(void)
+{
+	struct binlog *mem, *disk;
+	binlog_shared *sh;
+	char *p;
+	uint len, msg_len;
+	int ok = 0;
+
+	mem = binlog_create(NULL, 1 << 20, 0, BINLOG_UNLINK);
+	disk = binlog_create("/tmp/shared-binlog", 1, 1 << 20, BINLOG_UNLINK);
+	msg_len = strlen(msg_list[0]) + 1;
+	sh = binlog_shared_create(msg_list[0], msg_len);
+
+	if (binlog_add_shared(mem, sh) < 0 || binlog_add_shared(disk, sh) < 0)
+		t_fail("binlog_add_shared() failed");
+	binlog_shared_release(sh);
+
+	if (!binlog_read(mem, (void **)&p, &len)) {
+		ok += len == msg_len && !strcmp(p, msg_list[0]);
+		free(p);
+	}
+	if (!binlog_read(disk, (void **)&p, &len)) {
+		ok += len == msg_len && !strcmp(p, msg_list[0]);
+		free(p);
+	}
+	ok_int(ok, 2, "Shared entries are readable from all binlogs");
+
+	binlog_destroy(mem, BINLOG_UNLINK);
+	binlog_destroy(disk, BINLOG_UNLINK);
+}
+
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
 {
 	uint i;
@@ -757,5 +792,6 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
 	}
 
 	test_binlog_leakage();
+	test_binlog_shared();
 	return t_end();
 }
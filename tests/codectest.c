@@ -5,7 +5,7 @@
 void general_setup(void)
 {
 	merlin_log_file = "stdout";
-	log_levels = -1;
+	merlin_log_levels = -1;
 	log_init();
 }
 
@@ -29,7 +29,7 @@ START_TEST(test_encode_serviceevent)
 	ds.state.notified_on = 456;
 	ds.host_name = "foo";
 	ds.state.perf_data = "bar";
-	ret = merlin_encode_event(&pkt, (void *)&ds);
+	ret = merlin_encode_event(NULL, &pkt, (void *)&ds);
 	ck_assert(ret > 0);
 	pkt.hdr.len = ret;
 	ret = merlin_decode_event(NULL, &pkt);
@@ -61,7 +61,7 @@ START_TEST(test_encode_too_long)
 	ds.state.perf_data = "This should be truncated away";
 	ds.state.plugin_output = "This should be truncated away";
 	ds.state.long_plugin_output = "This should be truncated away";
-	ret = merlin_encode_event(&pkt, (void *)&ds);
+	ret = merlin_encode_event(NULL, &pkt, (void *)&ds);
 	ck_assert(ret > 0);
 	pkt.hdr.len = ret;
 	ret = merlin_decode_event(NULL, &pkt);
@@ -0,0 +1,206 @@
+#include "test_utils.h"
+#include "cfgfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *config =
+	"# a comment\n"
+	"log_level = info;\n"
+	"  escaped = foo\\;\n"
+	"key_only\n"
+	"key_only_semi;\n"
+	"equals = a=b = c\n"
+	"spaced\t=\t  value with spaces  \n"
+	"\n"
+	"module {\n"
+	"\tlog_file = /var/log/merlin/neb.log;\n"
+	"\tnested thing {\n"
+	"\t\tpush = mon oconf push foo\n"
+	"\t}\n"
+	"}\n"
+	"poller poller-1{\n"
+	"\taddress=10.0.0.1\n"
+	"\t# commented = out\n"
+	"}\n"
+	"last = no newline";
+
+/*
+ * The tree, flattened into the kind of items cfg_iter_next() returns,
+ * so what cfg_parse_file() builds can be checked against the iterator
+ */
+struct item {
+	int type;
+	unsigned line;
+	char *key, *value;
+};
+
+static struct item items[64];
+static unsigned num_items;
+
+static void add_item(int type, unsigned line, const char *key, size_t key_len,
+                     const char *value, size_t value_len)
+{
+	struct item *i = &items[num_items++];
+
+	i->type = type;
+	i->line = line;
+	i->key = key ? strndup(key, key_len) : NULL;
+	i->value = value ? strndup(value, value_len) : NULL;
+}
+
+static void flatten(struct cfg_comp *comp)
+{
+	unsigned v, c;
+
+	for (v = 0; v < comp->vars; v++) {
+		struct cfg_var *var = comp->vlist[v];
+		add_item(CFG_VAR, var->line, var->key, strlen(var->key),
+		         var->value, var->value ? strlen(var->value) : 0);
+	}
+	for (c = 0; c < comp->nested; c++) {
+		struct cfg_comp *n = comp->nest[c];
+		add_item(CFG_START, n->start, n->name, strlen(n->name), NULL, 0);
+		flatten(n);
+		add_item(CFG_END, 0, NULL, 0, NULL, 0);
+	}
+}
+
+static void free_items(void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_items; i++) {
+		free(items[i].key);
+		free(items[i].value);
+	}
+	num_items = 0;
+}
+
+static struct item *find_var(const char *key)
+{
+	unsigned i;
+
+	for (i = 0; i < num_items; i++) {
+		if (items[i].type == CFG_VAR && !strcmp(items[i].key, key))
+			return &items[i];
+	}
+	return NULL;
+}
+
+static void test_tree(const char *path)
+{
+	struct cfg_comp *conf;
+	struct item *i;
+
+	conf = cfg_parse_file(path);
+	ok_int(!!conf, 1, "cfg_parse_file() parses the config");
+	if (!conf)
+		return;
+
+	ok_uint(conf->vars, 7, "top-level variables");
+	ok_uint(conf->nested, 2, "top-level compounds");
+	ok_uint(conf->vlist_len, conf->vars, "vlist is sized from the first pass");
+	ok_str(conf->nest[0]->name, "module", "compound name");
+	ok_str(conf->nest[1]->name, "poller poller-1", "compound name without space before '{'");
+	ok_str(conf->nest[0]->nest[0]->name, "nested thing", "nested compound name");
+	ok_uint(conf->nest[0]->nest[0]->start, 11, "nested compound starting line");
+
+	flatten(conf);
+	cfg_destroy_compound(conf);
+
+	i = find_var("escaped");
+	ok_str(i ? i->value : NULL, "foo\\;", "escaped ';' is kept in the value");
+	i = find_var("key_only");
+	ok_int(i && !i->value, 1, "key-only variable has no value");
+	i = find_var("key_only_semi");
+	ok_int(i && !i->value, 1, "key-only variable with ';' has no value");
+	i = find_var("equals");
+	ok_str(i ? i->value : NULL, "a=b = c", "'=' inside the value is kept");
+	i = find_var("spaced");
+	ok_str(i ? i->value : NULL, "value with spaces", "value is trimmed");
+	ok_uint(i ? i->line : 0, 7, "variable line number");
+	i = find_var("address");
+	ok_str(i ? i->value : NULL, "10.0.0.1", "value without spaces around '='");
+	ok_int(find_var("commented") == NULL, 1, "comments are skipped");
+	i = find_var("last");
+	ok_str(i ? i->value : NULL, "no newline", "last line without newline");
+}
+
+static void test_iter_equivalence(const char *path)
+{
+	struct cfg_iter it;
+	unsigned compounds, vars, depth = 0;
+	int type;
+
+	if (cfg_iter_open(&it, path) < 0) {
+		t_fail("cfg_iter_open() opens the config");
+		return;
+	}
+
+	cfg_iter_count(&it, &compounds, &vars);
+	ok_uint(compounds, 3, "cfg_iter_count() counts compounds");
+	ok_uint(vars, 10, "cfg_iter_count() counts variables");
+
+	/*
+	 * the tree lists a compound's variables before its nested
+	 * compounds, so match the variables by line instead of order
+	 */
+	while ((type = cfg_iter_next(&it)) != CFG_EOF) {
+		struct item *i = NULL;
+		unsigned n;
+
+		if (type == CFG_START)
+			depth++;
+		else if (type == CFG_END)
+			depth--;
+		if (type != CFG_VAR)
+			continue;
+
+		for (n = 0; n < num_items; n++) {
+			if (items[n].type == CFG_VAR && items[n].line == it.line) {
+				i = &items[n];
+				break;
+			}
+		}
+		if (!i) {
+			t_fail("line %u: variable missing from the tree", it.line);
+			continue;
+		}
+		if (!cfg_span_is(&it.key, i->key))
+			t_fail("line %u: key '%.*s' != '%s'", it.line, (int)it.key.len, it.key.str, i->key);
+		else if (!i->value != !it.value.str)
+			t_fail("line %u: '%s' has a value in only one of them", it.line, i->key);
+		else if (i->value && !cfg_span_is(&it.value, i->value))
+			t_fail("line %u: value '%.*s' != '%s'", it.line, (int)it.value.len, it.value.str, i->value);
+		else
+			t_pass("line %u: '%s' matches the tree", it.line, i->key);
+	}
+	ok_uint(depth, 0, "all compounds are closed");
+	cfg_iter_close(&it);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char *argv[])
+{
+	char path[] = "/tmp/test-cfgfile.XXXXXX";
+	int fd;
+
+	t_set_colors(0);
+	t_verbose = 1;
+
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, config, strlen(config)) != (ssize_t)strlen(config)) {
+		perror("Failed to write test config");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	t_start("testing config file parsing");
+	test_tree(path);
+	test_iter_equivalence(path);
+	free_items();
+	unlink(path);
+
+	return t_end();
+}
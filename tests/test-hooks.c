@@ -38,7 +38,14 @@ struct comment *get_first_comment_by_host(__attribute__((unused)) char *host) {
 int delete_comment(__attribute__((unused)) int type, __attribute__((unused)) unsigned long comment_id) { return 0; }
 int delete_downtime_by_hostname_service_description_start_time_comment(__attribute__((unused)) char *hostname, __attribute__((unused)) char *service_description, __attribute__((unused)) time_t start_time, __attribute__((unused)) char *cmnt) { return 0; }
 int init_check_result(__attribute__((unused)) check_result *cr) { return 0; }
-int process_external_command2(__attribute__((unused)) int cmd, __attribute__((unused)) time_t entry_time, __attribute__((unused)) char *args) { return 0; }
+static int commands_run;
+static char last_command_args[256];
+int process_external_command2(__attribute__((unused)) int cmd, __attribute__((unused)) time_t entry_time, char *args)
+{
+	commands_run++;
+	snprintf(last_command_args, sizeof(last_command_args), "%s", args);
+	return 0;
+}
 int add_new_comment(__attribute__((unused)) int type, __attribute__((unused)) int entry_type, __attribute__((unused)) char *host_name, __attribute__((unused)) char *svc_description, __attribute__((unused)) time_t entry_time, __attribute__((unused)) char *author_name, __attribute__((unused)) char *comment_data, __attribute__((unused)) int persistent, __attribute__((unused)) int source, __attribute__((unused)) int expires, __attribute__((unused)) time_t expire_time, __attribute__((unused)) unsigned long *comment_id) { return 0; }
 
 void *last_event;
@@ -75,6 +82,11 @@ int ipc_send_event(merlin_event *pkt) {
 	return 0;
 }
 int ipc_grok_var(__attribute__((unused)) char *var, __attribute__((unused)) char *val) {return 1;}
+int ipc_recv(void) { return 0; }
+int ipc_ring_attach(void) { return 0; }
+void ipc_filter_reset(void) {}
+int ipc_filter_set(__attribute__((unused)) const merlin_event *pkt) { return 0; }
+int ipc_wants(int type, __attribute__((unused)) const void *data) { return daemon_wants(type); }
 
 #include "module.c"
 #include "pgroup.c"
@@ -266,6 +278,153 @@ START_TEST(multiple_host_expire)
 }
 END_TEST
 
+START_TEST(command_batch)
+{
+	merlin_event pkt = {{{0,},0,0,0,0,0,{0,},{0}},{0}};
+	nebstruct_external_command_data ds = {0,};
+	struct cmd_batch *b;
+	char *args[] = {
+		"host0;service0;1;0;0;someone;ack",
+		"host0;service0;1234567890",
+		"host1;service1;1234567890",
+	};
+	unsigned int i;
+
+	merlin_set_batch_commands(1);
+	ds.type = NEBTYPE_EXTERNALCOMMAND_START;
+	ds.entry_time = 1234567890;
+	for (i = 0; i < ARRAY_SIZE(args); i++) {
+		ds.command_type = i ? CMD_SCHEDULE_SVC_CHECK : CMD_ACKNOWLEDGE_SVC_PROBLEM;
+		ds.command_args = args[i];
+		hook_external_command(&pkt, &ds);
+	}
+	ck_assert_int_eq(1, cmd_batches_pending);
+	ck_assert_msg(cmd_batch_evt != NULL, "Pending commands should schedule a flush");
+
+	/* neither host has a poller, so the batch is for peers and masters */
+	b = &cmd_batch[cmd_batches - 1];
+	b->pkt->hdr.type = CMD_BATCH_PACKET;
+	b->pkt->hdr.len = b->len;
+	commands_run = 0;
+	ck_assert_int_eq(3, handle_command_batch(node_table[0], b->pkt));
+	ck_assert_int_eq(3, commands_run);
+	ck_assert_str_eq(args[2], last_command_args);
+
+	/* truncated batches run what's complete and no more */
+	b->pkt->hdr.len = b->len - 8;
+	commands_run = 0;
+	ck_assert_int_eq(2, handle_command_batch(node_table[0], b->pkt));
+
+	cmd_batch_flush_event(&to_timed_event(NULL));
+	ck_assert_int_eq(0, cmd_batches_pending);
+	ck_assert_msg(cmd_batch_evt == NULL, "Flushing should forget the flush event");
+	merlin_set_batch_commands(0);
+}
+END_TEST
+
+START_TEST(status_dupes)
+{
+	merlin_event a, b;
+	uint64_t ha, hb;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.hdr.type = b.hdr.type = NEBCALLBACK_HOST_STATUS_DATA;
+	a.hdr.object_id = b.hdr.object_id = 1;
+	a.hdr.len = b.hdr.len = 16;
+	strcpy(a.body, "acked");
+	strcpy(b.body, "not acked");
+	ha = packet_hash(&a);
+	hb = packet_hash(&b);
+	ck_assert_msg(ha != hb, "Different packets should hash differently");
+
+	num_objects.hosts = 2;
+	merlin_set_suppress_dupes(1);
+	check_dupes = 1;
+	ck_assert_int_eq(0, is_dupe(&a, ha));
+	remember_packet(&a, ha);
+	ck_assert_msg(is_dupe(&a, ha), "Back-to-back duplicate should be caught");
+	ck_assert_int_eq(1, merlin_dupe_hits(NEBCALLBACK_HOST_STATUS_DATA));
+	ck_assert_int_eq(0, is_dupe(&b, hb));
+	remember_packet(&b, hb);
+	ck_assert_msg(!is_dupe(&a, ha), "Status going back to what it was must be sent");
+	remember_packet(&a, ha);
+
+	/* the same packet for another host isn't a dupe */
+	a.hdr.object_id = 2;
+	ck_assert_int_eq(0, is_dupe(&a, ha));
+
+	merlin_set_suppress_dupes(0);
+	a.hdr.object_id = 1;
+	ck_assert_int_eq(0, is_dupe(&a, ha));
+	check_dupes = 0;
+	merlin_set_suppress_dupes(1);
+	num_objects.hosts = 0;
+}
+END_TEST
+
+START_TEST(comment_index_keys)
+{
+	nebstruct_comment_data a = {0,}, b = {0,}, c = {0,};
+	struct comment_ref *ref;
+	unsigned int n;
+
+	comment_index_init(NULL);
+	a.host_name = b.host_name = c.host_name = "host0";
+	a.service_description = b.service_description = "service0";
+	a.author_name = b.author_name = c.author_name = "someone";
+	a.entry_time = b.entry_time = c.entry_time = 1234567890;
+	a.comment_type = b.comment_type = SERVICE_COMMENT;
+	c.comment_type = HOST_COMMENT;
+	a.comment_id = 1;
+	b.comment_id = 2;
+	c.comment_id = 3;
+	comment_index_add(&a);
+	comment_index_add(&b);
+	comment_index_add(&c);
+	ck_assert_int_eq(3, comment_index_size());
+
+	for (n = 0, ref = comment_index_lookup(&a); ref; ref = ref->next, n++)
+		ck_assert_msg(ref->comment_id != 3, "Host comment should not share key with service comment");
+	ck_assert_int_eq(2, n);
+
+	comment_index_remove(&b);
+	ref = comment_index_lookup(&a);
+	ck_assert_msg(ref && ref->comment_id == 1 && !ref->next, "Only comment 1 should remain for the service");
+	comment_index_remove(&a);
+	ck_assert_msg(comment_index_lookup(&a) == NULL, "Service should have no comments left");
+	ref = comment_index_lookup(&c);
+	ck_assert_msg(ref && ref->comment_id == 3, "Host comment should still be indexed");
+	ck_assert_int_eq(1, comment_index_size());
+	comment_index_deinit();
+}
+END_TEST
+
+START_TEST(latency_percentiles)
+{
+	merlin_histogram h;
+	unsigned long long v;
+
+	histogram_reset(&h);
+	ck_assert_int_eq(0, histogram_percentile(&h, 99));
+	for (v = 1; v <= 1000; v++)
+		histogram_add(&h, v);
+	ck_assert_int_eq(1000, h.count);
+	ck_assert_int_eq(1000, h.max);
+	/* buckets are at most 1/8th of their value wide */
+	v = histogram_percentile(&h, 50);
+	ck_assert_msg(v >= 500 && v <= 500 + 500 / 8, "p50 of 1..1000 should be close to 500, got %llu", v);
+	v = histogram_percentile(&h, 90);
+	ck_assert_msg(v >= 900 && v <= 900 + 900 / 8, "p90 of 1..1000 should be close to 900, got %llu", v);
+	ck_assert_int_eq(1000, histogram_percentile(&h, 100));
+
+	histogram_add(&h, 1ULL << 50);
+	ck_assert_msg(histogram_percentile(&h, 100) == 1ULL << 50, "Huge values should be kept as max");
+	histogram_reset(&h);
+	ck_assert_int_eq(0, h.count);
+}
+END_TEST
+
 Suite *
 check_hooks_suite(void)
 {
@@ -278,6 +437,19 @@ check_hooks_suite(void)
 	tcase_add_test(tc, set_clear_svc_expire);
 	tcase_add_test(tc, multiple_host_expire);
 	tcase_add_test(tc, multiple_svc_expire);
+	tcase_add_test(tc, command_batch);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("dupes");
+	tcase_add_test(tc, status_dupes);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("comments");
+	tcase_add_test(tc, comment_index_keys);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("latency");
+	tcase_add_test(tc, latency_percentiles);
 	suite_add_tcase(s, tc);
 
 	return s;
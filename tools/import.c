@@ -1064,19 +1064,24 @@ int main(int argc, char **argv)
 		nagios_cfg = "/opt/monitor/etc/nagios.cfg";
 	}
 	if (nagios_cfg) {
-		struct cfg_comp *conf;
-		uint vi;
-
-		conf = cfg_parse_file(nagios_cfg);
-		for (vi = 0; vi < conf->vars; vi++) {
-			struct cfg_var *v = conf->vlist[vi];
-			if (!strcmp(v->key, "log_file")) {
-				add_naglog_path(v->value);
-			}
-			if (!strcmp(v->key, "log_archive_path")) {
-				add_naglog_path(v->value);
-			}
+		struct cfg_iter it;
+		int type;
+
+		if (cfg_iter_open(&it, nagios_cfg) < 0)
+			crash("Failed to parse nagios' main config file '%s'", nagios_cfg);
+		while ((type = cfg_iter_next(&it)) != CFG_EOF) {
+			char *path;
+
+			if (type != CFG_VAR || it.depth || !it.value.str)
+				continue;
+			if (!cfg_span_is(&it.key, "log_file") &&
+			    !cfg_span_is(&it.key, "log_archive_path"))
+				continue;
+			path = strndup(it.value.str, it.value.len);
+			add_naglog_path(path);
+			free(path);
 		}
+		cfg_iter_close(&it);
 	}
 
 	if (!list_files && use_database && (!truncate_db && !incremental)) {
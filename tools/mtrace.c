@@ -0,0 +1,213 @@
+/*
+ * Reads the packet trace files written by the module and merlind
+ * (see shared/trace.h) and prints latency histograms, showing how
+ * long it takes for events to reach each stage after they were
+ * first sent from the hook that created them.
+ *
+ * Records for the same event are matched up by the hash of their
+ * packet body, so trace files from several nodes can be combined,
+ * as long as their clocks are in sync.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared.h"
+#include "trace.h"
+#include "histogram.h"
+
+#define NUM_ROWS 41 /* powers of 2, in microseconds */
+
+/* a new event starts if the same packet shows up again after this */
+#define MAX_EVENT_GAP (60 * 1000000000ULL)
+
+static merlin_histogram stage_hist[TRACE_NUM_STAGES];
+static merlin_histogram type_hist[NEBCALLBACK_NUMITEMS + 2];
+static struct trace_record *records;
+static size_t num_records, alloc_records;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mtrace <trace-file>...\n");
+	fprintf(stderr, "Trace files are created when trace_file is set in merlin.conf\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Prints the percentiles and a bar chart with one row per power of
+ * two, which is coarser than the histogram's own buckets.
+ */
+static void hist_print(const char *name, const merlin_histogram *h)
+{
+	unsigned long long rows[NUM_ROWS];
+	unsigned int i, first = NUM_ROWS, last = 0;
+
+	if (!h->count)
+		return;
+
+	printf("%s: %llu events, avg %.3fms, p50 %lluus, p90 %lluus, p99 %lluus, max %.3fms\n",
+	       name, h->count, (double)h->sum / h->count / 1000.0,
+	       histogram_percentile(h, 50), histogram_percentile(h, 90),
+	       histogram_percentile(h, 99), (double)h->max / 1000.0);
+
+	memset(rows, 0, sizeof(rows));
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		unsigned long long limit = histogram_bucket_limit(i);
+		unsigned int row = 0;
+
+		if (!h->bucket[i])
+			continue;
+		while (limit >> row && row < NUM_ROWS - 1)
+			row++;
+		rows[row] += h->bucket[i];
+		if (row < first)
+			first = row;
+		if (row > last)
+			last = row;
+	}
+	for (i = first; i <= last; i++) {
+		unsigned int x, width = rows[i] * 50 / h->count;
+		printf("  <%10lluus %10llu |", 1ULL << i, rows[i]);
+		for (x = 0; x < width; x++)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+static int read_trace_file(const char *path)
+{
+	struct trace_file_header *hdr;
+	struct trace_record *r;
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "'%s' is not a merlin trace file\n", path);
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap() '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (hdr->magic != TRACE_MAGIC || hdr->record_size != sizeof(*r) ||
+	    sizeof(*hdr) + (size_t)hdr->num_records * sizeof(*r) > (size_t)st.st_size)
+	{
+		fprintf(stderr, "'%s' is not a merlin trace file, or is from another version\n", path);
+		munmap(hdr, st.st_size);
+		return -1;
+	}
+
+	printf("%s: %s pid %u, %llu records written, %u kept\n", path,
+	       hdr->is_module ? "module" : "daemon", hdr->pid,
+	       (unsigned long long)hdr->head,
+	       hdr->head < hdr->num_records ? (uint32_t)hdr->head : hdr->num_records);
+
+	if (num_records + hdr->num_records > alloc_records) {
+		alloc_records = num_records + hdr->num_records;
+		records = realloc(records, alloc_records * sizeof(*records));
+		if (!records) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r = (struct trace_record *)(hdr + 1);
+	for (i = 0; i < hdr->num_records; i++) {
+		if (!r[i].when || r[i].stage >= TRACE_NUM_STAGES)
+			continue;
+		records[num_records++] = r[i];
+	}
+
+	munmap(hdr, st.st_size);
+	return 0;
+}
+
+static int record_cmp(const void *a_, const void *b_)
+{
+	const struct trace_record *a = a_, *b = b_;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	if (a->when != b->when)
+		return a->when < b->when ? -1 : 1;
+	return a->stage - b->stage;
+}
+
+/*
+ * Records for one event are adjacent once sorted. Identical packets
+ * sent at different times (like a status that didn't change) get
+ * the same key, so a new hook_send or a long pause starts a new event.
+ */
+static void process_event(struct trace_record *first, size_t n)
+{
+	size_t i;
+	unsigned int type;
+
+	if (n < 2)
+		return;
+
+	for (i = 1; i < n; i++)
+		histogram_add(&stage_hist[first[i].stage], (first[i].when - first->when) / 1000);
+
+	type = first->type <= NEBCALLBACK_NUMITEMS ? first->type : NEBCALLBACK_NUMITEMS + 1;
+	histogram_add(&type_hist[type], (first[n - 1].when - first->when) / 1000);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i, start = 0;
+	int n;
+
+	if (argc < 2)
+		usage();
+
+	for (n = 1; n < argc; n++) {
+		if (!strcmp(argv[n], "--help") || !strcmp(argv[n], "-h"))
+			usage();
+		if (read_trace_file(argv[n]) < 0)
+			return EXIT_FAILURE;
+	}
+
+	if (!num_records) {
+		printf("No trace records found\n");
+		return EXIT_SUCCESS;
+	}
+
+	qsort(records, num_records, sizeof(*records), record_cmp);
+	for (i = 1; i <= num_records; i++) {
+		if (i < num_records && records[i].key == records[start].key &&
+		    records[i].stage != TRACE_HOOK_SEND &&
+		    records[i].when - records[i - 1].when < MAX_EVENT_GAP)
+		{
+			continue;
+		}
+		process_event(&records[start], i - start);
+		start = i;
+	}
+
+	printf("\nTime from first record to each stage\n");
+	for (n = 1; n < TRACE_NUM_STAGES; n++)
+		hist_print(trace_stage_name(n), &stage_hist[n]);
+
+	printf("\nEnd-to-end latency per event type\n");
+	for (n = 0; n <= NEBCALLBACK_NUMITEMS + 1; n++)
+		hist_print(n > NEBCALLBACK_NUMITEMS ? "other" : callback_name(n), &type_hist[n]);
+
+	free(records);
+	return EXIT_SUCCESS;
+}